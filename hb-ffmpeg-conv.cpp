@@ -8,12 +8,40 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <filesystem>
 #include <cstdlib>
 #include <algorithm>
 #include <memory>
+#include <sstream>
+#include <cmath>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <limits>
+#include <atomic>
+#include <cerrno>
 #include <nlohmann/json.hpp>
 
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/mempolicy.h>
+#endif
+
 namespace fs = std::filesystem;
 using json = nlohmann::json;
 
@@ -31,42 +59,326 @@ struct Settings {
     std::string video_bitrate;
     std::string video_preset;
     std::string video_profile;
+    std::string video_tune;            // may list several, e.g. "film,fastdecode"
+    std::string video_level;
+    std::string video_options;         // advanced encoder options, key=value:key=value
     std::string video_framerate;
     std::string video_quality;
     std::string video_quality_type;
     bool video_multipass;
     std::string picture_width;
     std::string picture_height;
+    bool picture_allow_upscaling = false;
+    bool picture_keep_ratio = true;
+    int picture_modulus = 2;
+    bool picture_auto_crop = false;
+    int picture_crop[4] = {0, 0, 0, 0};  // top, bottom, left, right
+    std::string picture_deinterlace_filter;
+    std::string picture_deinterlace_preset;
+    std::string picture_detelecine;
+    std::string picture_denoise_filter;
+    std::string picture_denoise_preset;
+    std::string picture_deblock_preset;
+    std::string picture_deblock_tune;
+    std::string picture_sharpen_filter;
+    std::string picture_sharpen_preset;
+    std::string picture_chroma_smooth_preset;
+    std::string picture_chroma_smooth_tune;
+    std::string picture_colorspace_preset;
+    bool picture_grayscale = false;
+    std::string picture_rotate;
     std::string audio_encoder;
     std::string audio_bitrate;
     std::string audio_mixdown;
+    double audio_gain = 0.0;           // dB
+    double audio_drc = -1.0;           // AC-3 dynamic range compression, -1 = not set
+    bool audio_normalize_mix = false;  // downmixes can't clip
     std::string container;
 };
 
+// Loudness of one audio track as EBU R128 measures it, see read_loudness()
+struct Loudness {
+    double integrated = 0.0;  // LUFS
+    double true_peak = 0.0;   // dBTP
+    double range = 0.0;       // LU
+};
+
+// How one HandBrake video encoder maps onto ffmpeg. Preset, tune and
+// profile names are HandBrake's; presets are translated when emitted.
+struct EncoderInfo {
+    std::string codec;            // ffmpeg encoder
+    std::string pix_fmt;          // output pixel format, empty = keep the source's
+    std::string quality_option;   // constant quality, empty = lossless only
+    std::string quality_extra;    // rate control options constant quality needs, e.g. " -b:v 0"
+    int quality_max;              // top of the quality scale
+    std::string params_option;    // key=value list option, empty = none
+    std::string preset_option;    // empty = no preset vocabulary in ffmpeg
+    std::vector<std::pair<std::string, std::string>> presets;  // HandBrake name -> ffmpeg value, slowest first
+    std::string default_preset;
+    std::vector<std::string> tunes;
+    std::vector<std::string> profiles;
+    bool two_pass;                // -pass 1/2 rate control
+    double speed;                 // work per frame at the default preset, x264 medium = 1
+};
+
+// What the installed ffmpeg's build of one encoder accepts, from
+// `ffmpeg -h encoder=...`
+struct EncoderCapabilities {
+    bool known = false;        // help could be read
+    bool available = false;
+    std::vector<std::string> pix_fmts;
+    std::map<std::string, std::vector<std::string>> options;  // name -> named values, empty = free form
+};
+
 struct FFmpegParams {
     std::string vcodec;
+    std::string encoder_name;     // HandBrake encoder ID, tells bit depths apart; empty = by vcodec
+    std::string pix_fmt;          // empty = the encoder's choice
     std::string acodec;
     std::string audio_channels;
     std::string quality;
     std::string format;
     std::string preset;
+    std::string requested_preset; // what --deadline replaced preset for, empty = not replaced
     std::string profile;
+    std::string tune;
+    std::string level;
     std::string framerate;
-    std::string resolution;
+    std::string resolution;       // output size, empty = the source's (no scaler)
+    int max_width = 0;            // preset's picture box, 0 = no limit
+    int max_height = 0;
+    bool allow_upscaling = false;
+    bool keep_aspect = true;      // fit into the box; otherwise stretch to it
+    int modulus = 2;              // output sides are multiples of this
     bool multipass;
     std::string preset_name;
+    int threads;                  // 0 = let the encoder decide
+    std::string encoder_options;  // key=value list for the encoder's params option (-x265-params...)
+    std::vector<std::string> encoder_flags;  // parallelism options of encoders without a params list
+    std::string passlogfile;      // per-job two-pass log prefix
+    std::vector<std::string> extra_formats;  // more containers written from the same encode
+    std::string analysis_cache;              // x265 analysis reuse directory, empty = off
+    long long analysis_cache_limit = 0;      // bytes kept in analysis_cache
+    bool auto_crop = false;                  // detect black bars per file
+    int crop[4] = {0, 0, 0, 0};              // top, bottom, left, right in source pixels
+    std::string crop_filter;                 // crop applied ahead of scaling, empty = none
+    std::string deinterlacer;                // bwdif or yadif for interlaced sources, empty = never
+    std::string deinterlace_mode;            // send_frame, or send_field to keep the field rate
+    bool detelecine = false;                 // inverse telecine for telecined sources
+    std::string field_filter;                // per file deinterlace or inverse telecine, empty = none
+    std::string deblock_filter;              // runs at source size, on the source's blocks
+    std::string denoise_filter;              // runs at the smaller of source and output size
+    std::vector<std::string> output_filters; // sharpen, chroma smooth, colour, rotation: at output size
+    bool rotate_quarter = false;             // rotation by 90 or 270 degrees swaps width and height
+    int source_width = 0;                    // per file, after cropping; 0 = unknown
+    int source_height = 0;
+    double audio_gain = 0.0;                 // dB, applied ahead of the downmix
+    double drc_scale = -1.0;                 // AC-3 decoder compression, -1 = decoder default
+    bool normalize_mix = false;              // keep downmixes from clipping
+    double loudness_target = 0.0;            // integrated LUFS for loudnorm, 0 = off
+    std::vector<Loudness> loudness;          // per audio track, measured from the source
+    std::string loudness_log;                // measure into <prefix>-<track>.log instead of normalizing
+    int audio_tracks = 0;                    // per file, from the probe
+    bool split_audio = false;                // per file: each audio track encoded by a process of its own
+    std::string source_file;                 // per file: the input as found when a staged copy is read
+    std::string checkpoint_dir;              // per file: segments and state, empty = next to the output
+};
+
+// Stream details of an input file as reported by ffprobe
+struct MediaInfo {
+    bool valid = false;
+    double duration = 0.0;
+    int width = 0;                  // as the filters see it, turned upright by its rotation
+    int height = 0;
+    double framerate = 0.0;
+    double sample_aspect = 1.0;     // pixel aspect ratio of the video
+    double start_time = 0.0;        // container start
+    double video_start_time = 0.0;  // first video timestamp
+    double video_duration = 0.0;    // the video stream's own, 0 = not reported
+    int rotation = 0;               // display rotation, 0/90/180/270 degrees counterclockwise
+    std::string video_codec;
+    std::string field_order;        // tff or bff when the stream says it is interlaced
+    std::string field_type;         // progressive, interlaced or telecined; empty = not checked
+    int audio_streams = 0;
+    std::vector<std::string> audio_codecs;
+    std::vector<double> audio_start_times;
+    std::vector<std::string> audio_dispositions;  // ffmpeg -disposition values, "0" = none
+    std::vector<std::string> subtitle_codecs;
+    uintmax_t file_size = 0;
+};
+
+// CPU layout used to place concurrent jobs
+struct CpuTopology {
+    std::vector<int> cpus;        // usable CPUs in id order
+    std::map<int, int> node_of;   // cpu -> NUMA node
+    std::map<int, int> l3_of;     // cpu -> L3 domain (lowest cpu id sharing the cache)
+    int node_count = 1;
+};
+
+// How a job's ffmpeg processes are started
+struct ExecContext {
+    std::vector<int> cpus;    // pin to these CPUs (empty = no pinning)
+    std::vector<int> nodes;   // NUMA nodes for the memory policy (empty = kernel default)
+    bool null_stdin = false;  // keep concurrent ffmpegs away from the terminal
+    bool idle_io = false;     // idle I/O class: disk time only when nobody else wants it
+    std::shared_ptr<std::atomic<long long>> cpu_usec;  // child CPU time is added here when set
+    std::shared_ptr<std::atomic<long long>> max_rss;   // peak RSS of the job's ffmpegs at once in bytes, when set
+    std::shared_ptr<std::atomic<int>> children;        // the job's alike ffmpegs running now, when set
+};
+
+// One unit of work for the job queue
+struct Job {
+    std::string input_file;
+    MediaInfo media;
+    FFmpegParams params;
+    ExecContext exec;
+    double weight = 1.0;      // relative encoder cost, used for thread budgeting
+    double cost = 0.0;        // estimated total encode work, used for ordering
+    double predicted_cpu = 0.0;  // CPU seconds according to the throughput model
+    int concurrency = 1;      // jobs running when this one started, itself included
+    int threads = 0;          // thread budget assigned at dispatch (0 = unlimited)
+    int result = 0;
+    std::function<int(Job&)> run;
+    std::vector<Job> batch;   // clips encoded together by this job, each with its own result
+    std::set<unsigned long long> devices;  // st_dev of the input and output, for per-device limits
+    std::string output_base;     // outputs are named after this, see get_output_base()
+    uintmax_t predicted_bytes = 0;  // expected output size, 0 = no free space check
+    uintmax_t predicted_rss = 0;    // expected peak resident memory, 0 = not counted
+    uintmax_t estimated_rss = 0;    // estimate_peak_rss for the whole job, 0 = not one encode to learn from
+};
+
+// Encode speeds learned from earlier runs, see load_throughput_model()
+struct ThroughputModel {
+    std::map<std::string, std::pair<double, double>> settings;  // encoder/preset -> 1080p frames, CPU seconds
+    std::map<std::string, std::pair<double, double>> sizes;     // setting and quality -> 1080p frames, bytes
+    std::map<std::string, std::pair<double, double>> memory;    // encoder -> estimated, observed peak RSS
+    double normalized_speed = 10.0;  // 1080p x264 medium frames per CPU second; a guess until there is history
+    double utilization = 0.85;       // CPU seconds per thread second that encodes actually reach
+    double cpu_seconds = 0.0;
+    int runs = 0;
+};
+
+// Inputs copied to local scratch ahead of the jobs that read them, within
+// a byte budget. Each staged input also reserves room for its job's
+// output, which is written to scratch and moved into place when done.
+struct ScratchStage {
+    std::string dir;
+    std::string input_root;       // staged copies keep their path below this
+    uintmax_t budget = 0;
+    uintmax_t reserved = 0;
+    std::vector<std::string> queue;                  // inputs, those the scheduler starts next first
+    std::map<std::string, std::string> staged;       // input -> local copy, empty = read in place
+    std::map<std::string, uintmax_t> reservations;
+    std::map<std::string, std::string> output_dirs;  // input -> directory its job writes to
+    std::string copying;          // input being copied, outside the lock
+    bool idle_io = false;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+struct SchedulerOptions {
+    int max_jobs = 1;
+    int total_cpus = 1;
+    bool pin_cpus = false;    // give each job a disjoint CPU set
+    CpuTopology topology;
+    bool prefetch_inputs = false;  // job inputs are files to read ahead
+    std::function<bool(const Job&)> reads_local;  // the job reads a local scratch copy, nothing to read ahead
+    std::function<void(const Job&)> on_next;      // told the job expected to start next
+    std::function<void(const Job&)> on_rejected;  // told a job that failed before it started
+    std::function<std::string(const Job&)> writes_to;  // output base a job writes while running, if not its own
+    int max_per_device = 0;        // jobs reading or writing one device at a time, 0 = no limit
+    uintmax_t memory_budget = 0;   // bytes the running jobs' peak RSS may add up to, 0 = no limit
+    bool label_output = false;     // prefix each job's lines with its file name
+    bool verbose = false;
+};
+
+// Prefix for the lines the calling thread writes to std::cout
+thread_local std::string output_prefix;
+thread_local std::string output_line;
+
+// Hands std::cout on in whole lines, each in one locked write with its
+// thread's prefix, so the output of concurrent jobs doesn't interleave
+// mid-line
+class LineOutput : public std::streambuf {
+public:
+    explicit LineOutput(std::streambuf* target) : target_(target) {}
+
+protected:
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            output_line += static_cast<char>(c);
+            if (c == '\n') {
+                std::lock_guard<std::mutex> guard(mutex_);
+                std::string line = output_prefix + output_line;
+                target_->sputn(line.data(), static_cast<std::streamsize>(line.size()));
+                output_line.clear();
+            }
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* text, std::streamsize count) override {
+        for (std::streamsize i = 0; i < count; ++i) {
+            overflow(static_cast<unsigned char>(text[i]));
+        }
+        return count;
+    }
+
+    // Partial lines stay buffered until their newline
+    int sync() override {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return target_->pubsync();
+    }
+
+private:
+    std::streambuf* target_;
+    std::mutex mutex_;
 };
 
 // Function prototypes
 void show_usage(const char* progname);
+int run_self_tests();
 Settings extract_preset_settings(const json& preset_data);
+void compile_picture_filters(const Settings& settings, FFmpegParams& ffmpeg_params);
+const std::map<std::string, EncoderInfo>& encoder_table();
+const EncoderInfo* find_encoder(const std::string& name);
+const EncoderInfo* find_encoder(const FFmpegParams& ffmpeg_params);
+std::string encoder_preset_value(const EncoderInfo& encoder, const std::string& preset);
+bool uses_two_pass(const FFmpegParams& ffmpeg_params);
 FFmpegParams convert_to_ffmpeg_params(const Settings& settings);
+EncoderCapabilities probe_encoder_capabilities(const std::string& codec, const std::string& cache_file);
+void check_encoder_capabilities(FFmpegParams& ffmpeg_params, const std::string& cache_file);
 void show_preset(const FFmpegParams& ffmpeg_params, const std::string& output_format,
                 int analyze_duration, int probe_size);
 bool should_ignore_file(const std::string& file_path, const std::string& ignore_flag);
 std::string format_filename(const std::string& basename, bool replace_underscores);
 bool check_file_access(const std::string& file_path);
 std::string get_null_device();
+std::vector<std::string> video_filters(const FFmpegParams& ffmpeg_params, bool before_scale);
+std::string scale_filter(const FFmpegParams& ffmpeg_params);
+std::string video_filter_chain(const FFmpegParams& ffmpeg_params, bool force_scale);
+void append_video_options(std::vector<std::string>& cmd, const FFmpegParams& ffmpeg_params);
+void append_output(std::vector<std::string>& cmd, const std::string& output_file, const FFmpegParams& ffmpeg_params);
+std::string audio_filter_chain(const FFmpegParams& ffmpeg_params, int track);
+void append_audio_options(std::vector<std::string>& cmd, const FFmpegParams& ffmpeg_params);
+void append_audio_input_options(std::vector<std::string>& cmd, const FFmpegParams& ffmpeg_params);
+void set_loudness_target(FFmpegParams& ffmpeg_params, double target);
+bool is_mp4_family(const std::string& format);
+void map_side_streams(std::vector<std::string>& cmd, const std::string& input, const std::string& output_file);
+bool is_text_subtitle(const std::string& codec);
+bool audio_fits_container(const std::string& format, const FFmpegParams& ffmpeg_params, const MediaInfo& media);
+bool tee_can_write(const std::string& primary_format, const std::string& format,
+                   const FFmpegParams& ffmpeg_params, const MediaInfo& media);
+void split_extra_formats(const std::string& primary_format, FFmpegParams& ffmpeg_params, const MediaInfo& media,
+                         std::vector<std::string>& remux_formats);
+std::vector<std::string> build_remux_command(const std::string& primary_file, const std::string& format,
+                                             const FFmpegParams& ffmpeg_params, const MediaInfo& media,
+                                             bool verbose);
+void drop_unsupported_containers(FFmpegParams& ffmpeg_params);
+int remux_containers(const std::string& primary_file, const std::vector<std::string>& formats,
+                     const FFmpegParams& ffmpeg_params, const MediaInfo& media,
+                     bool verbose, bool execute, const ExecContext& exec);
 std::vector<std::string> build_ffmpeg_command(const std::string& input_file,
                                              const std::string& output_file,
                                              const FFmpegParams& ffmpeg_params,
@@ -84,6 +396,37 @@ void get_file_info(const std::string& file_path);
 std::vector<std::string> find_media_files(const std::string& directory,
                                          bool recursive,
                                          const std::vector<std::string>& extensions);
+fs::path get_output_base(const std::string& input_file, const std::string& media_dir,
+                         const std::string& output_dir, bool replace_underscores);
+bool prepare_output_dir(const fs::path& output_subdir, bool dry_run);
+bool copy_file_contents(const std::string& from, const std::string& to);
+fs::path staged_path(const std::string& input, const std::string& input_root);
+uintmax_t stage_need(const std::string& input);
+void stage_inputs(ScratchStage& stage, bool verbose);
+void promote_stage(ScratchStage& stage, const std::string& input_file);
+std::string wait_for_stage(ScratchStage& stage, const std::string& input_file);
+void release_stage(ScratchStage& stage, const std::string& input_file);
+int move_outputs(const fs::path& from, const fs::path& to);
+std::vector<std::string> build_batch_command(const std::vector<std::string>& input_files,
+                                             const std::vector<std::string>& output_files,
+                                             const std::vector<FFmpegParams>& params,
+                                             int analyze_duration,
+                                             int probe_size,
+                                             bool verbose);
+int process_batch(std::vector<Job>& members,
+                  const std::string& media_dir,
+                  const std::string& output_dir,
+                  const std::string& original_format,
+                  const std::string& output_format,
+                  bool force_m4v,
+                  bool execute,
+                  bool dry_run,
+                  bool replace_underscores,
+                  int analyze_duration,
+                  int probe_size,
+                  bool verbose,
+                  const ExecContext& exec,
+                  int threads);
 int process_file(const std::string& input_file,
                 const std::string& media_dir,
                 const std::string& output_dir,
@@ -96,14 +439,231 @@ int process_file(const std::string& input_file,
                 bool replace_underscores,
                 int analyze_duration,
                 int probe_size,
-                bool verbose);
+                bool verbose,
+                const ExecContext& exec,
+                const MediaInfo& media,
+                int chunk_count,
+                double checkpoint_seconds,
+                const std::vector<FFmpegParams>& renditions);
 std::vector<std::string> split_string(const std::string& s, char delimiter);
+std::vector<std::string> split_encoder_options(const std::string& options);
+std::string escape_encoder_value(const std::string& value);
 std::string join_string(const std::vector<std::string>& elements, const std::string& delimiter);
 std::string escape_string(const std::string& s);
-int execute_command(const std::vector<std::string>& cmd, bool verbose);
+int execute_command(const std::vector<std::string>& cmd, bool verbose, const ExecContext& exec);
+int read_command_output(const std::vector<std::string>& cmd, std::string& output);
+double parse_rational(const std::string& value);
+int display_rotation(const json& stream);
+MediaInfo probe_media(const std::string& file_path, int analyze_duration, int probe_size);
+int get_available_cpus();
+uintmax_t parse_mem_available(std::istream& meminfo);
+std::string parse_cgroup_path(std::istream& cgroup);
+uintmax_t cgroup_memory_left(const std::string& limit, const std::string& usage);
+uintmax_t get_available_memory(std::string& source);
+double resolution_weight(int width, int height);
+void get_output_dimensions(const FFmpegParams& ffmpeg_params, const MediaInfo& media, int& width, int& height);
+double encoder_speed_factor(const FFmpegParams& ffmpeg_params);
+double estimate_encode_cost(const FFmpegParams& ffmpeg_params, const MediaInfo& media, const std::string& input_file);
+fs::path get_user_dir(const char* xdg_variable, const std::string& home_fallback);
+std::string speed_model_key(const FFmpegParams& ffmpeg_params);
+ThroughputModel load_throughput_model(const std::string& stats_file);
+double predict_cpu_seconds(const ThroughputModel& model, const FFmpegParams& ffmpeg_params, double cost);
+std::string size_model_key(const FFmpegParams& ffmpeg_params);
+uintmax_t predict_output_bytes(const ThroughputModel& model, const FFmpegParams& ffmpeg_params,
+                               const MediaInfo& media, double cost, bool in_parts);
+uintmax_t estimate_peak_rss(const FFmpegParams& ffmpeg_params, const MediaInfo& media);
+uintmax_t predict_peak_rss(const ThroughputModel& model, const FFmpegParams& ffmpeg_params, const MediaInfo& media);
+double project_wall_seconds(std::vector<double> cpu_seconds, int max_jobs, int total_cpus, double utilization);
+std::string format_duration(double seconds);
+std::string govern_preset(const FFmpegParams& ffmpeg_params, const std::string& requested, double speedup);
+bool parse_deadline(const std::string& value, std::chrono::system_clock::time_point& deadline);
+void append_json_line(const std::string& file, const json& record);
+void record_job_stats(const std::string& stats_file, const json& record);
+int plan_job_threads(double weight, double running_weight, int running_jobs, int slots, int total_cpus);
+void set_encoder_option(FFmpegParams& ffmpeg_params, const std::string& key, const std::string& value);
+void apply_thread_budget(FFmpegParams& ffmpeg_params, int threads, int width, int height);
+std::vector<int> parse_cpu_list(const std::string& list);
+std::string format_cpu_list(const std::vector<int>& cpus);
+CpuTopology read_cpu_topology();
+std::vector<int> allocate_cpus(const CpuTopology& topology, std::set<int>& free_cpus, int count);
+fs::path nearest_existing(const fs::path& path);
+unsigned long long device_of(const fs::path& path);
+uintmax_t available_space(const fs::path& path);
+bool is_rotational(unsigned long long device);
+void set_idle_io_priority();
+void prefetch_file(const std::string& path, off_t length);
+void drop_cached_file(const std::string& path, bool sync);
+bool is_job_output(const std::string& name, const std::string& base);
+std::vector<std::string> recent_outputs(const fs::path& output_base, fs::file_time_type since);
+int run_job_queue(std::vector<Job>& jobs, const SchedulerOptions& options);
+bool probe_video_packets(const std::string& file_path, std::vector<std::string>& keyframes, long& frame_count);
+std::string input_seek_time(const std::string& pts, const MediaInfo& media);
+std::vector<std::string> plan_chunk_boundaries(const std::vector<std::string>& keyframes, const MediaInfo& media,
+                                               int chunk_count);
+long count_video_frames(const std::string& file_path);
+std::vector<std::vector<std::string>> build_segment_commands(const std::string& input_file,
+                                                             const std::string& segment_file,
+                                                             const FFmpegParams& ffmpeg_params,
+                                                             const std::string& start,
+                                                             const std::string& end,
+                                                             int analyze_duration,
+                                                             int probe_size,
+                                                             bool verbose);
+std::vector<std::string> build_join_command(const std::string& input_file,
+                                            const std::string& list_file,
+                                            const std::string& output_file,
+                                            const FFmpegParams& ffmpeg_params,
+                                            const MediaInfo& media,
+                                            const std::string& video_start,
+                                            int analyze_duration,
+                                            int probe_size,
+                                            bool verbose);
+int join_segments(const std::string& input_file,
+                  const std::string& output_file,
+                  const std::vector<std::string>& segment_files,
+                  const FFmpegParams& ffmpeg_params,
+                  const MediaInfo& media,
+                  const std::string& video_start,
+                  long source_frames,
+                  const fs::path& work_dir,
+                  int analyze_duration,
+                  int probe_size,
+                  bool verbose,
+                  const ExecContext& exec);
+void print_command(const std::vector<std::string>& cmd);
+SchedulerOptions segment_scheduler(const FFmpegParams& ffmpeg_params, const ExecContext& exec,
+                                   int max_jobs, bool verbose);
+int encode_chunked(const std::string& input_file,
+                   const std::string& output_file,
+                   const FFmpegParams& ffmpeg_params,
+                   const MediaInfo& media,
+                   int chunk_count,
+                   int analyze_duration,
+                   int probe_size,
+                   bool verbose,
+                   bool execute,
+                   const ExecContext& exec);
+std::vector<std::string> build_audio_track_command(const std::string& input_file,
+                                                   const std::string& audio_file,
+                                                   const FFmpegParams& ffmpeg_params,
+                                                   int track,
+                                                   int analyze_duration,
+                                                   int probe_size,
+                                                   bool verbose);
+std::vector<std::string> build_split_mux_command(const std::string& input_file,
+                                                 const std::string& video_file,
+                                                 const std::vector<std::string>& audio_files,
+                                                 const std::string& output_file,
+                                                 const FFmpegParams& ffmpeg_params,
+                                                 const MediaInfo& media,
+                                                 int analyze_duration,
+                                                 int probe_size,
+                                                 bool verbose);
+int encode_split(const std::string& input_file,
+                 const std::string& output_file,
+                 const FFmpegParams& ffmpeg_params,
+                 const MediaInfo& media,
+                 int analyze_duration,
+                 int probe_size,
+                 bool verbose,
+                 bool execute,
+                 const ExecContext& exec);
+std::vector<double> sample_windows(const MediaInfo& media, int count, double window);
+std::string format_seconds(double seconds);
+std::string format_number(double value, int decimals);
+int run_sample_jobs(const std::string& input_file, const std::string& label, int count,
+                    const FFmpegParams& ffmpeg_params, const MediaInfo& media, const ExecContext& exec, bool verbose,
+                    const std::function<std::vector<std::vector<std::string>>(int, const FFmpegParams&)>& build);
+bool read_metric_log(const std::string& log_file, const std::string& field, double& sum, long& frames);
+bool search_crf(FFmpegParams& ffmpeg_params,
+                const std::string& input_file,
+                const MediaInfo& media,
+                const std::string& metric,
+                double target,
+                int analyze_duration,
+                int probe_size,
+                bool verbose,
+                bool execute,
+                const ExecContext& exec);
+void apply_crop(FFmpegParams& ffmpeg_params, const MediaInfo& media);
+void fit_output_size(FFmpegParams& ffmpeg_params, const MediaInfo& media);
+bool detect_crop(FFmpegParams& ffmpeg_params,
+                 const std::string& input_file,
+                 const MediaInfo& media,
+                 int analyze_duration,
+                 int probe_size,
+                 bool verbose,
+                 bool execute,
+                 const ExecContext& exec);
+void apply_field_filter(FFmpegParams& ffmpeg_params, const MediaInfo& media);
+bool detect_field_type(FFmpegParams& ffmpeg_params,
+                       const std::string& input_file,
+                       MediaInfo& media,
+                       const std::string& cache_file,
+                       int analyze_duration,
+                       int probe_size,
+                       bool verbose,
+                       bool execute,
+                       const ExecContext& exec);
+std::string loudness_log_prefix(const std::string& input_file);
+bool read_loudness(const std::string& log_prefix, int tracks, int first_track, const std::string& input_file,
+                   const FFmpegParams& ffmpeg_params, std::vector<Loudness>& loudness);
+bool measure_loudness(const FFmpegParams& ffmpeg_params,
+                      const std::string& input_file,
+                      const MediaInfo& media,
+                      int track,
+                      std::vector<Loudness>& loudness,
+                      int analyze_duration,
+                      int probe_size,
+                      bool verbose,
+                      bool execute,
+                      const ExecContext& exec);
+std::string encode_settings_signature(const FFmpegParams& ffmpeg_params);
+std::vector<std::string> plan_checkpoint_boundaries(const MediaInfo& media, double segment_seconds);
+void strip_analysis_options(FFmpegParams& ffmpeg_params);
+std::string source_identity(const std::string& input_file, const FFmpegParams& ffmpeg_params);
+std::string analysis_cache_key(const std::string& input_file, const MediaInfo& media,
+                               const FFmpegParams& ffmpeg_params, int width, int height);
+void plan_analysis_reuse(FFmpegParams& ffmpeg_params, const std::string& input_file, const MediaInfo& media,
+                         std::vector<std::string>& pending_saves);
+void finish_analysis_save(const std::vector<std::string>& pending_saves, bool success, long long cache_limit);
+int encode_checkpointed(const std::string& input_file,
+                        const std::string& output_file,
+                        const FFmpegParams& ffmpeg_params,
+                        const MediaInfo& media,
+                        double segment_seconds,
+                        int parallel_segments,
+                        int analyze_duration,
+                        int probe_size,
+                        bool verbose,
+                        bool execute,
+                        const ExecContext& exec);
+std::vector<std::string> with_stream_specifier(const std::vector<std::string>& options,
+                                               const std::string& type, int index);
+std::string tee_format_name(const std::string& format);
+std::string tee_slave_name(const std::string& output_file);
+std::vector<std::vector<std::string>> build_ladder_commands(const std::string& input_file,
+                                                            const std::vector<std::string>& output_files,
+                                                            const std::vector<FFmpegParams>& renditions,
+                                                            const MediaInfo& media,
+                                                            int analyze_duration,
+                                                            int probe_size,
+                                                            bool verbose,
+                                                            const std::string& passlogfile);
+int encode_ladder(const std::string& input_file,
+                  const std::vector<std::string>& output_files,
+                  const std::vector<FFmpegParams>& renditions,
+                  const FFmpegParams& ffmpeg_params,
+                  const MediaInfo& media,
+                  int analyze_duration,
+                  int probe_size,
+                  bool verbose,
+                  bool execute,
+                  const ExecContext& exec);
 
 void show_usage(const char* progname) {
     std::cout << "Usage: " << progname << " [input_json_file] [options]" << std::endl;
+    std::cout << "       " << progname << " --self-test   Check the timing, size and scheduling helpers" << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -r, --recursive    Process media files recursively in subdirectories" << std::endl;
     std::cout << "  -e, --execute      Execute the generated ffmpeg commands" << std::endl;
@@ -114,6 +674,51 @@ void show_usage(const char* progname) {
     std::cout << "  -m, --force-m4v    Force output extension to .m4v regardless of container" << std::endl;
     std::cout << "  -u, --no-underscore-replace  Don't replace underscores with spaces in output filenames" << std::endl;
     std::cout << "  --ignore-flag=X    Set custom ignore flag file (default: .noconvert)" << std::endl;
+    std::cout << "  -j, --jobs N       Run up to N conversions concurrently (default: 1)" << std::endl;
+    std::cout << "  --affinity         With -j, pin each job to its own CPUs and NUMA node" << std::endl;
+    std::cout << "  --chunked[=SECS]   Split files longer than SECS (default: 1800) at keyframes and" << std::endl;
+    std::cout << "                     encode the chunks in parallel" << std::endl;
+    std::cout << "  --chunks N         Number of chunks for --chunked (default: from the CPU count)" << std::endl;
+    std::cout << "  --checkpoint[=SECS] Encode in resumable segments of SECS (default: 300); rerun" << std::endl;
+    std::cout << "                     after a crash to continue from the last finished segment" << std::endl;
+    std::cout << "  --ladder LIST      Encode several renditions from one decode. LIST is comma" << std::endl;
+    std::cout << "                     separated heights (using this preset) and/or preset files," << std::endl;
+    std::cout << "                     e.g. --ladder 1080,720,480" << std::endl;
+    std::cout << "  --deadline=TIME    Finish by TIME (HH:MM or +DURATION such as +90m): x264/x265" << std::endl;
+    std::cout << "                     jobs use faster presets when the projection runs late" << std::endl;
+    std::cout << "  --stats-file=FILE  Where finished jobs are recorded for ETAs (default:" << std::endl;
+    std::cout << "                     ~/.local/share/hb-ffmpeg-conv/stats.jsonl)" << std::endl;
+    std::cout << "  --order=ORDER      Job order: longest (default with -j), shortest (quick" << std::endl;
+    std::cout << "                     results first) or input (directory order)" << std::endl;
+    std::cout << "  --batch[=SECS]     Encode clips up to SECS long (default: 30) several to one" << std::endl;
+    std::cout << "                     ffmpeg process; failed clips are retried on their own" << std::endl;
+    std::cout << "  --batch-size N     Clips per batch (default: 8)" << std::endl;
+    std::cout << "  --analysis-cache[=DIR] Reuse x265 analysis between encodes of the same source" << std::endl;
+    std::cout << "                     (other bitrates, ladder renditions, re-runs). Default DIR:" << std::endl;
+    std::cout << "                     ~/.cache/hb-ffmpeg-conv/x265-analysis" << std::endl;
+    std::cout << "  --analysis-cache-size=GB  Size limit of the analysis cache (default: 50)" << std::endl;
+    std::cout << "  --containers LIST  Also write these containers (mkv,mp4,m4v,mov,webm) from the" << std::endl;
+    std::cout << "                     same encode, e.g. --containers mkv,mp4" << std::endl;
+    std::cout << "  --target-ssim=X    Per-title CRF: the highest CRF whose sampled windows reach" << std::endl;
+    std::cout << "                     SSIM X (e.g. 0.98); needs a constant quality preset" << std::endl;
+    std::cout << "  --target-psnr=DB   Same, with a PSNR target in dB (e.g. 42)" << std::endl;
+    std::cout << "  --split-audio      Encode the video and each transcoded audio track in separate" << std::endl;
+    std::cout << "                     processes at the same time, then mux them" << std::endl;
+    std::cout << "  --scratch DIR      Copy inputs to DIR (local disk) ahead of their jobs and write" << std::endl;
+    std::cout << "                     outputs there, moving them into place when each job is done" << std::endl;
+    std::cout << "  --scratch-size GB  Space --scratch may use (default: 90% of what is free there)" << std::endl;
+    std::cout << "  --per-device N     With -j, run at most N jobs reading or writing each spinning" << std::endl;
+    std::cout << "                     disk; jobs on other disks go ahead, SSDs are not limited" << std::endl;
+    std::cout << "  --io-idle          Run ffmpeg and staging in the idle I/O class, so other" << std::endl;
+    std::cout << "                     services on the host get the disks first" << std::endl;
+    std::cout << "  --keep-cache       Leave finished inputs and outputs in the page cache (by" << std::endl;
+    std::cout << "                     default outputs are flushed and both are dropped)" << std::endl;
+    std::cout << "  --no-space-check   Start jobs even when their predicted output size doesn't fit" << std::endl;
+    std::cout << "                     in the free space (by default they wait, or fail up front)" << std::endl;
+    std::cout << "  --memory GB        With -j, start jobs only while their predicted peak memory adds" << std::endl;
+    std::cout << "                     up to this (default: 90% of MemAvailable or the cgroup limit)" << std::endl;
+    std::cout << "  --loudnorm[=LUFS]  Normalize audio loudness (EBU R128, default: -23 LUFS), measured" << std::endl;
+    std::cout << "                     in pass 1 or an audio-only decode, then applied as a linear gain" << std::endl;
     std::cout << "  --verbose          Show verbose output and ffmpeg logs" << std::endl;
     std::cout << "  -v, --version      Show version: " << SCRIPT_VERSION << std::endl;
     std::cout << "  -h, --help         Show this help message" << std::endl;
@@ -122,6 +727,7 @@ void show_usage(const char* progname) {
     std::cout << "  - Files will be skipped if a '.noconvert' file exists in the same directory" << std::endl;
     std::cout << "  - Use -m/--force-m4v to output all files with .m4v extension" << std::endl;
     std::cout << "  - By default, underscores in filenames are replaced with spaces" << std::endl;
+    std::cout << "  - With -j, the available CPUs are split between concurrent encodes by resolution" << std::endl;
     exit(1);
 }
 
@@ -163,6 +769,9 @@ Settings extract_preset_settings(const json& preset_data) {
 
     settings.video_preset = preset.value("VideoPreset", "");
     settings.video_profile = preset.value("VideoProfile", "");
+    settings.video_tune = preset.value("VideoTune", "");
+    settings.video_level = preset.value("VideoLevel", "");
+    settings.video_options = preset.value("VideoOptionExtra", "");
 
     if (preset.contains("VideoFramerate")) {
         if (preset["VideoFramerate"].is_string()) {
@@ -204,6 +813,46 @@ Settings extract_preset_settings(const json& preset_data) {
         settings.picture_height = "0";
     }
 
+    settings.picture_allow_upscaling = preset.value("PictureAllowUpscaling", false);
+    settings.picture_keep_ratio = preset.value("PictureKeepRatio", true);
+    settings.picture_modulus = std::max(2, preset.value("PictureModulus", 2));
+
+    // HandBrake 1.6+ has PictureCropMode (0 automatic, 1 conservative,
+    // 2 none, 3 custom); older presets only PictureAutoCrop
+    bool custom_crop;
+    if (preset.contains("PictureCropMode")) {
+        int crop_mode = preset["PictureCropMode"].get<int>();
+        settings.picture_auto_crop = crop_mode == 0 || crop_mode == 1;
+        custom_crop = crop_mode == 3;
+    } else {
+        settings.picture_auto_crop = preset.value("PictureAutoCrop", false);
+        custom_crop = !settings.picture_auto_crop;
+    }
+    if (custom_crop) {
+        const char* keys[4] = {"PictureTopCrop", "PictureBottomCrop", "PictureLeftCrop", "PictureRightCrop"};
+        for (int edge = 0; edge < 4; ++edge) {
+            settings.picture_crop[edge] = std::max(0, preset.value(keys[edge], 0));
+        }
+    }
+
+    settings.picture_deinterlace_filter = preset.value("PictureDeinterlaceFilter", "off");
+    settings.picture_deinterlace_preset = preset.value("PictureDeinterlacePreset", "default");
+    settings.picture_detelecine = preset.value("PictureDetelecine", "off");
+
+    settings.picture_denoise_filter = preset.value("PictureDenoiseFilter", "off");
+    settings.picture_denoise_preset = preset.value("PictureDenoisePreset", "medium");
+    settings.picture_deblock_preset = preset.value("PictureDeblockPreset", "off");
+    settings.picture_deblock_tune = preset.value("PictureDeblockTune", "medium");
+    settings.picture_sharpen_filter = preset.value("PictureSharpenFilter", "off");
+    settings.picture_sharpen_preset = preset.value("PictureSharpenPreset", "medium");
+    settings.picture_chroma_smooth_preset = preset.value("PictureChromaSmoothPreset", "off");
+    settings.picture_chroma_smooth_tune = preset.value("PictureChromaSmoothTune", "medium");
+    settings.picture_colorspace_preset = preset.value("PictureColorspacePreset", "off");
+    settings.picture_grayscale = preset.value("VideoGrayScale", false);
+    if (preset.contains("PictureRotate") && preset["PictureRotate"].is_string()) {
+        settings.picture_rotate = preset["PictureRotate"].get<std::string>();
+    }
+
     settings.audio_encoder = audio_settings.value("AudioEncoder", "");
 
     if (audio_settings.contains("AudioBitrate")) {
@@ -213,20 +862,234 @@ Settings extract_preset_settings(const json& preset_data) {
     }
 
     settings.audio_mixdown = audio_settings.value("AudioMixdown", "");
+    if (audio_settings.contains("AudioTrackGainSlider") && audio_settings["AudioTrackGainSlider"].is_number()) {
+        settings.audio_gain = audio_settings["AudioTrackGainSlider"].get<double>();
+    }
+    if (audio_settings.contains("AudioTrackDRCSlider") && audio_settings["AudioTrackDRCSlider"].is_number()) {
+        settings.audio_drc = audio_settings["AudioTrackDRCSlider"].get<double>();
+    }
+    settings.audio_normalize_mix = audio_settings.value("AudioNormalizeMixLevel", false);
     settings.container = preset.value("FileFormat", "");
 
     return settings;
 }
 
+// HandBrake's picture filters as ffmpeg filters. Strengths follow
+// HandBrake's presets; filters ffmpeg doesn't have map to the nearest one
+// (lapsharp to unsharp, chroma smooth to unsharp with negative chroma).
+void compile_picture_filters(const Settings& settings, FFmpegParams& ffmpeg_params) {
+    static const std::vector<std::string> strengths = {"ultralight", "light", "medium", "strong", "stronger",
+                                                       "verystrong"};
+    auto strength = [&](const std::string& preset) {
+        auto it = std::find(strengths.begin(), strengths.end(), preset);
+        return it == strengths.end() ? 2 : static_cast<int>(it - strengths.begin());
+    };
+
+    if (settings.picture_deblock_preset != "off" && !settings.picture_deblock_preset.empty()) {
+        int block = settings.picture_deblock_tune == "small" ? 4 : settings.picture_deblock_tune == "large" ? 16 : 8;
+        ffmpeg_params.deblock_filter = std::string("deblock=filter=") +
+            (strength(settings.picture_deblock_preset) < 3 ? "weak" : "strong") + ":block=" + std::to_string(block);
+    }
+
+    if (settings.picture_denoise_filter == "nlmeans") {
+        static const char* nlmeans[] = {"1.5", "3", "6", "10", "10", "10"};
+        ffmpeg_params.denoise_filter = std::string("nlmeans=s=") + nlmeans[strength(settings.picture_denoise_preset)];
+    } else if (settings.picture_denoise_filter == "hqdn3d") {
+        static const char* hqdn3d[] = {"1:0.7:1:2", "2:1:2:3", "3:2:2:3", "7:7:5:5", "7:7:5:5", "7:7:5:5"};
+        ffmpeg_params.denoise_filter = std::string("hqdn3d=") + hqdn3d[strength(settings.picture_denoise_preset)];
+    }
+
+    static const char* amounts[] = {"0.25", "0.5", "0.8", "1.2", "1.5", "2.0"};
+    if (settings.picture_chroma_smooth_preset != "off" && !settings.picture_chroma_smooth_preset.empty()) {
+        static const std::map<std::string, std::string> sizes = {
+            {"tiny", "3"}, {"small", "5"}, {"medium", "7"}, {"wide", "9"}, {"verywide", "11"}};
+        auto size = sizes.find(settings.picture_chroma_smooth_tune);
+        std::string matrix = size == sizes.end() ? "7" : size->second;
+        ffmpeg_params.output_filters.push_back("unsharp=lx=3:ly=3:la=0:cx=" + matrix + ":cy=" + matrix + ":ca=-" +
+                                               amounts[strength(settings.picture_chroma_smooth_preset)]);
+    }
+    if (settings.picture_sharpen_filter == "unsharp" || settings.picture_sharpen_filter == "lapsharp") {
+        ffmpeg_params.output_filters.push_back(std::string("unsharp=lx=5:ly=5:la=") +
+                                               amounts[strength(settings.picture_sharpen_preset)] + ":ca=0");
+    }
+
+    static const std::set<std::string> colorspaces = {"bt709", "bt601-6-625", "bt601-6-525", "bt2020"};
+    if (colorspaces.count(settings.picture_colorspace_preset)) {
+        ffmpeg_params.output_filters.push_back("colorspace=all=" + settings.picture_colorspace_preset);
+    }
+    if (settings.picture_grayscale) {
+        ffmpeg_params.output_filters.push_back("hue=s=0");
+    }
+
+    // "angle=90:hflip=1"; rotated after scaling, where there are fewer pixels to move
+    int angle = 0;
+    bool hflip = false;
+    for (const auto& option : split_string(settings.picture_rotate, ':')) {
+        if (option.rfind("angle=", 0) == 0) {
+            angle = static_cast<int>(parse_rational(option.substr(6)));
+        } else if (option == "hflip=1") {
+            hflip = true;
+        }
+    }
+    if (hflip) {
+        ffmpeg_params.output_filters.push_back("hflip");
+    }
+    if (angle == 90) {
+        ffmpeg_params.output_filters.push_back("transpose=clock");
+    } else if (angle == 180) {
+        ffmpeg_params.output_filters.push_back("hflip,vflip");
+    } else if (angle == 270) {
+        ffmpeg_params.output_filters.push_back("transpose=cclock");
+    }
+    ffmpeg_params.rotate_quarter = angle == 90 || angle == 270;
+}
+
+// HandBrake video encoder IDs. Speeds are rough figures at the default
+// preset, like those of encoder_speed_factor().
+const std::map<std::string, EncoderInfo>& encoder_table() {
+    static const std::vector<std::pair<std::string, std::string>> x26x_presets = {
+        {"placebo", "placebo"}, {"veryslow", "veryslow"}, {"slower", "slower"}, {"slow", "slow"},
+        {"medium", "medium"}, {"fast", "fast"}, {"faster", "faster"}, {"veryfast", "veryfast"},
+        {"superfast", "superfast"}, {"ultrafast", "ultrafast"}
+    };
+    static const std::vector<std::pair<std::string, std::string>> vpx_presets = {
+        {"veryslow", "0"}, {"slower", "1"}, {"slow", "2"}, {"medium", "3"}, {"fast", "4"},
+        {"faster", "5"}, {"veryfast", "6"}
+    };
+    static const std::vector<std::pair<std::string, std::string>> nvenc_presets = {
+        {"slowest", "p7"}, {"slower", "p6"}, {"slow", "p5"}, {"medium", "p4"}, {"fast", "p3"},
+        {"faster", "p2"}, {"fastest", "p1"}
+    };
+    static const std::vector<std::pair<std::string, std::string>> qsv_presets = {
+        {"quality", "veryslow"}, {"balanced", "medium"}, {"speed", "veryfast"}
+    };
+    static const std::vector<std::pair<std::string, std::string>> vt_presets = {
+        {"quality", ""}, {"speed", ""}
+    };
+    static const std::vector<std::string> x264_tunes = {
+        "film", "animation", "grain", "stillimage", "psnr", "ssim", "fastdecode", "zerolatency"
+    };
+    static const std::vector<std::string> x265_tunes = {
+        "psnr", "ssim", "grain", "zerolatency", "fastdecode", "animation"
+    };
+    static const std::vector<std::string> nvenc_tunes = {"hq", "uhq", "ll", "ull", "lossless"};
+
+    static const std::map<std::string, EncoderInfo> table = [&] {
+        std::vector<std::pair<std::string, std::string>> svt_presets;
+        for (int preset = 0; preset <= 13; ++preset) {
+            svt_presets.push_back({std::to_string(preset), std::to_string(preset)});
+        }
+
+        std::map<std::string, EncoderInfo> encoders;
+        encoders["x264"] = {"libx264", "yuv420p", "-crf", "", 51, "-x264-params", "-preset", x26x_presets,
+                            "medium", x264_tunes, {"baseline", "main", "high"}, true, 1.0};
+        encoders["x264_10bit"] = {"libx264", "yuv420p10le", "-crf", "", 51, "-x264-params", "-preset", x26x_presets,
+                                  "medium", x264_tunes, {"high10"}, true, 1.2};
+        encoders["x265"] = {"libx265", "yuv420p", "-crf", "", 51, "-x265-params", "-preset", x26x_presets,
+                            "medium", x265_tunes, {"main", "mainstillpicture"}, true, 4.0};
+        encoders["x265_10bit"] = {"libx265", "yuv420p10le", "-crf", "", 51, "-x265-params", "-preset", x26x_presets,
+                                  "medium", x265_tunes, {"main10", "main10-intra"}, true, 4.0};
+        encoders["x265_12bit"] = {"libx265", "yuv420p12le", "-crf", "", 51, "-x265-params", "-preset", x26x_presets,
+                                  "medium", x265_tunes, {"main12", "main12-intra"}, true, 4.5};
+        // ffmpeg's SVT-AV1 wrapper has no two-pass mode
+        encoders["svt_av1"] = {"libsvtav1", "yuv420p", "-crf", "", 63, "-svtav1-params", "-preset", svt_presets,
+                               "8", {"psnr", "ssim"}, {"main"}, false, 3.0};
+        encoders["svt_av1_10bit"] = {"libsvtav1", "yuv420p10le", "-crf", "", 63, "-svtav1-params", "-preset",
+                                     svt_presets, "8", {"psnr", "ssim"}, {"main"}, false, 3.0};
+        // libvpx only runs unconstrained constant quality with a zero
+        // bitrate; VP8 needs a ceiling instead
+        encoders["vp8"] = {"libvpx", "yuv420p", "-crf", " -b:v 20M", 63, "", "-cpu-used", vpx_presets,
+                           "medium", {}, {}, true, 1.2};
+        encoders["vp9"] = {"libvpx-vp9", "yuv420p", "-crf", " -b:v 0", 63, "", "-cpu-used", vpx_presets,
+                           "medium", {}, {}, true, 3.0};
+        encoders["vp9_10bit"] = {"libvpx-vp9", "yuv420p10le", "-crf", " -b:v 0", 63, "", "-cpu-used", vpx_presets,
+                                 "medium", {}, {}, true, 3.5};
+        encoders["mpeg4"] = {"mpeg4", "yuv420p", "-q:v", "", 31, "", "", {}, "", {}, {}, true, 0.1};
+        encoders["mpeg2"] = {"mpeg2video", "yuv420p", "-q:v", "", 31, "", "", {}, "", {}, {}, true, 0.1};
+        encoders["ffv1"] = {"ffv1", "", "", "", 0, "", "", {}, "", {}, {}, false, 0.2};
+        // Hardware encoders: the GPU or media engine does the work
+        encoders["nvenc_h264"] = {"h264_nvenc", "yuv420p", "-cq", " -b:v 0", 51, "", "-preset", nvenc_presets,
+                                  "medium", nvenc_tunes, {"baseline", "main", "high"}, false, 0.05};
+        encoders["nvenc_h265"] = {"hevc_nvenc", "yuv420p", "-cq", " -b:v 0", 51, "", "-preset", nvenc_presets,
+                                  "medium", nvenc_tunes, {"main"}, false, 0.05};
+        encoders["nvenc_h265_10bit"] = {"hevc_nvenc", "p010le", "-cq", " -b:v 0", 51, "", "-preset", nvenc_presets,
+                                        "medium", nvenc_tunes, {"main10"}, false, 0.05};
+        encoders["qsv_h264"] = {"h264_qsv", "nv12", "-global_quality", "", 51, "", "-preset", qsv_presets,
+                                "balanced", {}, {"baseline", "main", "high"}, false, 0.08};
+        encoders["qsv_h265"] = {"hevc_qsv", "nv12", "-global_quality", "", 51, "", "-preset", qsv_presets,
+                                "balanced", {}, {"main"}, false, 0.08};
+        encoders["qsv_h265_10bit"] = {"hevc_qsv", "p010le", "-global_quality", "", 51, "", "-preset", qsv_presets,
+                                      "balanced", {}, {"main10"}, false, 0.08};
+        encoders["vt_h264"] = {"h264_videotoolbox", "nv12", "-q:v", "", 100, "", "", vt_presets,
+                               "quality", {}, {"baseline", "main", "high"}, false, 0.08};
+        encoders["vt_h265"] = {"hevc_videotoolbox", "nv12", "-q:v", "", 100, "", "", vt_presets,
+                               "quality", {}, {"main"}, false, 0.08};
+        encoders["vt_h265_10bit"] = {"hevc_videotoolbox", "p010le", "-q:v", "", 100, "", "", vt_presets,
+                                     "quality", {}, {"main10"}, false, 0.08};
+        // Names of older presets
+        encoders["ffmpeg4"] = encoders["mpeg4"];
+        encoders["ffmpeg2"] = encoders["mpeg2"];
+        encoders["VP8"] = encoders["vp8"];
+        encoders["VP9"] = encoders["vp9"];
+        return encoders;
+    }();
+    return table;
+}
+
+// By HandBrake ID or by ffmpeg encoder; nullptr for encoders we don't know
+const EncoderInfo* find_encoder(const std::string& name) {
+    const auto& table = encoder_table();
+    auto found = table.find(name);
+    if (found != table.end()) {
+        return &found->second;
+    }
+    for (const auto& entry : table) {
+        if (entry.second.codec == name) {
+            return &entry.second;
+        }
+    }
+    return nullptr;
+}
+
+// The entry the preset named, which tells the bit depths of one ffmpeg
+// encoder apart; by ffmpeg encoder when the preset named none we know
+const EncoderInfo* find_encoder(const FFmpegParams& ffmpeg_params) {
+    const EncoderInfo* encoder = ffmpeg_params.encoder_name.empty() ? nullptr
+                                                                    : find_encoder(ffmpeg_params.encoder_name);
+    if (encoder && encoder->codec == ffmpeg_params.vcodec) {
+        return encoder;
+    }
+    return find_encoder(ffmpeg_params.vcodec);
+}
+
+std::string encoder_preset_value(const EncoderInfo& encoder, const std::string& preset) {
+    for (const auto& entry : encoder.presets) {
+        if (entry.first == preset) {
+            return entry.second;
+        }
+    }
+    return "";
+}
+
+// Bitrate targets with an encoder that supports a stats pass
+bool uses_two_pass(const FFmpegParams& ffmpeg_params) {
+    const EncoderInfo* encoder = find_encoder(ffmpeg_params);
+    return ffmpeg_params.multipass && ffmpeg_params.quality.rfind("-b:v", 0) == 0 &&
+           (!encoder || encoder->two_pass);
+}
+
 FFmpegParams convert_to_ffmpeg_params(const Settings& settings) {
     FFmpegParams result;
 
     // Convert video encoder
-    if (settings.video_encoder == "x265") {
-        result.vcodec = "libx265";
-    } else if (settings.video_encoder == "x264") {
-        result.vcodec = "libx264";
+    const EncoderInfo* encoder = find_encoder(settings.video_encoder);
+    if (encoder) {
+        result.encoder_name = settings.video_encoder;
+        result.vcodec = encoder->codec;
+        result.pix_fmt = encoder->pix_fmt;
     } else {
+        std::cout << "Warning: Unknown video encoder " << settings.video_encoder
+                  << ", passing it to ffmpeg as is" << std::endl;
         result.vcodec = settings.video_encoder;
     }
 
@@ -248,11 +1111,21 @@ FFmpegParams convert_to_ffmpeg_params(const Settings& settings) {
     } else {
         result.audio_channels = "";
     }
+    result.audio_gain = settings.audio_gain;
+    result.drc_scale = settings.audio_drc;
+    result.normalize_mix = settings.audio_normalize_mix;
 
     // Video quality settings
     if (settings.video_quality_type == "2") {
-        // CRF mode
-        result.quality = "-crf " + settings.video_quality;
+        // Constant quality, CRF for the software encoders
+        if (!encoder) {
+            result.quality = "-crf " + settings.video_quality;
+        } else if (!encoder->quality_option.empty()) {
+            result.quality = encoder->quality_option + " " + settings.video_quality + encoder->quality_extra;
+        }
+    } else if (encoder && encoder->quality_option.empty()) {
+        // Lossless encoders have no rate control
+        result.quality.clear();
     } else {
         // Bitrate mode
         result.quality = "-b:v " + settings.video_bitrate + "k";
@@ -269,38 +1142,290 @@ FFmpegParams convert_to_ffmpeg_params(const Settings& settings) {
 
     result.preset = settings.video_preset;
     result.profile = settings.video_profile;
+    if (encoder) {
+        // Names from another encoder's vocabulary fall back to the defaults
+        if (encoder->presets.empty()) {
+            result.preset.clear();
+        } else if (std::none_of(encoder->presets.begin(), encoder->presets.end(),
+                                [&](const auto& entry) { return entry.first == result.preset; })) {
+            if (!result.preset.empty()) {
+                std::cout << "Note: " << settings.video_encoder << " has no preset " << result.preset << ", using "
+                          << encoder->default_preset << std::endl;
+            }
+            result.preset = encoder->default_preset;
+        }
+        if (!result.profile.empty() && result.profile != "auto" &&
+            std::find(encoder->profiles.begin(), encoder->profiles.end(), result.profile) == encoder->profiles.end()) {
+            std::cout << "Note: " << settings.video_encoder << " has no profile " << result.profile
+                      << ", leaving it to the encoder" << std::endl;
+            result.profile = "auto";
+        }
+    }
+
+    // The advanced options string uses the encoders' own key=value syntax
+    std::vector<std::string> options;
+    for (const auto& option : split_string(settings.video_options, ':')) {
+        std::string trimmed = option;
+        trimmed.erase(std::remove_if(trimmed.begin(), trimmed.end(), ::isspace), trimmed.end());
+        if (!trimmed.empty()) {
+            options.push_back(trimmed);
+        }
+    }
+    if (!options.empty() && (!encoder || encoder->params_option.empty())) {
+        std::cout << "Note: " << settings.video_encoder << " takes no advanced options, ignoring "
+                  << settings.video_options << std::endl;
+    } else {
+        result.encoder_options = join_string(options, ":");
+    }
+
+    std::vector<std::string> tunes;
+    for (const auto& tune : split_string(settings.video_tune, ',')) {
+        if (tune.empty() || tune == "none") {
+            continue;
+        }
+        if (encoder && std::find(encoder->tunes.begin(), encoder->tunes.end(), tune) == encoder->tunes.end()) {
+            std::cout << "Note: " << settings.video_encoder << " has no tune " << tune << ", ignoring it" << std::endl;
+        } else {
+            tunes.push_back(tune);
+        }
+    }
+    // SVT-AV1 takes its tune as a number in its params
+    if (result.vcodec == "libsvtav1" && !tunes.empty()) {
+        set_encoder_option(result, "tune", tunes.back() == "psnr" ? "1" : "2");
+    } else {
+        result.tune = join_string(tunes, ",");
+    }
+
+    // x265 and SVT-AV1 have no -level in ffmpeg
+    std::string level = settings.video_level == "auto" ? "" : settings.video_level;
+    if (!level.empty() && result.vcodec == "libx265") {
+        set_encoder_option(result, "level-idc", level);
+    } else if (!level.empty() && result.vcodec == "libsvtav1") {
+        set_encoder_option(result, "level", level);
+    } else {
+        result.level = level;
+    }
     result.framerate = settings.video_framerate;
     result.resolution = settings.picture_width + "x" + settings.picture_height;
+    result.max_width = std::max(0, std::atoi(settings.picture_width.c_str()));
+    result.max_height = std::max(0, std::atoi(settings.picture_height.c_str()));
+    result.allow_upscaling = settings.picture_allow_upscaling;
+    result.keep_aspect = settings.picture_keep_ratio;
+    result.modulus = settings.picture_modulus;
     result.multipass = settings.video_multipass;
+    if (encoder && result.multipass && !encoder->two_pass && settings.video_quality_type != "2") {
+        std::cout << "Note: " << settings.video_encoder << " has no two-pass mode in ffmpeg, encoding in one pass"
+                  << std::endl;
+        result.multipass = false;
+    }
+    result.auto_crop = settings.picture_auto_crop;
+    std::copy(settings.picture_crop, settings.picture_crop + 4, result.crop);
+
+    // Decomb has no ffmpeg equivalent; bwdif is the closest. Whether a
+    // file needs any of this is decided per file by detect_field_type().
+    if (settings.picture_deinterlace_filter == "yadif") {
+        result.deinterlacer = "yadif";
+    } else if (settings.picture_deinterlace_filter == "bwdif" || settings.picture_deinterlace_filter == "decomb") {
+        result.deinterlacer = "bwdif";
+    }
+    result.deinterlace_mode = settings.picture_deinterlace_preset.find("bob") != std::string::npos
+                              ? "send_field" : "send_frame";
+    result.detelecine = !settings.picture_detelecine.empty() && settings.picture_detelecine != "off";
+    compile_picture_filters(settings, result);
     result.preset_name = settings.preset_name;
+    result.threads = 0;
 
     return result;
 }
 
+// Parsed `ffmpeg -h encoder=...`, kept in a cache keyed by the ffmpeg
+// version so each build's help is only read once
+EncoderCapabilities probe_encoder_capabilities(const std::string& codec, const std::string& cache_file) {
+    EncoderCapabilities capabilities;
+    std::string version;
+    if (read_command_output({"ffmpeg", "-version"}, version) != 0 || version.empty()) {
+        return capabilities;
+    }
+    std::string key = version.substr(0, version.find('\n')) + "|" + codec;
+
+    std::ifstream in(cache_file);
+    std::string line;
+    while (std::getline(in, line)) {
+        try {
+            json entry = json::parse(line);
+            if (entry.value("key", "") == key) {
+                capabilities.known = true;
+                capabilities.available = entry.value("available", false);
+                capabilities.pix_fmts = entry.value("pix_fmts", std::vector<std::string>());
+                capabilities.options =
+                    entry.value("options", std::map<std::string, std::vector<std::string>>());
+            }
+        } catch (json::exception&) {
+            continue;
+        }
+    }
+    if (capabilities.known) {
+        return capabilities;
+    }
+
+    std::string help;
+    if (read_command_output({"ffmpeg", "-hide_banner", "-h", "encoder=" + codec}, help) != 0 || help.empty()) {
+        return capabilities;
+    }
+    capabilities.known = true;
+    capabilities.available = help.find("is not recognized") == std::string::npos;
+
+    // Options are "  -name  <type> ...", their named values indented
+    // further below them; only the AVOptions sections list options
+    std::istringstream lines(help);
+    bool in_options = false;
+    std::string option;
+    while (std::getline(lines, line)) {
+        std::istringstream words(line);
+        std::string word;
+        words >> word;
+        if (line.find("Supported pixel formats:") != std::string::npos) {
+            for (words >> word >> word; words >> word;) {
+                capabilities.pix_fmts.push_back(word);
+            }
+        } else if (line.size() > 10 && line.compare(line.size() - 10, 10, "AVOptions:") == 0) {
+            in_options = true;
+        } else if (in_options && line.rfind("  -", 0) == 0) {
+            option = word.substr(1);
+            capabilities.options[option];
+        } else if (in_options && line.rfind("     ", 0) == 0 && !option.empty() && !word.empty()) {
+            capabilities.options[option].push_back(word);
+        }
+    }
+
+    append_json_line(cache_file, {{"key", key}, {"available", capabilities.available},
+                                  {"pix_fmts", capabilities.pix_fmts}, {"options", capabilities.options}});
+    return capabilities;
+}
+
+// Drop what the installed encoder would reject rather than fail every
+// encode on it; the encoder then uses its own default
+void check_encoder_capabilities(FFmpegParams& ffmpeg_params, const std::string& cache_file) {
+    EncoderCapabilities capabilities = probe_encoder_capabilities(ffmpeg_params.vcodec, cache_file);
+    if (!capabilities.known) {
+        return;
+    }
+    if (!capabilities.available) {
+        std::cout << "Warning: This ffmpeg has no " << ffmpeg_params.vcodec << " encoder" << std::endl;
+        return;
+    }
+
+    if (!ffmpeg_params.pix_fmt.empty() && !capabilities.pix_fmts.empty() &&
+        std::find(capabilities.pix_fmts.begin(), capabilities.pix_fmts.end(), ffmpeg_params.pix_fmt) ==
+            capabilities.pix_fmts.end()) {
+        std::cout << "Note: " << ffmpeg_params.vcodec << " here can't encode " << ffmpeg_params.pix_fmt
+                  << ", leaving the pixel format to it" << std::endl;
+        ffmpeg_params.pix_fmt.clear();
+    }
+
+    // Named values are checked one by one; free form ones only need the option
+    auto accepts = [&](const std::string& option, const std::string& value) {
+        auto found = capabilities.options.find(option);
+        if (found == capabilities.options.end()) {
+            return false;
+        }
+        const auto& values = found->second;
+        std::vector<std::string> items = split_string(value, ',');
+        return values.empty() || std::all_of(items.begin(), items.end(), [&](const std::string& item) {
+            return std::find(values.begin(), values.end(), item) != values.end();
+        });
+    };
+    if (!ffmpeg_params.tune.empty() && !accepts("tune", ffmpeg_params.tune)) {
+        std::cout << "Note: " << ffmpeg_params.vcodec << " here doesn't take -tune " << ffmpeg_params.tune
+                  << ", ignoring it" << std::endl;
+        ffmpeg_params.tune.clear();
+    }
+    if (!ffmpeg_params.level.empty() && !accepts("level", ffmpeg_params.level)) {
+        std::cout << "Note: " << ffmpeg_params.vcodec << " here doesn't take -level " << ffmpeg_params.level
+                  << ", ignoring it" << std::endl;
+        ffmpeg_params.level.clear();
+    }
+    if (ffmpeg_params.profile != "auto" && !ffmpeg_params.profile.empty() &&
+        capabilities.options.count("profile") && !accepts("profile", ffmpeg_params.profile)) {
+        std::cout << "Note: " << ffmpeg_params.vcodec << " here doesn't take -profile:v " << ffmpeg_params.profile
+                  << ", leaving it to the encoder" << std::endl;
+        ffmpeg_params.profile = "auto";
+    }
+}
+
 void show_preset(const FFmpegParams& ffmpeg_params, const std::string& output_format,
                 int analyze_duration, int probe_size) {
     std::cout << "============================================" << std::endl;
     std::cout << "Handbrake Preset: " << ffmpeg_params.preset_name << std::endl;
     std::cout << "FFmpeg Equivalent Parameters:" << std::endl;
     std::cout << "============================================" << std::endl;
+    const EncoderInfo* encoder = find_encoder(ffmpeg_params);
+    std::string preset_option = !encoder ? "-preset " + ffmpeg_params.preset
+                              : encoder->preset_option.empty() ? ""
+                              : encoder->preset_option + " " + encoder_preset_value(*encoder, ffmpeg_params.preset);
     std::cout << "Video codec:      -c:v " << ffmpeg_params.vcodec << std::endl;
-    std::cout << "Quality:          " << ffmpeg_params.quality << std::endl;
-    std::cout << "Preset:           -preset " << ffmpeg_params.preset << std::endl;
+    if (!ffmpeg_params.pix_fmt.empty()) {
+        std::cout << "Pixel format:     -pix_fmt " << ffmpeg_params.pix_fmt << std::endl;
+    }
+    std::cout << "Quality:          " << (ffmpeg_params.quality.empty() ? "lossless" : ffmpeg_params.quality)
+              << std::endl;
+    if (!preset_option.empty()) {
+        std::cout << "Preset:           " << preset_option
+                  << (preset_option.substr(preset_option.find(' ') + 1) == ffmpeg_params.preset
+                      ? "" : " (" + ffmpeg_params.preset + ")") << std::endl;
+    }
 
     if (ffmpeg_params.framerate != "auto" && !ffmpeg_params.framerate.empty()) {
         std::cout << "Framerate:        -r " << ffmpeg_params.framerate << std::endl;
     }
 
     std::cout << "Resolution:       -s " << ffmpeg_params.resolution << std::endl;
+    if (!ffmpeg_params.deinterlacer.empty() || ffmpeg_params.detelecine) {
+        std::cout << "Interlacing:      detected per file (idet), then "
+                  << (ffmpeg_params.deinterlacer.empty() ? "" : ffmpeg_params.deinterlacer + " " +
+                                                                ffmpeg_params.deinterlace_mode)
+                  << (ffmpeg_params.deinterlacer.empty() || !ffmpeg_params.detelecine ? "" : " / ")
+                  << (ffmpeg_params.detelecine ? "fieldmatch+decimate" : "") << std::endl;
+    }
+    if (ffmpeg_params.auto_crop) {
+        std::cout << "Crop:             detected per file (cropdetect)" << std::endl;
+    } else if (std::any_of(ffmpeg_params.crop, ffmpeg_params.crop + 4, [](int edge) { return edge > 0; })) {
+        std::cout << "Crop:             " << ffmpeg_params.crop[0] << "/" << ffmpeg_params.crop[1] << "/"
+                  << ffmpeg_params.crop[2] << "/" << ffmpeg_params.crop[3] << " (top/bottom/left/right)" << std::endl;
+    }
     std::cout << "Audio:            " << ffmpeg_params.acodec << " " << ffmpeg_params.audio_channels << std::endl;
+    std::string audio_filters = audio_filter_chain(ffmpeg_params, 0);
+    if (!audio_filters.empty() && ffmpeg_params.acodec.find("copy") == std::string::npos) {
+        std::cout << "Audio filters:    -af " << audio_filters
+                  << (ffmpeg_params.loudness_target < 0 ? " (linear once measured per file)" : "") << std::endl;
+    }
+    if (ffmpeg_params.drc_scale >= 0 && ffmpeg_params.acodec.find("copy") == std::string::npos) {
+        std::cout << "Audio DRC:        -drc_scale " << format_number(ffmpeg_params.drc_scale, 1)
+                  << " (AC-3 sources)" << std::endl;
+    }
 
     if (ffmpeg_params.profile != "auto" && !ffmpeg_params.profile.empty()) {
         std::cout << "Profile:          -profile:v " << ffmpeg_params.profile << std::endl;
     }
+    if (!ffmpeg_params.tune.empty()) {
+        std::cout << "Tune:             -tune " << ffmpeg_params.tune << std::endl;
+    }
+    if (!ffmpeg_params.level.empty()) {
+        std::cout << "Level:            -level " << ffmpeg_params.level << std::endl;
+    }
+    if (!ffmpeg_params.encoder_options.empty() && encoder && !encoder->params_option.empty()) {
+        std::cout << "Encoder options:  " << encoder->params_option << " " << ffmpeg_params.encoder_options
+                  << std::endl;
+    }
+
+    std::string filters = video_filter_chain(ffmpeg_params, false);
+    if (!filters.empty()) {
+        std::cout << "Filters:          -vf " << filters << std::endl;
+    }
 
     std::cout << "Output format:    " << output_format << std::endl;
 
-    if (ffmpeg_params.multipass && ffmpeg_params.quality.find("-crf") == std::string::npos) {
+    if (uses_two_pass(ffmpeg_params)) {
         std::cout << "Multipass:        Enabled (two-pass encoding)" << std::endl;
     } else {
         std::cout << "Multipass:        Disabled (single-pass encoding)" << std::endl;
@@ -311,8 +1436,11 @@ void show_preset(const FFmpegParams& ffmpeg_params, const std::string& output_fo
     std::cout << "============================================" << std::endl;
     std::cout << "Example usage:" << std::endl;
     std::cout << "ffmpeg -analyzeduration " << analyze_duration << " -probesize " << probe_size
-              << " -i input.mp4 -c:v " << ffmpeg_params.vcodec << " " << ffmpeg_params.quality
-              << " -preset " << ffmpeg_params.preset << " -s " << ffmpeg_params.resolution
+              << " -i input.mp4 -c:v " << ffmpeg_params.vcodec
+              << (ffmpeg_params.quality.empty() ? "" : " " + ffmpeg_params.quality)
+              << (preset_option.empty() ? "" : " " + preset_option)
+              << (ffmpeg_params.pix_fmt.empty() ? "" : " -pix_fmt " + ffmpeg_params.pix_fmt)
+              << (filters.empty() ? " -s " + ffmpeg_params.resolution : " -vf " + filters)
               << " " << ffmpeg_params.acodec << " " << ffmpeg_params.audio_channels
               << " output." << output_format << std::endl;
     std::cout << "============================================" << std::endl;
@@ -387,6 +1515,41 @@ std::vector<std::string> split_string(const std::string& s, char delimiter) {
     return tokens;
 }
 
+// The encoder's key=value list, split at the ':' that aren't escaped
+std::vector<std::string> split_encoder_options(const std::string& options) {
+    std::vector<std::string> tokens;
+    std::string token;
+    for (size_t i = 0; i < options.size(); ++i) {
+        if (options[i] == '\\' && i + 1 < options.size()) {
+            token += options.substr(i++, 2);
+        } else if (options[i] == ':') {
+            if (!token.empty()) {
+                tokens.push_back(token);
+            }
+            token.clear();
+        } else {
+            token += options[i];
+        }
+    }
+    if (!token.empty()) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+// A value for the encoder's key=value list, such as a file path, with the
+// separators ffmpeg splits the list at escaped
+std::string escape_encoder_value(const std::string& value) {
+    std::string result;
+    for (char c : value) {
+        if (c == '\\' || c == ':' || c == '=' || c == '\'') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
 std::string join_string(const std::vector<std::string>& elements, const std::string& delimiter) {
     std::ostringstream result;
     for (size_t i = 0; i < elements.size(); ++i) {
@@ -405,32 +1568,126 @@ std::string escape_string(const std::string& s) {
     return s;
 }
 
-std::vector<std::string> build_ffmpeg_command(const std::string& input_file,
-                                             const std::string& output_file,
-                                             const FFmpegParams& ffmpeg_params,
-                                             int analyze_duration,
-                                             int probe_size,
-                                             bool verbose) {
-    std::vector<std::string> cmd;
+// The picture filters on one side of the scaler, ordered by what they
+// cost: deinterlacing needs the fields and deblocking the source's block
+// grid, so they run at source size after cropping has removed the bars;
+// denoising runs at whichever of the source and output size is smaller;
+// the rest run on the scaled frames.
+std::vector<std::string> video_filters(const FFmpegParams& ffmpeg_params, bool before_scale) {
+    int width, height;
+    get_output_dimensions(ffmpeg_params, MediaInfo(), width, height);
+    bool upscaling = ffmpeg_params.source_width > 0 &&
+                     static_cast<long long>(width) * height >
+                     static_cast<long long>(ffmpeg_params.source_width) * ffmpeg_params.source_height;
+
+    std::vector<std::string> filters;
+    if (before_scale) {
+        filters = {ffmpeg_params.field_filter, ffmpeg_params.crop_filter, ffmpeg_params.deblock_filter};
+        if (upscaling) {
+            filters.push_back(ffmpeg_params.denoise_filter);
+        }
+    } else {
+        if (!upscaling) {
+            filters.push_back(ffmpeg_params.denoise_filter);
+        }
+        filters.insert(filters.end(), ffmpeg_params.output_filters.begin(), ffmpeg_params.output_filters.end());
+    }
+    filters.erase(std::remove(filters.begin(), filters.end(), std::string()), filters.end());
+    return filters;
+}
 
-    // Base command with proper escaping and extended analysis parameters
-    cmd.push_back("ffmpeg");
-    cmd.push_back("-analyzeduration");
-    cmd.push_back(std::to_string(analyze_duration));
-    cmd.push_back("-probesize");
-    cmd.push_back(std::to_string(probe_size));
-    cmd.push_back("-i");
-    cmd.push_back(input_file);
+// Scaler to the output size; a quarter rotation after it swaps the sides.
+// Without a probed source size ffmpeg fits the picture into the box, and
+// an open side follows the source's aspect ratio.
+std::string scale_filter(const FFmpegParams& ffmpeg_params) {
+    if (ffmpeg_params.source_width <= 0 && ffmpeg_params.keep_aspect &&
+        (ffmpeg_params.max_width > 0 || ffmpeg_params.max_height > 0)) {
+        int box_width = ffmpeg_params.max_width;
+        int box_height = ffmpeg_params.max_height;
+        if (ffmpeg_params.rotate_quarter) {
+            std::swap(box_width, box_height);
+        }
+        std::string open_side = "-" + std::to_string(std::max(2, ffmpeg_params.modulus));
+        std::string width = box_width > 0 ? std::to_string(box_width) : open_side;
+        std::string height = box_height > 0 ? std::to_string(box_height) : open_side;
+        if (!ffmpeg_params.allow_upscaling) {
+            width = box_width > 0 ? "min(" + width + "\\,iw)" : width;
+            height = box_height > 0 ? "min(" + height + "\\,ih)" : height;
+        }
+        return "scale=w=" + width + ":h=" + height + ":force_original_aspect_ratio=decrease:force_divisible_by=" +
+               std::to_string(ffmpeg_params.modulus);
+    }
+
+    int width, height;
+    get_output_dimensions(ffmpeg_params, MediaInfo(), width, height);
+    if (ffmpeg_params.resolution.empty() || width <= 0 || height <= 0) {
+        return "";
+    }
+    if (ffmpeg_params.rotate_quarter) {
+        std::swap(width, height);
+    }
+    return "scale=" + std::to_string(width) + ":" + std::to_string(height);
+}
+
+// The whole picture chain for -vf. Without filters it is empty and a
+// plain resize is left to -s, unless force_scale asks for it anyway.
+std::string video_filter_chain(const FFmpegParams& ffmpeg_params, bool force_scale) {
+    std::vector<std::string> filters = video_filters(ffmpeg_params, true);
+    std::vector<std::string> after = video_filters(ffmpeg_params, false);
+    std::string scale = scale_filter(ffmpeg_params);
+    bool plain_resize = scale.find("force_original_aspect_ratio") == std::string::npos;
+    if (filters.empty() && after.empty() && plain_resize && !force_scale) {
+        return "";
+    }
+    if (!scale.empty()) {
+        filters.push_back(scale);
+    }
+    filters.insert(filters.end(), after.begin(), after.end());
+    return join_string(filters, ",");
+}
+
+// Video encoder, rate control, picture and profile options shared by
+// every command that encodes video
+void append_video_options(std::vector<std::string>& cmd, const FFmpegParams& ffmpeg_params) {
     cmd.push_back("-c:v");
     cmd.push_back(ffmpeg_params.vcodec);
 
     // Add quality parameters
-    std::vector<std::string> quality_parts = split_string(ffmpeg_params.quality, ' ');
-    cmd.insert(cmd.end(), quality_parts.begin(), quality_parts.end());
+    if (!ffmpeg_params.quality.empty()) {
+        std::vector<std::string> quality_parts = split_string(ffmpeg_params.quality, ' ');
+        cmd.insert(cmd.end(), quality_parts.begin(), quality_parts.end());
+    }
+
+    // Add preset, in the encoder's own vocabulary
+    const EncoderInfo* encoder = find_encoder(ffmpeg_params);
+    if (!encoder && !ffmpeg_params.preset.empty()) {
+        cmd.push_back("-preset");
+        cmd.push_back(ffmpeg_params.preset);
+    } else if (encoder && !encoder->preset_option.empty() && !ffmpeg_params.preset.empty()) {
+        cmd.push_back(encoder->preset_option);
+        cmd.push_back(encoder_preset_value(*encoder, ffmpeg_params.preset));
+    }
+    if (!ffmpeg_params.tune.empty()) {
+        cmd.push_back("-tune");
+        cmd.push_back(ffmpeg_params.tune);
+    }
+
+    if (!ffmpeg_params.pix_fmt.empty()) {
+        cmd.push_back("-pix_fmt");
+        cmd.push_back(ffmpeg_params.pix_fmt);
+    }
+
+    // Add thread budget and encoder-private parameters
+    if (ffmpeg_params.threads > 0) {
+        cmd.push_back("-threads");
+        cmd.push_back(std::to_string(ffmpeg_params.threads));
+    }
+    cmd.insert(cmd.end(), ffmpeg_params.encoder_flags.begin(), ffmpeg_params.encoder_flags.end());
 
-    // Add preset
-    cmd.push_back("-preset");
-    cmd.push_back(ffmpeg_params.preset);
+    if (!ffmpeg_params.encoder_options.empty() && encoder && !encoder->params_option.empty()) {
+        cmd.push_back(encoder->params_option);
+        cmd.push_back(ffmpeg_params.encoder_options);
+    }
 
     // Add framerate if specified
     if (ffmpeg_params.framerate != "auto" && !ffmpeg_params.framerate.empty()) {
@@ -438,17 +1695,19 @@ std::vector<std::string> build_ffmpeg_command(const std::string& input_file,
         cmd.push_back(ffmpeg_params.framerate);
     }
 
-    // Add resolution
-    cmd.push_back("-s");
-    cmd.push_back(ffmpeg_params.resolution);
-
-    // Add audio settings
-    std::vector<std::string> audio_parts = split_string(ffmpeg_params.acodec, ' ');
-    cmd.insert(cmd.end(), audio_parts.begin(), audio_parts.end());
-
-    if (!ffmpeg_params.audio_channels.empty()) {
-        std::vector<std::string> audio_channel_parts = split_string(ffmpeg_params.audio_channels, ' ');
-        cmd.insert(cmd.end(), audio_channel_parts.begin(), audio_channel_parts.end());
+    // Add resolution, or the picture filter chain with its scaler. Filters
+    // use the thread budget as slice threads.
+    std::string filters = video_filter_chain(ffmpeg_params, false);
+    if (filters.empty() && !ffmpeg_params.resolution.empty()) {
+        cmd.push_back("-s");
+        cmd.push_back(ffmpeg_params.resolution);
+    } else if (!filters.empty()) {
+        if (ffmpeg_params.threads > 0) {
+            cmd.push_back("-filter_threads");
+            cmd.push_back(std::to_string(ffmpeg_params.threads));
+        }
+        cmd.push_back("-vf");
+        cmd.push_back(filters);
     }
 
     // Add profile if specified
@@ -456,69 +1715,3761 @@ std::vector<std::string> build_ffmpeg_command(const std::string& input_file,
         cmd.push_back("-profile:v");
         cmd.push_back(ffmpeg_params.profile);
     }
+    if (!ffmpeg_params.level.empty()) {
+        cmd.push_back("-level");
+        cmd.push_back(ffmpeg_params.level);
+    }
+}
 
-    // Add verbosity level
-    if (!verbose) {
-        cmd.push_back("-v");
-        cmd.push_back("error");
-        cmd.push_back("-stats");
+// Audio filters of one track: the preset's gain and mix level, then
+// loudness normalization. With measured values loudnorm only applies a
+// linear gain; before measurement it falls back to its dynamic mode.
+std::string audio_filter_chain(const FFmpegParams& ffmpeg_params, int track) {
+    std::vector<std::string> filters;
+    if (ffmpeg_params.audio_gain != 0.0) {
+        filters.push_back("volume=" + format_number(ffmpeg_params.audio_gain, 1) + "dB");
+    }
+    if (ffmpeg_params.normalize_mix && !ffmpeg_params.audio_channels.empty()) {
+        std::string channels = ffmpeg_params.audio_channels.substr(ffmpeg_params.audio_channels.find(' ') + 1);
+        std::string layout = channels == "6" ? "5.1" : channels == "1" ? "mono" : "stereo";
+        filters.push_back("aresample=rematrix_maxval=1:ochl=" + layout);
     }
 
-    // Always copy all streams from input
-    cmd.push_back("-map");
-    cmd.push_back("0");
+    if (!ffmpeg_params.loudness_log.empty()) {
+        // Fewer, longer frames keep the metadata log small; the last
+        // frame carries the totals
+        filters.push_back("asetnsamples=n=480000:p=0");
+        filters.push_back("ebur128=metadata=1:peak=true");
+        filters.push_back("ametadata=mode=print:file=" + ffmpeg_params.loudness_log + "-" +
+                          std::to_string(track) + ".log");
+    } else if (ffmpeg_params.loudness_target < 0) {
+        std::string loudnorm = "loudnorm=I=" + format_number(ffmpeg_params.loudness_target, 1) + ":TP=-1";
+        if (track < static_cast<int>(ffmpeg_params.loudness.size())) {
+            const Loudness& measured = ffmpeg_params.loudness[track];
+            if (measured.integrated <= -70.0) {
+                return join_string(filters, ",");  // silent, nothing to normalize
+            }
+            // The target range follows the source so loudnorm stays
+            // linear; ebur128 doesn't report the gate, it is 10 LU below
+            loudnorm += ":LRA=" + format_number(std::clamp(measured.range, 7.0, 20.0), 1) +
+                        ":measured_I=" + format_number(measured.integrated, 2) +
+                        ":measured_TP=" + format_number(measured.true_peak, 2) +
+                        ":measured_LRA=" + format_number(measured.range, 2) +
+                        ":measured_thresh=" + format_number(measured.integrated - 10.0, 2) + ":linear=true";
+        } else {
+            loudnorm += ":LRA=7";
+        }
+        filters.push_back(loudnorm + ":print_format=none");
+        filters.push_back("aresample=48000");  // loudnorm runs at 192 kHz
+    }
+    return join_string(filters, ",");
+}
 
-    // Add output file
-    cmd.push_back(output_file);
+// Audio encoder, downmix and filters. Measured loudness differs per
+// track, so each track gets its own filter then.
+void append_audio_options(std::vector<std::string>& cmd, const FFmpegParams& ffmpeg_params) {
+    std::vector<std::string> audio_parts = split_string(ffmpeg_params.acodec, ' ');
+    cmd.insert(cmd.end(), audio_parts.begin(), audio_parts.end());
+    if (!ffmpeg_params.audio_channels.empty()) {
+        std::vector<std::string> audio_channel_parts = split_string(ffmpeg_params.audio_channels, ' ');
+        cmd.insert(cmd.end(), audio_channel_parts.begin(), audio_channel_parts.end());
+    }
+    if (ffmpeg_params.acodec.find("copy") != std::string::npos) {
+        return;
+    }
 
-    return cmd;
+    if (ffmpeg_params.loudness_log.empty() && ffmpeg_params.loudness.empty()) {
+        std::string filters = audio_filter_chain(ffmpeg_params, 0);
+        if (!filters.empty()) {
+            cmd.push_back("-af");
+            cmd.push_back(filters);
+        }
+        return;
+    }
+    int tracks = std::max(ffmpeg_params.audio_tracks, static_cast<int>(ffmpeg_params.loudness.size()));
+    for (int track = 0; track < tracks; ++track) {
+        std::string filters = audio_filter_chain(ffmpeg_params, track);
+        if (!filters.empty()) {
+            cmd.push_back("-filter:a:" + std::to_string(track));
+            cmd.push_back(filters);
+        }
+    }
 }
 
-std::vector<std::vector<std::string>> build_multipass_commands(const std::string& input_file,
-                                                              const std::string& output_file,
-                                                              const FFmpegParams& ffmpeg_params,
-                                                              int analyze_duration,
-                                                              int probe_size,
-                                                              bool verbose) {
-    std::vector<std::vector<std::string>> commands;
+// Decoder options for the audio, given ahead of the input they apply to
+void append_audio_input_options(std::vector<std::string>& cmd, const FFmpegParams& ffmpeg_params) {
+    if (ffmpeg_params.drc_scale >= 0.0 && ffmpeg_params.acodec.find("copy") == std::string::npos) {
+        cmd.push_back("-drc_scale");
+        cmd.push_back(format_number(ffmpeg_params.drc_scale, 1));
+    }
+}
 
-    // Get appropriate null device
-    std::string null_device = get_null_device();
+// Loudness normalization needs the audio re-encoded; copied audio
+// becomes AAC at ffmpeg's per channel default bitrate
+void set_loudness_target(FFmpegParams& ffmpeg_params, double target) {
+    ffmpeg_params.loudness_target = target;
+    if (target < 0 && ffmpeg_params.acodec.find("copy") != std::string::npos) {
+        std::cout << "Note: --loudnorm re-encodes the audio that " << ffmpeg_params.preset_name
+                  << " copies, as AAC" << std::endl;
+        ffmpeg_params.acodec = "-c:a aac";
+    }
+}
 
-    // First pass command
-    std::vector<std::string> pass1_cmd = build_ffmpeg_command(input_file, null_device, ffmpeg_params,
+// The output file, or when more containers are wanted a tee muxer that
+// writes the same encoded streams into each of them
+void append_output(std::vector<std::string>& cmd, const std::string& output_file, const FFmpegParams& ffmpeg_params) {
+    if (ffmpeg_params.extra_formats.empty()) {
+        cmd.push_back(output_file);
+        return;
+    }
+
+    std::string format = fs::path(output_file).extension().string().substr(1);
+    std::vector<std::string> slaves = {"[f=" + tee_format_name(format) + "]" + tee_slave_name(output_file)};
+    for (const auto& extra_format : ffmpeg_params.extra_formats) {
+        std::string options = "f=" + tee_format_name(extra_format);
+        if (tee_format_name(extra_format) == "mp4" || extra_format == "mov") {
+            options += ":movflags=+faststart";
+        }
+        slaves.push_back("[" + options + "]" +
+                         tee_slave_name(fs::path(output_file).replace_extension(extra_format).string()));
+    }
+
+    cmd.insert(cmd.end(), {"-flags", "+global_header", "-f", "tee", join_string(slaves, "|")});
+}
+
+std::vector<std::string> build_ffmpeg_command(const std::string& input_file,
+                                             const std::string& output_file,
+                                             const FFmpegParams& ffmpeg_params,
+                                             int analyze_duration,
+                                             int probe_size,
+                                             bool verbose) {
+    std::vector<std::string> cmd;
+
+    // Base command with proper escaping and extended analysis parameters
+    cmd.push_back("ffmpeg");
+    cmd.push_back("-analyzeduration");
+    cmd.push_back(std::to_string(analyze_duration));
+    cmd.push_back("-probesize");
+    cmd.push_back(std::to_string(probe_size));
+    append_audio_input_options(cmd, ffmpeg_params);
+    cmd.push_back("-i");
+    cmd.push_back(input_file);
+    append_video_options(cmd, ffmpeg_params);
+
+    // Add audio settings
+    append_audio_options(cmd, ffmpeg_params);
+
+    // Add verbosity level
+    if (!verbose) {
+        cmd.push_back("-v");
+        cmd.push_back("error");
+        cmd.push_back("-stats");
+    }
+
+    // Always copy all streams from input
+    cmd.push_back("-map");
+    cmd.push_back("0");
+
+    // Add output file
+    append_output(cmd, output_file, ffmpeg_params);
+
+    return cmd;
+}
+
+std::vector<std::vector<std::string>> build_multipass_commands(const std::string& input_file,
+                                                              const std::string& output_file,
+                                                              const FFmpegParams& ffmpeg_params,
+                                                              int analyze_duration,
+                                                              int probe_size,
+                                                              bool verbose) {
+    std::vector<std::vector<std::string>> commands;
+
+    // Get appropriate null device
+    std::string null_device = get_null_device();
+
+    // First pass command, nothing is written so no extra containers or analysis
+    FFmpegParams pass1_params = ffmpeg_params;
+    pass1_params.extra_formats.clear();
+    strip_analysis_options(pass1_params);
+    std::vector<std::string> pass1_cmd = build_ffmpeg_command(input_file, null_device, pass1_params,
+                                                           analyze_duration, probe_size, verbose);
+
+    // Remove the output file (last element)
+    pass1_cmd.pop_back();
+
+    // Add pass and format parameters
+    pass1_cmd.push_back("-pass");
+    pass1_cmd.push_back("1");
+    if (!ffmpeg_params.passlogfile.empty()) {
+        pass1_cmd.push_back("-passlogfile");
+        pass1_cmd.push_back(ffmpeg_params.passlogfile);
+    }
+    pass1_cmd.push_back("-f");
+    pass1_cmd.push_back("null");
+    pass1_cmd.push_back(null_device);
+
+    // Second pass command
+    std::vector<std::string> pass2_cmd = build_ffmpeg_command(input_file, output_file, ffmpeg_params,
                                                            analyze_duration, probe_size, verbose);
+    pass2_cmd.push_back("-pass");
+    pass2_cmd.push_back("2");
+    if (!ffmpeg_params.passlogfile.empty()) {
+        pass2_cmd.push_back("-passlogfile");
+        pass2_cmd.push_back(ffmpeg_params.passlogfile);
+    }
+
+    commands.push_back(pass1_cmd);
+    commands.push_back(pass2_cmd);
+
+    return commands;
+}
+
+int execute_command(const std::vector<std::string>& cmd, bool verbose, const ExecContext& exec) {
+    std::string command = join_string(cmd, " ");
+
+    if (verbose) {
+        std::cout << "Executing: " << command << std::endl;
+    }
+
+#ifdef _WIN32
+    (void)exec;
+    return system(command.c_str());
+#else
+    // Everything the child needs is prepared before fork
+    std::vector<char*> argv;
+    for (const auto& arg : cmd) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int cpu : exec.cpus) {
+        CPU_SET(cpu, &cpu_set);
+    }
+
+    unsigned long node_mask[4] = {0, 0, 0, 0};
+    const unsigned long max_node = sizeof(node_mask) * 8;
+    for (int node : exec.nodes) {
+        if (node >= 0 && static_cast<unsigned long>(node) < max_node) {
+            node_mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+        }
+    }
+    // One node: prefer its memory but don't OOM if it fills; several: spread evenly
+    int mem_mode = exec.nodes.size() == 1 ? MPOL_PREFERRED : MPOL_INTERLEAVE;
+#endif
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cout << "Error: Could not start " << cmd[0] << std::endl;
+        return -1;
+    }
+
+    if (pid == 0) {
+#ifdef __linux__
+        if (!exec.cpus.empty()) {
+            sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+        }
+        if (!exec.nodes.empty()) {
+            syscall(SYS_set_mempolicy, mem_mode, node_mask, max_node);
+        }
+#endif
+        if (exec.idle_io) {
+            set_idle_io_priority();
+        }
+        if (exec.null_stdin) {
+            int devnull = open("/dev/null", O_RDONLY);
+            if (devnull >= 0) {
+                dup2(devnull, STDIN_FILENO);
+                close(devnull);
+            }
+        }
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    if (exec.children) {
+        ++*exec.children;
+    }
+    int status = 0;
+    struct rusage usage;
+    int waited = wait4(pid, &status, 0, &usage);
+    int running = exec.children ? (*exec.children)-- : 1;
+    if (waited < 0) {
+        return -1;
+    }
+    if (exec.cpu_usec) {
+        *exec.cpu_usec += (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+                          usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+    if (exec.max_rss) {
+        // ru_maxrss is in kilobytes. Chunks and segments running at once
+        // are alike, so this one's peak times their number stands for
+        // their sum.
+        long long rss = usage.ru_maxrss * 1024LL * std::max(1, running);
+        long long seen = exec.max_rss->load();
+        while (rss > seen && !exec.max_rss->compare_exchange_weak(seen, rss)) {
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+int read_command_output(const std::vector<std::string>& cmd, std::string& output) {
+    output.clear();
+#ifdef _WIN32
+    std::vector<std::string> escaped_cmd;
+    for (const auto& arg : cmd) {
+        escaped_cmd.push_back(escape_string(arg));
+    }
+    FILE* pipe = _popen(join_string(escaped_cmd, " ").c_str(), "r");
+    if (!pipe) {
+        return -1;
+    }
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+        output.append(buffer, n);
+    }
+    return _pclose(pipe);
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Child: stdout into the pipe, stderr discarded
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDERR_FILENO);
+            close(devnull);
+        }
+
+        std::vector<char*> argv;
+        for (const auto& arg : cmd) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    close(fds[1]);
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, n);
+    }
+    close(fds[0]);
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0) {
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+// Parse ffprobe rationals such as "30000/1001"
+double parse_rational(const std::string& value) {
+    size_t slash = value.find('/');
+    try {
+        if (slash == std::string::npos) {
+            return std::stod(value);
+        }
+        double num = std::stod(value.substr(0, slash));
+        double den = std::stod(value.substr(slash + 1));
+        return den != 0.0 ? num / den : 0.0;
+    } catch (...) {
+        return 0.0;
+    }
+}
+
+// A video stream's display rotation from its display matrix, or the older
+// rotate tag, in whole degrees counterclockwise from 0 to 270
+int display_rotation(const json& stream) {
+    double rotation = 0.0;
+    for (const auto& side_data : stream.value("side_data_list", json::array())) {
+        if (side_data.contains("rotation") && side_data["rotation"].is_number()) {
+            rotation = side_data["rotation"].get<double>();
+        }
+    }
+    std::string tag = stream.value("tags", json::object()).value("rotate", "");
+    if (rotation == 0.0 && !tag.empty()) {
+        rotation = -parse_rational(tag);
+    }
+    int quarter = static_cast<int>(std::lround(rotation / 90.0));
+    return ((quarter % 4) + 4) % 4 * 90;
+}
+
+MediaInfo probe_media(const std::string& file_path, int analyze_duration, int probe_size) {
+    MediaInfo info;
+
+    std::vector<std::string> cmd = {
+        "ffprobe", "-v", "error",
+        "-analyzeduration", std::to_string(analyze_duration),
+        "-probesize", std::to_string(probe_size),
+        "-print_format", "json", "-show_format", "-show_streams",
+        file_path
+    };
+
+    std::string output;
+    if (read_command_output(cmd, output) != 0) {
+        return info;
+    }
+
+    try {
+        json data = json::parse(output);
+
+        for (const auto& stream : data.value("streams", json::array())) {
+            std::string codec_type = stream.value("codec_type", "");
+            if (codec_type == "video" && info.width == 0) {
+                // Skip attached cover art, it is not the main video stream
+                if (stream.contains("disposition") && stream["disposition"].value("attached_pic", 0) == 1) {
+                    continue;
+                }
+                info.video_codec = stream.value("codec_name", "");
+                info.width = stream.value("width", 0);
+                info.height = stream.value("height", 0);
+                info.framerate = parse_rational(stream.value("avg_frame_rate", "0/0"));
+                if (info.framerate <= 0.0) {
+                    info.framerate = parse_rational(stream.value("r_frame_rate", "0/0"));
+                }
+                info.video_start_time = parse_rational(stream.value("start_time", "0"));
+                info.video_duration = parse_rational(stream.value("duration", "0"));
+                // Matroska only has it as an HH:MM:SS.fraction tag
+                std::string tag = stream.value("tags", json::object()).value("DURATION", "");
+                if (info.video_duration <= 0.0 && std::count(tag.begin(), tag.end(), ':') == 2) {
+                    info.video_duration = parse_rational(tag.substr(0, tag.find(':'))) * 3600 +
+                                          parse_rational(tag.substr(tag.find(':') + 1, 2)) * 60 +
+                                          parse_rational(tag.substr(tag.rfind(':') + 1));
+                }
+                std::string sample_aspect = stream.value("sample_aspect_ratio", "1:1");
+                std::replace(sample_aspect.begin(), sample_aspect.end(), ':', '/');
+                info.sample_aspect = parse_rational(sample_aspect) > 0.0 ? parse_rational(sample_aspect) : 1.0;
+                // ffmpeg turns the picture upright ahead of the filters, so
+                // cropping and sizing work on the turned sides
+                info.rotation = display_rotation(stream);
+                if (info.rotation == 90 || info.rotation == 270) {
+                    std::swap(info.width, info.height);
+                    info.sample_aspect = 1.0 / info.sample_aspect;
+                }
+                std::string field_order = stream.value("field_order", "");
+                if (field_order == "tt" || field_order == "tb") {
+                    info.field_order = "tff";
+                } else if (field_order == "bb" || field_order == "bt") {
+                    info.field_order = "bff";
+                }
+            } else if (codec_type == "audio") {
+                info.audio_streams++;
+                info.audio_codecs.push_back(stream.value("codec_name", ""));
+                info.audio_start_times.push_back(parse_rational(stream.value("start_time", "0")));
+                json disposition = stream.value("disposition", json::object());
+                std::vector<std::string> flags;
+                for (const auto& flag : disposition.items()) {
+                    if (flag.value().is_number() && flag.value().get<int>() == 1) {
+                        flags.push_back(flag.key());
+                    }
+                }
+                info.audio_dispositions.push_back(flags.empty() ? "0" : join_string(flags, "+"));
+            } else if (codec_type == "subtitle") {
+                info.subtitle_codecs.push_back(stream.value("codec_name", ""));
+            }
+        }
+
+        json format = data.value("format", json::object());
+        info.duration = parse_rational(format.value("duration", "0"));
+        info.start_time = parse_rational(format.value("start_time", "0"));
+        info.valid = true;
+    } catch (json::exception& e) {
+        std::cout << "Warning: Could not parse ffprobe output for " << file_path << ": " << e.what() << std::endl;
+        return info;
+    }
+
+    try {
+        info.file_size = fs::file_size(file_path);
+    } catch (const fs::filesystem_error&) {
+        info.file_size = 0;
+    }
+
+    return info;
+}
+
+int get_available_cpus() {
+    int cpus = 0;
+
+#ifdef __linux__
+    // Honour the affinity mask we were started with (taskset, cpuset cgroups)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        cpus = CPU_COUNT(&set);
+    }
+#endif
+
+    if (cpus <= 0) {
+        cpus = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    if (cpus <= 0) {
+        cpus = 1;
+    }
+
+#ifdef __linux__
+    // Honour a CFS bandwidth quota (cgroup v2 cpu.max, then cgroup v1)
+    std::ifstream cgroup_file("/proc/self/cgroup");
+    std::string cgroup_path = parse_cgroup_path(cgroup_file);
+
+    double quota_cpus = 0.0;
+    std::ifstream cpu_max("/sys/fs/cgroup" + cgroup_path + "/cpu.max");
+    if (!cpu_max.is_open()) {
+        cpu_max.open("/sys/fs/cgroup/cpu.max");
+    }
+
+    std::string quota, period;
+    if (cpu_max >> quota >> period) {
+        if (quota != "max") {
+            double p = parse_rational(period);
+            quota_cpus = p > 0.0 ? parse_rational(quota) / p : 0.0;
+        }
+    } else {
+        std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        long quota_us = -1, period_us = 0;
+        if (quota_file >> quota_us && period_file >> period_us && quota_us > 0 && period_us > 0) {
+            quota_cpus = static_cast<double>(quota_us) / period_us;
+        }
+    }
+
+    if (quota_cpus > 0.0) {
+        int limit = std::max(1, static_cast<int>(std::ceil(quota_cpus)));
+        cpus = std::min(cpus, limit);
+    }
+#endif
+
+    return cpus;
+}
+
+// MemAvailable in /proc/meminfo, in bytes; 0 when it isn't there
+uintmax_t parse_mem_available(std::istream& meminfo) {
+    std::string key;
+    uintmax_t value;
+    std::string unit;
+    while (meminfo >> key >> value) {
+        std::getline(meminfo, unit);
+        if (key == "MemAvailable:") {
+            return value * 1024;
+        }
+    }
+    return 0;
+}
+
+// The v2 cgroup in /proc/self/cgroup ("0::/path"); empty under v1
+std::string parse_cgroup_path(std::istream& cgroup) {
+    std::string path;
+    std::string line;
+    while (std::getline(cgroup, line)) {
+        if (line.rfind("0::", 0) == 0) {
+            path = line.substr(3);
+        }
+    }
+    return path;
+}
+
+// What is left under a cgroup memory limit; the largest value when there
+// is no limit ("max") or it can't be read. v1 reports no limit as a huge
+// number, which comes out huge too.
+uintmax_t cgroup_memory_left(const std::string& limit, const std::string& usage) {
+    try {
+        if (limit != "max") {
+            uintmax_t limit_bytes = std::stoull(limit);
+            uintmax_t usage_bytes = std::stoull(usage);
+            return limit_bytes > usage_bytes ? limit_bytes - usage_bytes : 0;
+        }
+    } catch (...) {
+    }
+    return std::numeric_limits<uintmax_t>::max();
+}
+
+// Memory jobs can use: MemAvailable, or what is left under the cgroup
+// limit (v2 memory.max, then v1) when that is less. 0 when unknown.
+uintmax_t get_available_memory(std::string& source) {
+    uintmax_t available = 0;
+    source.clear();
+
+#ifdef __linux__
+    std::ifstream meminfo("/proc/meminfo");
+    available = parse_mem_available(meminfo);
+    if (available > 0) {
+        source = "MemAvailable";
+    }
+
+    std::ifstream cgroup_file("/proc/self/cgroup");
+    std::string cgroup_path = parse_cgroup_path(cgroup_file);
+
+    std::string limit, usage;
+    std::ifstream memory_max("/sys/fs/cgroup" + cgroup_path + "/memory.max");
+    std::ifstream memory_current("/sys/fs/cgroup" + cgroup_path + "/memory.current");
+    if (!(memory_max >> limit && memory_current >> usage)) {
+        memory_max = std::ifstream("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+        memory_current = std::ifstream("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+        if (!(memory_max >> limit && memory_current >> usage)) {
+            limit = "max";
+        }
+    }
+    uintmax_t left = cgroup_memory_left(limit, usage);
+    if (left != std::numeric_limits<uintmax_t>::max() && (available == 0 || left < available)) {
+        available = left;
+        source = "cgroup memory limit";
+    }
+#endif
+
+    return available;
+}
+
+// Encoder cost relative to a 1080p frame. Work per frame scales with the
+// pixel count but parallelism doesn't scale linearly with it, hence sqrt.
+double resolution_weight(int width, int height) {
+    if (width <= 0 || height <= 0) {
+        return 1.0;
+    }
+    double weight = std::sqrt((static_cast<double>(width) * height) / (1920.0 * 1080.0));
+    return std::clamp(weight, 0.25, 4.0);
+}
+
+void get_output_dimensions(const FFmpegParams& ffmpeg_params, const MediaInfo& media, int& width, int& height) {
+    width = 0;
+    height = 0;
+
+    size_t x = ffmpeg_params.resolution.find('x');
+    if (x != std::string::npos) {
+        try {
+            width = std::stoi(ffmpeg_params.resolution.substr(0, x));
+            height = std::stoi(ffmpeg_params.resolution.substr(x + 1));
+        } catch (...) {
+            width = 0;
+            height = 0;
+        }
+    }
+
+    // Fall back to the (cropped) source size when there is no scaling
+    if (width <= 0 || height <= 0) {
+        width = ffmpeg_params.source_width > 0 ? ffmpeg_params.source_width : media.width;
+        height = ffmpeg_params.source_height > 0 ? ffmpeg_params.source_height : media.height;
+    }
+}
+
+// Relative encoder work per output pixel and frame, x264 "medium" = 1.
+// Rough figures; they only need to rank jobs against each other.
+double encoder_speed_factor(const FFmpegParams& ffmpeg_params) {
+    static const std::map<std::string, double> preset_factors = {
+        {"ultrafast", 0.15}, {"superfast", 0.22}, {"veryfast", 0.35}, {"faster", 0.6}, {"fast", 0.8},
+        {"medium", 1.0}, {"slow", 1.6}, {"slower", 3.0}, {"veryslow", 6.0}, {"placebo", 15.0}
+    };
+
+    double factor = 1.0;
+    const EncoderInfo* encoder = find_encoder(ffmpeg_params);
+    auto preset = preset_factors.find(ffmpeg_params.preset);
+    if (preset != preset_factors.end()) {
+        factor = preset->second;
+    } else if (encoder) {
+        // Numbered or vendor presets: about 1.5x per step from the default
+        auto position = [&](const std::string& name) {
+            auto found = std::find_if(encoder->presets.begin(), encoder->presets.end(),
+                                      [&](const auto& entry) { return entry.first == name; });
+            return static_cast<int>(found - encoder->presets.begin());
+        };
+        int steps = position(encoder->default_preset) - position(ffmpeg_params.preset);
+        if (position(ffmpeg_params.preset) < static_cast<int>(encoder->presets.size())) {
+            factor = std::pow(1.5, steps);
+        }
+    }
+    if (encoder) {
+        factor *= encoder->speed;
+    }
+    // A first pass costs roughly half a second one
+    if (uses_two_pass(ffmpeg_params)) {
+        factor *= 1.5;
+    }
+    return factor;
+}
+
+// Estimated encode work for one output: duration x output frame rate x
+// output pixels (in 1080p frames) x encoder speed factor. Without a probe
+// the file size stands in for the duration, at about 1 MB per second.
+double estimate_encode_cost(const FFmpegParams& ffmpeg_params, const MediaInfo& media, const std::string& input_file) {
+    double duration = media.duration;
+    if (!media.valid || duration <= 0.0) {
+        std::error_code ec;
+        auto size = fs::file_size(input_file, ec);
+        duration = ec ? 0.0 : static_cast<double>(size) / 1e6;
+    }
+
+    double fps = media.framerate > 0.0 ? media.framerate : 24.0;
+    if (ffmpeg_params.framerate != "auto" && !ffmpeg_params.framerate.empty() && parse_rational(ffmpeg_params.framerate) > 0) {
+        fps = parse_rational(ffmpeg_params.framerate);
+    }
+
+    int width, height;
+    get_output_dimensions(ffmpeg_params, media, width, height);
+    double frame_size = (width > 0 && height > 0) ? (static_cast<double>(width) * height) / (1920.0 * 1080.0) : 1.0;
+
+    return duration * fps * frame_size * encoder_speed_factor(ffmpeg_params);
+}
+
+// Per-user directory under an XDG base (e.g. XDG_CACHE_HOME, falling back
+// to ~/.cache), or the temp directory without a home
+fs::path get_user_dir(const char* xdg_variable, const std::string& home_fallback) {
+    const char* xdg_dir = getenv(xdg_variable);
+    const char* home = getenv("HOME");
+    fs::path root = xdg_dir && *xdg_dir ? fs::path(xdg_dir)
+                  : home && *home ? fs::path(home) / home_fallback
+                  : fs::temp_directory_path();
+    return root / "hb-ffmpeg-conv";
+}
+
+std::string speed_model_key(const FFmpegParams& ffmpeg_params) {
+    bool two_pass = uses_two_pass(ffmpeg_params);
+    return ffmpeg_params.vcodec + "/" + ffmpeg_params.preset + (two_pass ? "/2pass" : "");
+}
+
+// Fit the speed model to the recorded jobs. Speeds are in 1080p frames
+// per CPU second; the normalized speed is the same with the encoder
+// speed factor taken out, for settings that have no history yet.
+ThroughputModel load_throughput_model(const std::string& stats_file) {
+    ThroughputModel model;
+    double normalized_frames = 0.0;
+    double busy_seconds = 0.0;
+    double available_seconds = 0.0;
+
+    std::ifstream in(stats_file);
+    std::string line;
+    while (std::getline(in, line)) {
+        json record;
+        try {
+            record = json::parse(line);
+        } catch (json::parse_error&) {
+            continue;
+        }
+        double frames = record.value("frames_1080p", 0.0);
+        double cpu_seconds = record.value("cpu_seconds", 0.0);
+        double wall_seconds = record.value("wall_seconds", 0.0);
+        int threads = record.value("threads", 0);
+        if (frames <= 0.0 || cpu_seconds <= 0.0) {
+            continue;
+        }
+
+        auto& setting = model.settings[record.value("setting", std::string())];
+        setting.first += frames;
+        setting.second += cpu_seconds;
+        double estimated_rss = record.value("estimated_rss", 0.0);
+        double max_rss = record.value("max_rss", 0.0);
+        if (estimated_rss > 0.0 && max_rss > 0.0) {
+            auto& memory = model.memory[record.value("encoder", std::string())];
+            memory.first += estimated_rss;
+            memory.second += max_rss;
+        }
+        double output_bytes = record.value("output_bytes", 0.0);
+        if (output_bytes > 0.0 && record.contains("quality")) {
+            auto& size = model.sizes[record.value("setting", std::string()) + " " +
+                                     record.value("quality", std::string())];
+            size.first += frames;
+            size.second += output_bytes;
+        }
+        normalized_frames += frames * record.value("speed_factor", 1.0);
+        model.cpu_seconds += cpu_seconds;
+        if (wall_seconds > 0.0 && threads > 0) {
+            busy_seconds += cpu_seconds;
+            available_seconds += wall_seconds * threads;
+        }
+        model.runs++;
+    }
+
+    if (model.cpu_seconds > 0.0) {
+        model.normalized_speed = normalized_frames / model.cpu_seconds;
+    }
+    if (available_seconds > 0.0) {
+        model.utilization = std::clamp(busy_seconds / available_seconds, 0.2, 1.0);
+    }
+    return model;
+}
+
+// CPU seconds an encode is expected to take; cost is estimate_encode_cost()
+double predict_cpu_seconds(const ThroughputModel& model, const FFmpegParams& ffmpeg_params, double cost) {
+    auto setting = model.settings.find(speed_model_key(ffmpeg_params));
+    if (setting != model.settings.end() && setting->second.first > 0.0) {
+        double speed = setting->second.first / setting->second.second;
+        return cost / encoder_speed_factor(ffmpeg_params) / speed;
+    }
+    return cost / model.normalized_speed;
+}
+
+std::string size_model_key(const FFmpegParams& ffmpeg_params) {
+    return speed_model_key(ffmpeg_params) + " " + ffmpeg_params.quality;
+}
+
+// Bytes an encode is expected to write. Earlier runs at the same setting
+// and quality give the size per 1080p frame, audio included. Otherwise
+// bitrate targets give the video size outright and constant quality gets
+// a generous guess. Unprobed inputs are assumed to come out the size they
+// went in. Encodes written in parts (chunks, checkpoint segments, split
+// audio) keep the parts until they are joined, about twice the output.
+uintmax_t predict_output_bytes(const ThroughputModel& model, const FFmpegParams& ffmpeg_params,
+                               const MediaInfo& media, double cost, bool in_parts) {
+    double parts = in_parts ? 2.0 : 1.0;
+    if (!media.valid || media.duration <= 0.0) {
+        return static_cast<uintmax_t>(media.file_size * parts);
+    }
+
+    double frames_1080p = cost / encoder_speed_factor(ffmpeg_params);
+    double containers = (1.0 + ffmpeg_params.extra_formats.size()) * parts;
+    auto size = model.sizes.find(size_model_key(ffmpeg_params));
+    if (size != model.sizes.end() && size->second.first > 0.0) {
+        return static_cast<uintmax_t>(frames_1080p * size->second.second / size->second.first * containers);
+    }
+
+    double video_bytes;
+    if (ffmpeg_params.quality.rfind("-b:v ", 0) == 0) {
+        video_bytes = parse_rational(ffmpeg_params.quality.substr(5)) * 1000.0 / 8.0 * media.duration;
+    } else {
+        // 0.1 bits per pixel is a large constant quality encode; lossless
+        // keeps several bits of every pixel
+        double bits_per_pixel = ffmpeg_params.quality.empty() ? 6.0 : 0.1;
+        video_bytes = frames_1080p * 1920.0 * 1080.0 * bits_per_pixel / 8.0;
+    }
+
+    // Copied audio is taken at the largest common AC-3 rate
+    double audio_kbps = 640.0;
+    size_t bitrate = ffmpeg_params.acodec.find("-b:a ");
+    if (bitrate != std::string::npos) {
+        audio_kbps = parse_rational(ffmpeg_params.acodec.substr(bitrate + 5));
+    }
+    double audio_bytes = media.audio_streams * audio_kbps * 1000.0 / 8.0 * media.duration;
+    return static_cast<uintmax_t>((video_bytes + audio_bytes) * containers);
+}
+
+// Peak resident memory of an encode: the frames the encoder keeps in
+// flight (lookahead, frame threads, references) times what it stores per
+// frame, the decoder's and filters' frames at source size, and a fixed
+// amount for ffmpeg itself
+uintmax_t estimate_peak_rss(const FFmpegParams& ffmpeg_params, const MediaInfo& media) {
+    int width, height;
+    get_output_dimensions(ffmpeg_params, media, width, height);
+    if (width <= 0 || height <= 0) {
+        width = 1920;
+        height = 1080;
+    }
+    // yuv420p10le, p010le, yuv444p12le; not nv12
+    bool deep = ffmpeg_params.pix_fmt.find("p10") != std::string::npos ||
+                ffmpeg_params.pix_fmt.find("p12") != std::string::npos ||
+                ffmpeg_params.pix_fmt.find("p010") != std::string::npos;
+    double frame_bytes = static_cast<double>(width) * height * 1.5 * (deep ? 2 : 1);
+    double source_bytes = media.width > 0 && media.height > 0 ? media.width * media.height * 1.5 : frame_bytes;
+
+    std::map<std::string, std::string> options;
+    for (const auto& option : split_encoder_options(ffmpeg_params.encoder_options)) {
+        size_t equals = option.find('=');
+        if (equals != std::string::npos) {
+            options[option.substr(0, equals)] = option.substr(equals + 1);
+        }
+    }
+    auto option = [&](const std::string& key, int fallback) {
+        try {
+            return options.count(key) ? std::stoi(options[key]) : fallback;
+        } catch (...) {
+            return fallback;
+        }
+    };
+
+    // Per frame in flight, relative to the picture: x265 works on 16-bit
+    // samples and keeps per-CTU analysis, the others less
+    int lookahead = 4;
+    int frame_threads = 1;
+    double per_frame = 1.5;
+    if (ffmpeg_params.vcodec == "libx265") {
+        lookahead = option("rc-lookahead", 20);
+        frame_threads = option("frame-threads", height >= 1440 ? 6 : (height >= 720 ? 4 : 2));
+        per_frame = 4.0;
+    } else if (ffmpeg_params.vcodec == "libx264") {
+        lookahead = option("rc-lookahead", 40);
+        frame_threads = 8;
+        per_frame = 2.0;
+    } else if (ffmpeg_params.vcodec == "libsvtav1") {
+        lookahead = option("lookahead", 60);
+        per_frame = 3.0;
+    } else if (ffmpeg_params.vcodec == "libvpx-vp9") {
+        lookahead = 25;
+        per_frame = 2.0;
+    }
+    double frames_in_flight = lookahead + 4.0 * frame_threads + 8.0;
+
+    return static_cast<uintmax_t>(150e6 + frame_bytes * per_frame * frames_in_flight + source_bytes * 16.0);
+}
+
+// The estimate, scaled by how far off it was for this encoder in earlier runs
+uintmax_t predict_peak_rss(const ThroughputModel& model, const FFmpegParams& ffmpeg_params, const MediaInfo& media) {
+    double estimate = static_cast<double>(estimate_peak_rss(ffmpeg_params, media));
+    auto memory = model.memory.find(ffmpeg_params.vcodec);
+    if (memory != model.memory.end() && memory->second.first > 0.0) {
+        estimate *= std::clamp(memory->second.second / memory->second.first, 0.25, 4.0);
+    }
+    return static_cast<uintmax_t>(estimate);
+}
+
+// Wall time for a set of jobs run max_jobs at a time, biggest first, each
+// with an even share of the CPUs
+double project_wall_seconds(std::vector<double> cpu_seconds, int max_jobs, int total_cpus, double utilization) {
+    std::sort(cpu_seconds.rbegin(), cpu_seconds.rend());
+    int slots = std::max(1, std::min<int>(max_jobs, static_cast<int>(cpu_seconds.size())));
+    double threads_per_job = std::max(1.0, static_cast<double>(total_cpus) / slots);
+    std::vector<double> slot_end(slots, 0.0);
+    for (double cpu : cpu_seconds) {
+        auto slot = std::min_element(slot_end.begin(), slot_end.end());
+        *slot += cpu / (threads_per_job * utilization);
+    }
+    return slot_end.empty() ? 0.0 : *std::max_element(slot_end.begin(), slot_end.end());
+}
+
+std::string format_duration(double seconds) {
+    long total = std::lround(std::max(0.0, seconds));
+    std::ostringstream out;
+    if (total >= 3600) {
+        out << total / 3600 << "h " << std::setw(2) << std::setfill('0') << (total % 3600) / 60 << "m";
+    } else if (total >= 60) {
+        out << total / 60 << "m " << std::setw(2) << std::setfill('0') << total % 60 << "s";
+    } else {
+        out << total << "s";
+    }
+    return out.str();
+}
+
+// The slowest preset of the encoder, never slower than the requested one,
+// that is at least `speedup` times faster than it by
+// encoder_speed_factor(). Encoders without presets keep theirs.
+std::string govern_preset(const FFmpegParams& ffmpeg_params, const std::string& requested, double speedup) {
+    const EncoderInfo* encoder = find_encoder(ffmpeg_params);
+    std::vector<std::string> presets;
+    if (encoder && !encoder->preset_option.empty()) {
+        for (const auto& entry : encoder->presets) {
+            presets.push_back(entry.first);
+        }
+    }
+
+    auto start = std::find(presets.begin(), presets.end(), requested);
+    if (start == presets.end()) {
+        return ffmpeg_params.preset;
+    }
+
+    FFmpegParams params = ffmpeg_params;
+    params.preset = requested;
+    double requested_factor = encoder_speed_factor(params);
+    for (auto preset = start; preset != presets.end(); ++preset) {
+        params.preset = *preset;
+        if (requested_factor / encoder_speed_factor(params) >= speedup) {
+            return *preset;
+        }
+    }
+    return presets.back();
+}
+
+// --deadline: "HH:MM" (the next time it comes round) or "+DURATION" with
+// an s, m or h suffix, e.g. "+90m"
+bool parse_deadline(const std::string& value, std::chrono::system_clock::time_point& deadline) {
+    auto now = std::chrono::system_clock::now();
+    try {
+        if (!value.empty() && value[0] == '+') {
+            size_t used = 0;
+            double amount = std::stod(value.substr(1), &used);
+            std::string unit = value.substr(1 + used);
+            double scale = unit.empty() || unit == "s" ? 1.0 : unit == "m" ? 60.0 : unit == "h" ? 3600.0 : 0.0;
+            if (amount <= 0.0 || scale == 0.0) {
+                return false;
+            }
+            deadline = now + std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                                 std::chrono::duration<double>(amount * scale));
+            return true;
+        }
+
+        size_t colon = value.find(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        int hour = std::stoi(value.substr(0, colon));
+        int minute = std::stoi(value.substr(colon + 1));
+        if (hour < 0 || hour > 23 || minute < 0 || minute > 59) {
+            return false;
+        }
+
+        std::time_t now_time = std::chrono::system_clock::to_time_t(now);
+        std::tm local = *std::localtime(&now_time);
+        local.tm_hour = hour;
+        local.tm_min = minute;
+        local.tm_sec = 0;
+        deadline = std::chrono::system_clock::from_time_t(std::mktime(&local));
+        if (deadline <= now) {
+            local.tm_mday += 1;
+            deadline = std::chrono::system_clock::from_time_t(std::mktime(&local));
+        }
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// Append a record to a JSON lines file; concurrent jobs share the files
+void append_json_line(const std::string& file, const json& record) {
+    static std::mutex file_mutex;
+    std::lock_guard<std::mutex> guard(file_mutex);
+
+    std::error_code ec;
+    fs::create_directories(fs::path(file).parent_path(), ec);
+    std::ofstream out(file, std::ios::app);
+    if (out.is_open()) {
+        out << record.dump() << std::endl;
+    }
+}
+
+// Append one finished job to the stats store, one JSON object per line
+void record_job_stats(const std::string& stats_file, const json& record) {
+    append_json_line(stats_file, record);
+}
+
+// Share of the machine for a job starting now. The running jobs keep their
+// threads; the remaining free slots are assumed to be filled by jobs of the
+// same weight as this one.
+int plan_job_threads(double weight, double running_weight, int running_jobs, int slots, int total_cpus) {
+    int free_slots = std::max(1, slots - running_jobs);
+    double expected_weight = running_weight + weight * free_slots;
+    if (expected_weight <= 0.0) {
+        return total_cpus;
+    }
+    int threads = static_cast<int>(std::lround(total_cpus * weight / expected_weight));
+    return std::clamp(threads, 1, total_cpus);
+}
+
+// Set key=value in the encoder parameter list, replacing an earlier value
+void set_encoder_option(FFmpegParams& ffmpeg_params, const std::string& key, const std::string& value) {
+    std::vector<std::string> options;
+    for (const auto& option : split_encoder_options(ffmpeg_params.encoder_options)) {
+        if (option.substr(0, option.find('=')) != key) {
+            options.push_back(option);
+        }
+    }
+    options.push_back(key + "=" + value);
+    ffmpeg_params.encoder_options = join_string(options, ":");
+}
+
+void apply_thread_budget(FFmpegParams& ffmpeg_params, int threads, int width, int height) {
+    ffmpeg_params.threads = threads;
+    ffmpeg_params.encoder_flags.clear();
+
+    if (ffmpeg_params.vcodec == "libx265") {
+        // Frame threads beyond what the CTU rows can feed only add latency
+        // and memory, so cap them lower for small pictures. WPP keeps the
+        // pool busy within each frame.
+        int max_frame_threads = height >= 1440 ? 6 : (height >= 720 ? 4 : 2);
+        int frame_threads = std::clamp((threads + 3) / 4, 1, max_frame_threads);
+        set_encoder_option(ffmpeg_params, "pools", std::to_string(threads));
+        set_encoder_option(ffmpeg_params, "frame-threads", std::to_string(frame_threads));
+        set_encoder_option(ffmpeg_params, "wpp", "1");
+    } else if (ffmpeg_params.vcodec == "libx264") {
+        // Same ratio x264 uses by default, but against our budget
+        int lookahead_threads = std::max(1, threads / 6);
+        set_encoder_option(ffmpeg_params, "lookahead_threads", std::to_string(lookahead_threads));
+    } else if (ffmpeg_params.vcodec == "libsvtav1") {
+        // SVT-AV1 sizes its own thread pools from the logical processors
+        set_encoder_option(ffmpeg_params, "lp", std::to_string(threads));
+    } else if (ffmpeg_params.vcodec == "libvpx-vp9") {
+        // libvpx only threads across tile columns, which are at least 256
+        // pixels wide, and rows within them with row-mt
+        int log2_columns = 0;
+        while ((2 << log2_columns) <= threads && (512 << log2_columns) <= width) {
+            ++log2_columns;
+        }
+        ffmpeg_params.encoder_flags = {"-row-mt", "1", "-tile-columns", std::to_string(log2_columns)};
+    } else if (ffmpeg_params.vcodec == "ffv1") {
+        // FFV1 threads across slices, which need version 2 or later; 3
+        // unless the preset picked a level, which is then kept as is
+        if (ffmpeg_params.level.empty()) {
+            ffmpeg_params.level = "3";
+        }
+        int slices = threads >= 24 ? 24 : threads >= 16 ? 16 : threads >= 12 ? 12 : threads >= 9 ? 9
+                   : threads >= 6 ? 6 : 4;
+        if (std::atoi(ffmpeg_params.level.c_str()) >= 2) {
+            ffmpeg_params.encoder_flags = {"-slices", std::to_string(slices)};
+        }
+    }
+}
+
+// Parse kernel CPU lists such as "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    for (const auto& range : split_string(list, ',')) {
+        try {
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } catch (...) {
+            continue;
+        }
+    }
+    return cpus;
+}
+
+std::string format_cpu_list(const std::vector<int>& cpus) {
+    std::vector<int> sorted = cpus;
+    std::sort(sorted.begin(), sorted.end());
+
+    std::vector<std::string> ranges;
+    for (size_t i = 0; i < sorted.size(); ) {
+        size_t j = i;
+        while (j + 1 < sorted.size() && sorted[j + 1] == sorted[j] + 1) {
+            ++j;
+        }
+        ranges.push_back(i == j ? std::to_string(sorted[i])
+                                : std::to_string(sorted[i]) + "-" + std::to_string(sorted[j]));
+        i = j + 1;
+    }
+    return join_string(ranges, ",");
+}
+
+CpuTopology read_cpu_topology() {
+    CpuTopology topology;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                topology.cpus.push_back(cpu);
+            }
+        }
+    }
+
+    // NUMA nodes
+    std::set<int> nodes;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator("/sys/devices/system/node", ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+            !std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+            continue;
+        }
+        int node = std::stoi(name.substr(4));
+        std::ifstream cpulist(entry.path() / "cpulist");
+        std::string list;
+        if (std::getline(cpulist, list)) {
+            for (int cpu : parse_cpu_list(list)) {
+                topology.node_of[cpu] = node;
+            }
+            nodes.insert(node);
+        }
+    }
+
+    // Last level caches; the domain id is the lowest CPU sharing the cache
+    for (int cpu : topology.cpus) {
+        fs::path cache_dir = fs::path("/sys/devices/system/cpu") / ("cpu" + std::to_string(cpu)) / "cache";
+        for (int index = 0; index < 8; ++index) {
+            fs::path index_dir = cache_dir / ("index" + std::to_string(index));
+            std::ifstream level_file(index_dir / "level");
+            int level = 0;
+            if (!(level_file >> level)) {
+                break;
+            }
+            if (level != 3) {
+                continue;
+            }
+            std::ifstream shared(index_dir / "shared_cpu_list");
+            std::string list;
+            if (std::getline(shared, list)) {
+                std::vector<int> sharing = parse_cpu_list(list);
+                if (!sharing.empty()) {
+                    topology.l3_of[cpu] = *std::min_element(sharing.begin(), sharing.end());
+                }
+            }
+        }
+    }
+
+    topology.node_count = std::max<int>(1, static_cast<int>(nodes.size()));
+#endif
+
+    if (topology.cpus.empty()) {
+        int cpus = static_cast<int>(std::thread::hardware_concurrency());
+        for (int cpu = 0; cpu < std::max(1, cpus); ++cpu) {
+            topology.cpus.push_back(cpu);
+        }
+    }
+
+    // Without sysfs details treat the machine as one node with one shared cache
+    for (int cpu : topology.cpus) {
+        if (topology.node_of.find(cpu) == topology.node_of.end()) {
+            topology.node_of[cpu] = 0;
+        }
+        if (topology.l3_of.find(cpu) == topology.l3_of.end()) {
+            topology.l3_of[cpu] = -1 - topology.node_of[cpu];
+        }
+    }
+
+    return topology;
+}
+
+// Pick `count` free CPUs for a job, keeping it inside as few L3 caches and
+// NUMA nodes as possible. Best fit: the smallest cache (then node) that
+// still holds the whole job, so larger holes stay free for larger jobs.
+std::vector<int> allocate_cpus(const CpuTopology& topology, std::set<int>& free_cpus, int count) {
+    std::map<int, std::vector<int>> free_by_l3;
+    std::map<int, std::vector<int>> free_by_node;
+    for (int cpu : free_cpus) {
+        free_by_l3[topology.l3_of.at(cpu)].push_back(cpu);
+        free_by_node[topology.node_of.at(cpu)].push_back(cpu);
+    }
+
+    count = std::min<int>(count, static_cast<int>(free_cpus.size()));
+    std::vector<int> chosen;
+    if (count <= 0) {
+        return chosen;
+    }
+
+    auto best_fit = [count](const std::map<int, std::vector<int>>& groups) {
+        const std::vector<int>* best = nullptr;
+        for (const auto& group : groups) {
+            if (static_cast<int>(group.second.size()) >= count &&
+                (best == nullptr || group.second.size() < best->size())) {
+                best = &group.second;
+            }
+        }
+        return best;
+    };
+
+    // Take CPUs from the given candidates, emptiest caches last
+    auto take_from = [&](const std::vector<int>& candidates) {
+        std::map<int, std::vector<int>> by_l3;
+        for (int cpu : candidates) {
+            by_l3[topology.l3_of.at(cpu)].push_back(cpu);
+        }
+        std::vector<std::vector<int>> groups;
+        for (auto& group : by_l3) {
+            groups.push_back(group.second);
+        }
+        std::stable_sort(groups.begin(), groups.end(), [](const std::vector<int>& a, const std::vector<int>& b) {
+            return a.size() > b.size();
+        });
+        for (const auto& group : groups) {
+            for (int cpu : group) {
+                if (static_cast<int>(chosen.size()) == count) {
+                    return;
+                }
+                chosen.push_back(cpu);
+            }
+        }
+    };
+
+    if (const std::vector<int>* l3 = best_fit(free_by_l3)) {
+        take_from(*l3);
+    } else if (const std::vector<int>* node = best_fit(free_by_node)) {
+        take_from(*node);
+    } else {
+        // Spans nodes: fill the nodes with the most free CPUs first
+        std::vector<std::vector<int>> nodes;
+        for (auto& node : free_by_node) {
+            nodes.push_back(node.second);
+        }
+        std::stable_sort(nodes.begin(), nodes.end(), [](const std::vector<int>& a, const std::vector<int>& b) {
+            return a.size() > b.size();
+        });
+        for (const auto& node : nodes) {
+            take_from(node);
+        }
+    }
+
+    for (int cpu : chosen) {
+        free_cpus.erase(cpu);
+    }
+    std::sort(chosen.begin(), chosen.end());
+    return chosen;
+}
+
+// A path, or its nearest ancestor that exists: where a file about to be
+// created will live
+fs::path nearest_existing(const fs::path& path) {
+    std::error_code ec;
+    fs::path existing = fs::absolute(path, ec);
+    while (!fs::exists(existing, ec) && existing.has_relative_path()) {
+        existing = existing.parent_path();
+    }
+    return existing;
+}
+
+// The device a path is on, or would be on once created. 0 when unknown.
+unsigned long long device_of(const fs::path& path) {
+#ifdef _WIN32
+    (void)path;
+    return 0;
+#else
+    struct stat info;
+    if (stat(nearest_existing(path).c_str(), &info) != 0) {
+        return 0;
+    }
+    return static_cast<unsigned long long>(info.st_dev);
+#endif
+}
+
+// Space an unprivileged write to path can use; unknown counts as unlimited
+uintmax_t available_space(const fs::path& path) {
+    std::error_code ec;
+    fs::space_info space = fs::space(nearest_existing(path), ec);
+    return ec ? std::numeric_limits<uintmax_t>::max() : space.available;
+}
+
+// Whether the block device is a spinning disk. Partitions keep the queue
+// attributes on their parent; network and memory file systems have none.
+bool is_rotational(unsigned long long device) {
+#ifdef __linux__
+    fs::path block = fs::path("/sys/dev/block") /
+                     (std::to_string(major(device)) + ":" + std::to_string(minor(device)));
+    for (const fs::path& attribute : {block / "queue" / "rotational", block / ".." / "queue" / "rotational"}) {
+        std::ifstream file(attribute);
+        int rotational = 0;
+        if (file >> rotational) {
+            return rotational == 1;
+        }
+    }
+#else
+    (void)device;
+#endif
+    return false;
+}
+
+// Idle I/O class for the calling thread, or the process after fork
+void set_idle_io_priority() {
+#ifdef __linux__
+    const int who_process = 1;
+    const int class_idle = 3;
+    const int class_shift = 13;
+    syscall(SYS_ioprio_set, who_process, 0, class_idle << class_shift);
+#endif
+}
+
+// Have the kernel read the start of a file ahead, without waiting for it
+void prefetch_file(const std::string& path, off_t length) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+#endif
+}
+
+// Drop a finished file from the page cache. Dirty pages can't be dropped,
+// so outputs are flushed first.
+void drop_cached_file(const std::string& path, bool sync) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        if (sync) {
+            fdatasync(fd);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#endif
+}
+
+// Whether a file name is one of the outputs named after an output base:
+// "<base>.<ext>" for each container, "<base>-<height>p.<ext>" and
+// "<base>-<height>p-<n>.<ext>" for ladder renditions. Other sources that
+// only start with the same name ("Movie 2.mkv" for "Movie") don't match.
+bool is_job_output(const std::string& name, const std::string& base) {
+    if (name.compare(0, base.size(), base) != 0) {
+        return false;
+    }
+    std::string rest = name.substr(base.size());
+    size_t dot = rest.find('.');
+    if (dot == std::string::npos || dot + 1 == rest.size() || rest.find('.', dot + 1) != std::string::npos) {
+        return false;
+    }
+    std::string suffix = rest.substr(0, dot);
+    if (suffix.empty()) {
+        return true;
+    }
+    auto digits = [](const std::string& s) {
+        return !s.empty() && std::all_of(s.begin(), s.end(), [](unsigned char c) { return std::isdigit(c); });
+    };
+    size_t p = suffix.find('p');
+    if (suffix[0] != '-' || p == std::string::npos || !digits(suffix.substr(1, p - 1))) {
+        return false;
+    }
+    std::string copy = suffix.substr(p + 1);
+    return copy.empty() || (copy[0] == '-' && digits(copy.substr(1)));
+}
+
+// Files a job wrote next to its output base: every container and
+// rendition is named after it
+std::vector<std::string> recent_outputs(const fs::path& output_base, fs::file_time_type since) {
+    std::vector<std::string> outputs;
+    std::string base = output_base.filename().string();
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(output_base.parent_path(), ec)) {
+        std::string name = entry.path().filename().string();
+        if (entry.is_regular_file(ec) && is_job_output(name, base) &&
+            fs::last_write_time(entry.path(), ec) >= since) {
+            outputs.push_back(entry.path().string());
+        }
+    }
+    return outputs;
+}
+
+int run_job_queue(std::vector<Job>& jobs, const SchedulerOptions& options) {
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::map<const Job*, std::thread> workers;
+    std::vector<const Job*> done;  // workers that have finished and can be joined
+    int running_jobs = 0;
+    double running_weight = 0.0;
+    int error_count = 0;
+
+    int max_jobs = std::max(1, options.max_jobs);
+    int total_cpus = options.total_cpus;
+    bool pin_cpus = options.pin_cpus && !options.topology.cpus.empty();
+
+    std::set<int> free_cpus;
+    if (pin_cpus) {
+        free_cpus.insert(options.topology.cpus.begin(), options.topology.cpus.end());
+        total_cpus = std::min<int>(total_cpus, static_cast<int>(free_cpus.size()));
+    }
+
+    // Running jobs by start time, to tell when a slot is about to free up
+    std::map<const Job*, std::chrono::steady_clock::time_point> started;
+    const double prefetch_lead = 30.0;
+    auto slot_soon = [&] {
+        auto now = std::chrono::steady_clock::now();
+        for (const auto& entry : started) {
+            int threads = entry.first->threads > 0 ? entry.first->threads : total_cpus;
+            double left = entry.first->predicted_cpu / threads -
+                          std::chrono::duration<double>(now - entry.second).count();
+            if (entry.first->predicted_cpu <= 0.0 || left < prefetch_lead) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // Jobs go in queue order, except that one whose disk already has its
+    // limit of jobs waits and lets jobs on other disks go ahead
+    std::map<unsigned long long, int> device_jobs;
+    auto devices_free = [&](const Job& job) {
+        return options.max_per_device <= 0 ||
+               std::all_of(job.devices.begin(), job.devices.end(), [&](unsigned long long device) {
+                   return device_jobs[device] < options.max_per_device;
+               });
+    };
+    // A job starts once its predicted output fits in the free space of the
+    // file system it writes to, less what running jobs there are still
+    // expected to write; it is held back rather than left to fail halfway
+    auto writes_to = [&](const Job& job) {
+        return options.writes_to ? options.writes_to(job) : job.output_base;
+    };
+    std::map<const Job*, fs::file_time_type> writing;
+    std::map<unsigned long long, intmax_t> room;  // per device, recomputed on each poll
+    auto space_free = [&](const Job& job) {
+        if (job.predicted_bytes == 0) {
+            return true;
+        }
+        std::string base = writes_to(job);
+        unsigned long long device = device_of(base);
+        if (room.find(device) == room.end()) {
+            uintmax_t available = available_space(base);
+            intmax_t left = static_cast<intmax_t>(std::min<uintmax_t>(available, std::numeric_limits<intmax_t>::max()));
+            for (const auto& entry : writing) {
+                std::string written_base = writes_to(*entry.first);
+                if (entry.first->predicted_bytes == 0 || device_of(written_base) != device) {
+                    continue;
+                }
+                uintmax_t written = 0;
+                for (const auto& output : recent_outputs(written_base, entry.second)) {
+                    std::error_code ec;
+                    uintmax_t size = fs::file_size(output, ec);
+                    written += ec ? 0 : size;
+                }
+                if (entry.first->predicted_bytes > written) {
+                    left -= static_cast<intmax_t>(entry.first->predicted_bytes - written);
+                }
+            }
+            room[device] = left;
+        }
+        return room[device] >= static_cast<intmax_t>(job.predicted_bytes);
+    };
+
+    // Jobs are admitted while their predicted peak RSS adds up to no more
+    // than the memory budget. Peaks seen in this run correct the
+    // predictions for the same encoder.
+    std::map<const Job*, uintmax_t> resident;
+    uintmax_t resident_total = 0;
+    std::map<std::string, std::pair<double, double>> observed;  // encoder -> predicted, peak RSS
+    auto expected_rss = [&](const Job& job) {
+        auto seen = observed.find(job.params.vcodec);
+        if (seen == observed.end() || seen->second.first <= 0.0) {
+            return job.predicted_rss;
+        }
+        double ratio = std::clamp(seen->second.second / seen->second.first, 0.25, 4.0);
+        return static_cast<uintmax_t>(job.predicted_rss * ratio);
+    };
+    auto memory_free = [&](const Job& job) {
+        return options.memory_budget == 0 || running_jobs == 0 ||
+               resident_total + expected_rss(job) <= options.memory_budget;
+    };
+    std::set<const Job*> held;
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        pending.push_back(i);
+    }
+
+    // Finished workers are joined as the queue goes, so a long queue
+    // doesn't keep a thread object per job
+    auto join_done = [&] {
+        for (const Job* job : done) {
+            workers[job].join();
+            workers.erase(job);
+        }
+        done.clear();
+    };
+
+    while (!pending.empty()) {
+        std::unique_lock<std::mutex> lock(mutex);
+        join_done();
+        auto can_start = [&] {
+            return running_jobs < max_jobs && (!pin_cpus || !free_cpus.empty());
+        };
+        auto eligible = [&] {
+            return std::find_if(pending.begin(), pending.end(), [&](size_t i) {
+                return devices_free(jobs[i]) && space_free(jobs[i]) && memory_free(jobs[i]);
+            });
+        };
+        // The next input's first chunk is read ahead once a running job
+        // is expected to finish within the lead time. Free space is looked
+        // at once per poll.
+        room.clear();
+        auto next = eligible();
+        const Job& upcoming = jobs[next != pending.end() ? *next : pending.front()];
+        if (options.on_next) {
+            options.on_next(upcoming);
+        }
+        bool prefetched = !options.prefetch_inputs || !upcoming.batch.empty() ||
+                          (options.reads_local && options.reads_local(upcoming));
+        while (!can_start() || eligible() == pending.end()) {
+            // With nothing running, no space is going to come free
+            if (running_jobs == 0) {
+                break;
+            }
+            const Job& front = jobs[pending.front()];
+            if (can_start() && devices_free(front) && held.find(&front) == held.end()) {
+                if (!space_free(front)) {
+                    std::cout << "Holding back " << front.input_file << " until "
+                              << format_number(front.predicted_bytes / 1e9, 1) << " GB are free in "
+                              << nearest_existing(writes_to(front)).string() << std::endl;
+                    held.insert(&front);
+                } else if (!memory_free(front)) {
+                    std::cout << "Holding back " << front.input_file << " until "
+                              << format_number(expected_rss(front) / 1e9, 1) << " GB of memory are free" << std::endl;
+                    held.insert(&front);
+                }
+            }
+            if (!prefetched && slot_soon()) {
+                if (options.verbose) {
+                    std::cout << "Prefetching the start of " << upcoming.input_file << std::endl;
+                }
+                prefetch_file(upcoming.input_file, 64 << 20);
+                prefetched = true;
+            }
+            finished.wait_for(lock, std::chrono::seconds(prefetched ? 60 : 5));
+            room.clear();
+        }
+
+        auto chosen = eligible();
+        if (chosen == pending.end()) {
+            Job& job = jobs[pending.front()];
+            std::cout << "Error: Not enough space for " << job.input_file << ": about "
+                      << format_number(job.predicted_bytes / 1e9, 1) << " GB needed, "
+                      << format_number(available_space(writes_to(job)) / 1e9, 1) << " GB free in "
+                      << nearest_existing(writes_to(job)).string() << std::endl;
+            job.result = 1;
+            error_count++;
+            pending.erase(pending.begin());
+            if (options.on_rejected) {
+                options.on_rejected(job);
+            }
+            continue;
+        }
+        Job& job = jobs[*chosen];
+        int remaining = static_cast<int>(pending.size());
+        pending.erase(chosen);
+        for (unsigned long long device : job.devices) {
+            device_jobs[device]++;
+        }
+
+        // A single job keeps the old behaviour: the encoder owns the machine
+        if (max_jobs > 1) {
+            int slots = std::min(max_jobs, running_jobs + remaining);
+            job.threads = plan_job_threads(job.weight, running_weight, running_jobs, slots, total_cpus);
+            job.exec.null_stdin = true;
+
+            if (pin_cpus) {
+                job.exec.cpus = allocate_cpus(options.topology, free_cpus, job.threads);
+                job.threads = static_cast<int>(job.exec.cpus.size());
+
+                std::set<int> nodes;
+                std::set<int> caches;
+                for (int cpu : job.exec.cpus) {
+                    nodes.insert(options.topology.node_of.at(cpu));
+                    caches.insert(options.topology.l3_of.at(cpu));
+                }
+                if (options.topology.node_count > 1) {
+                    job.exec.nodes.assign(nodes.begin(), nodes.end());
+                }
+
+                std::vector<int> node_list(nodes.begin(), nodes.end());
+                std::cout << "Placement for " << job.input_file << ": CPUs " << format_cpu_list(job.exec.cpus)
+                          << ", NUMA node" << (nodes.size() > 1 ? "s " : " ") << format_cpu_list(node_list)
+                          << ", " << caches.size() << " L3 domain" << (caches.size() > 1 ? "s" : "") << std::endl;
+            }
+
+            int width, height;
+            get_output_dimensions(job.params, job.media, width, height);
+            apply_thread_budget(job.params, job.threads, width, height);
+
+            std::cout << "Thread budget for " << job.input_file << ": " << job.threads
+                      << " of " << total_cpus << " CPUs (" << width << "x" << height << ")" << std::endl;
+            if (options.verbose && !job.params.encoder_options.empty()) {
+                std::cout << "  Encoder threading: " << job.params.encoder_options << std::endl;
+            }
+        }
+
+        running_jobs++;
+        running_weight += job.weight;
+        job.concurrency = running_jobs;
+        started[&job] = std::chrono::steady_clock::now();
+        writing[&job] = fs::file_time_type::clock::now();
+        resident[&job] = expected_rss(job);
+        resident_total += resident[&job];
+
+        std::string prefix = options.label_output ? "[" + fs::path(job.input_file).filename().string() + "] "
+                                                  : output_prefix;
+        workers[&job] = std::thread([&, job_ptr = &job, prefix] {
+            output_prefix = prefix;
+            int result = job_ptr->run(*job_ptr);
+
+            std::lock_guard<std::mutex> guard(mutex);
+            job_ptr->result = result;
+            if (result != 0) {
+                error_count++;
+            }
+            running_jobs--;
+            running_weight -= job_ptr->weight;
+            started.erase(job_ptr);
+            writing.erase(job_ptr);
+            resident_total -= resident[job_ptr];
+            resident.erase(job_ptr);
+            if (job_ptr->estimated_rss > 0 && job_ptr->predicted_rss > 0 && job_ptr->exec.max_rss &&
+                *job_ptr->exec.max_rss > 0) {
+                auto& seen = observed[job_ptr->params.vcodec];
+                seen.first += job_ptr->predicted_rss;
+                seen.second += *job_ptr->exec.max_rss;
+            }
+            for (unsigned long long device : job_ptr->devices) {
+                device_jobs[device]--;
+            }
+            free_cpus.insert(job_ptr->exec.cpus.begin(), job_ptr->exec.cpus.end());
+            done.push_back(job_ptr);
+            finished.notify_all();
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.second.join();
+    }
+
+    return error_count;
+}
+
+// List the video packets of a file without decoding: keyframe timestamps
+// (as ffprobe prints them, so they can be handed back to ffmpeg verbatim)
+// and the total frame count.
+bool probe_video_packets(const std::string& file_path, std::vector<std::string>& keyframes, long& frame_count) {
+    keyframes.clear();
+    frame_count = 0;
+
+    std::vector<std::string> cmd = {
+        "ffprobe", "-v", "error", "-select_streams", "v:0",
+        "-show_entries", "packet=pts_time,flags", "-of", "csv=p=0", file_path
+    };
+
+    std::string output;
+    if (read_command_output(cmd, output) != 0) {
+        return false;
+    }
+
+    std::istringstream lines(output);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t comma = line.find(',');
+        if (comma == std::string::npos) {
+            continue;
+        }
+        frame_count++;
+        std::string pts = line.substr(0, comma);
+        if (line.find('K', comma) != std::string::npos && pts != "N/A") {
+            keyframes.push_back(pts);
+        }
+    }
+
+    std::sort(keyframes.begin(), keyframes.end(), [](const std::string& a, const std::string& b) {
+        return parse_rational(a) < parse_rational(b);
+    });
+    return frame_count > 0 && !keyframes.empty();
+}
+
+// Input -ss and -to count from the container start, which ffmpeg adds back
+// on; packet timestamps don't. Sources with a nonzero start (MPEG-TS, edit
+// lists) would otherwise be cut that much late.
+std::string input_seek_time(const std::string& pts, const MediaInfo& media) {
+    return format_number(parse_rational(pts) - media.start_time, 6);
+}
+
+// Split points for an even division of the file, each moved to the nearest
+// keyframe. Only depends on the input, so the same file always gets the
+// same chunks.
+std::vector<std::string> plan_chunk_boundaries(const std::vector<std::string>& keyframes, const MediaInfo& media,
+                                               int chunk_count) {
+    std::vector<std::string> boundaries;
+    if (keyframes.empty()) {
+        return boundaries;
+    }
+
+    double first = parse_rational(keyframes.front());
+    double previous = first;
+    boundaries.push_back(keyframes.front());
+
+    for (int i = 1; i < chunk_count; ++i) {
+        double target = first + media.duration * i / chunk_count;
+        const std::string* best = nullptr;
+        double best_distance = 0.0;
+        for (const auto& keyframe : keyframes) {
+            double t = parse_rational(keyframe);
+            if (t <= previous) {
+                continue;
+            }
+            double distance = std::fabs(t - target);
+            if (best == nullptr || distance < best_distance) {
+                best = &keyframe;
+                best_distance = distance;
+            }
+        }
+        if (best == nullptr) {
+            break;
+        }
+        boundaries.push_back(*best);
+        previous = parse_rational(*best);
+    }
+
+    return boundaries;
+}
+
+long count_video_frames(const std::string& file_path) {
+    std::vector<std::string> cmd = {
+        "ffprobe", "-v", "error", "-select_streams", "v:0", "-count_packets",
+        "-show_entries", "stream=nb_read_packets", "-of", "csv=p=0", file_path
+    };
+
+    std::string output;
+    if (read_command_output(cmd, output) != 0) {
+        return -1;
+    }
+    try {
+        return std::stol(output);
+    } catch (...) {
+        return -1;
+    }
+}
+
+// Commands that encode the video between two input timestamps into a
+// video-only segment file. An empty end runs to the end of the input.
+std::vector<std::vector<std::string>> build_segment_commands(const std::string& input_file,
+                                                             const std::string& segment_file,
+                                                             const FFmpegParams& ffmpeg_params,
+                                                             const std::string& start,
+                                                             const std::string& end,
+                                                             int analyze_duration,
+                                                             int probe_size,
+                                                             bool verbose) {
+    std::vector<std::string> cmd = {
+        "ffmpeg", "-y", "-analyzeduration", std::to_string(analyze_duration),
+        "-probesize", std::to_string(probe_size), "-ss", start
+    };
+    if (!end.empty()) {
+        cmd.push_back("-to");
+        cmd.push_back(end);
+    }
+    cmd.push_back("-i");
+    cmd.push_back(input_file);
+    cmd.push_back("-map");
+    cmd.push_back("0:v:0");
+
+    bool is_multipass = uses_two_pass(ffmpeg_params);
+    FFmpegParams segment_params = ffmpeg_params;
+    if (is_multipass) {
+        segment_params.passlogfile = (fs::path(segment_file).parent_path() / fs::path(segment_file).stem()).string();
+        if (segment_params.vcodec == "libx265") {
+            set_encoder_option(segment_params, "stats", segment_params.passlogfile + ".x265.log");
+        }
+    }
+    append_video_options(cmd, segment_params);
+    cmd.insert(cmd.end(), {"-an", "-sn", "-dn"});
+    if (!verbose) {
+        cmd.insert(cmd.end(), {"-v", "error", "-stats"});
+    }
+
+    std::vector<std::vector<std::string>> commands;
+    if (is_multipass) {
+        std::vector<std::string> pass1 = cmd;
+        pass1.insert(pass1.end(), {"-pass", "1", "-passlogfile", segment_params.passlogfile,
+                                   "-f", "null", get_null_device()});
+        cmd.insert(cmd.end(), {"-pass", "2", "-passlogfile", segment_params.passlogfile});
+        commands.push_back(pass1);
+    }
+    cmd.push_back(segment_file);
+    commands.push_back(cmd);
+    return commands;
+}
+
+// Join the segments without re-encoding and take audio, subtitles,
+// attachments, chapters and metadata from the source. video_start is the input
+// timestamp of the first segment, which keeps the video where it was
+// relative to the audio.
+std::vector<std::string> build_join_command(const std::string& input_file,
+                                            const std::string& list_file,
+                                            const std::string& output_file,
+                                            const FFmpegParams& ffmpeg_params,
+                                            const MediaInfo& media,
+                                            const std::string& video_start,
+                                            int analyze_duration,
+                                            int probe_size,
+                                            bool verbose) {
+    std::ostringstream offset;
+    offset.precision(6);
+    offset << std::fixed << (parse_rational(video_start) - media.start_time);
+
+    std::vector<std::string> cmd = {
+        "ffmpeg", "-f", "concat", "-safe", "0", "-itsoffset", offset.str(), "-i", list_file,
+        "-analyzeduration", std::to_string(analyze_duration), "-probesize", std::to_string(probe_size)
+    };
+    append_audio_input_options(cmd, ffmpeg_params);
+    cmd.insert(cmd.end(), {"-i", input_file, "-map", "0:v", "-map", "1:a?", "-map", "1:s?"});
+    map_side_streams(cmd, "1", output_file);
+    cmd.insert(cmd.end(), {"-c:v", "copy"});
+    append_audio_options(cmd, ffmpeg_params);
+    cmd.insert(cmd.end(), {"-map_metadata", "1", "-map_chapters", "1"});
+    if (!verbose) {
+        cmd.insert(cmd.end(), {"-v", "error", "-stats"});
+    }
+    append_output(cmd, output_file, ffmpeg_params);
+    return cmd;
+}
+
+// Write the concat list, join, and check that no frame went missing:
+// every segment frame must be in the output and, without a frame rate
+// change, every source frame must be in the segments.
+int join_segments(const std::string& input_file,
+                  const std::string& output_file,
+                  const std::vector<std::string>& segment_files,
+                  const FFmpegParams& ffmpeg_params,
+                  const MediaInfo& media,
+                  const std::string& video_start,
+                  long source_frames,
+                  const fs::path& work_dir,
+                  int analyze_duration,
+                  int probe_size,
+                  bool verbose,
+                  const ExecContext& exec) {
+    fs::path list_file = work_dir / "segments.txt";
+    std::ofstream list(list_file);
+    long segment_frames = 0;
+    for (const auto& segment_file : segment_files) {
+        std::string escaped = segment_file;
+        for (size_t pos = 0; (pos = escaped.find('\'', pos)) != std::string::npos; pos += 4) {
+            escaped.replace(pos, 1, "'\\''");
+        }
+        list << "file '" << escaped << "'" << std::endl;
+
+        long frames = count_video_frames(segment_file);
+        if (frames < 0) {
+            std::cout << "Error: Could not count the frames of " << segment_file << std::endl;
+            return 1;
+        }
+        segment_frames += frames;
+    }
+    list.close();
+
+    std::cout << "Joining " << segment_files.size() << " segments into " << output_file << std::endl;
+    std::vector<std::string> cmd = build_join_command(input_file, list_file.string(), output_file, ffmpeg_params,
+                                                      media, video_start, analyze_duration, probe_size, verbose);
+    int result_code = execute_command(cmd, verbose, exec);
+    if (result_code != 0) {
+        std::cout << "Error: Joining segments failed with return code " << result_code
+                  << ", segments kept in " << work_dir << std::endl;
+        return 1;
+    }
+
+    long output_frames = count_video_frames(output_file);
+    // Inverse telecine drops frames and bobbing doubles them
+    bool rate_changed = (ffmpeg_params.framerate != "auto" && !ffmpeg_params.framerate.empty()) ||
+                        ffmpeg_params.field_filter.find("decimate") != std::string::npos ||
+                        ffmpeg_params.field_filter.find("send_field") != std::string::npos;
+    if (output_frames != segment_frames || (!rate_changed && segment_frames != source_frames)) {
+        std::cout << "Error: Frame count mismatch (source " << source_frames << ", segments " << segment_frames
+                  << ", output " << output_frames << "), segments kept in " << work_dir << std::endl;
+        return 1;
+    }
+
+    std::cout << "Conversion successful (" << output_frames << " frames verified)" << std::endl;
+    return 0;
+}
+
+void print_command(const std::vector<std::string>& cmd) {
+    std::vector<std::string> escaped_cmd;
+    for (const auto& arg : cmd) {
+        escaped_cmd.push_back(escape_string(arg));
+    }
+    std::cout << join_string(escaped_cmd, " ") << std::endl;
+}
+
+bool is_mp4_family(const std::string& format) {
+    return format == "mp4" || format == "m4v" || format == "mov";
+}
+
+// What -map 0 keeps besides audio, video and subtitles, for commands that
+// map streams one kind at a time: attachments (the fonts ASS subtitles
+// need) where Matroska takes them, data streams in the MP4 family
+void map_side_streams(std::vector<std::string>& cmd, const std::string& input, const std::string& output_file) {
+    std::string format = fs::path(output_file).extension().string();
+    format = format.empty() ? format : format.substr(1);
+    if (format == "mkv") {
+        cmd.insert(cmd.end(), {"-map", input + ":t?"});
+    } else if (is_mp4_family(format)) {
+        cmd.insert(cmd.end(), {"-map", input + ":d?", "-c:d", "copy"});
+    }
+}
+
+bool is_text_subtitle(const std::string& codec) {
+    static const std::vector<std::string> text_codecs = {"subrip", "srt", "ass", "ssa", "mov_text", "webvtt", "text"};
+    return std::find(text_codecs.begin(), text_codecs.end(), codec) != text_codecs.end();
+}
+
+// Whether copied audio can go into this container as is
+bool audio_fits_container(const std::string& format, const FFmpegParams& ffmpeg_params, const MediaInfo& media) {
+    if (ffmpeg_params.acodec.find("copy") == std::string::npos) {
+        if (format != "webm") {
+            return true;
+        }
+        return ffmpeg_params.acodec.find("opus") != std::string::npos ||
+               ffmpeg_params.acodec.find("vorbis") != std::string::npos;
+    }
+
+    std::vector<std::string> allowed;
+    if (is_mp4_family(format)) {
+        allowed = {"aac", "mp3", "ac3", "eac3", "alac", "opus", "flac"};
+    } else if (format == "webm") {
+        allowed = {"opus", "vorbis"};
+    } else {
+        return true;
+    }
+    for (const auto& codec : media.audio_codecs) {
+        if (std::find(allowed.begin(), allowed.end(), codec) == allowed.end()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether a tee slave of this container can take the streams encoded for
+// the primary one. Subtitles are encoded for the primary container, and
+// webm only takes VP8/VP9/AV1 with Opus/Vorbis, so it is always remuxed.
+bool tee_can_write(const std::string& primary_format, const std::string& format,
+                   const FFmpegParams& ffmpeg_params, const MediaInfo& media) {
+    if (format == "webm" || primary_format == "webm") {
+        return false;
+    }
+    if (is_mp4_family(primary_format) != is_mp4_family(format) && !media.subtitle_codecs.empty()) {
+        return false;
+    }
+    return audio_fits_container(format, ffmpeg_params, media);
+}
+
+// Keep the containers the tee muxer can write in ffmpeg_params and move
+// the others to remux_formats
+void split_extra_formats(const std::string& primary_format, FFmpegParams& ffmpeg_params, const MediaInfo& media,
+                         std::vector<std::string>& remux_formats) {
+    std::vector<std::string> tee_formats;
+    for (const auto& format : ffmpeg_params.extra_formats) {
+        if (format == primary_format) {
+            continue;
+        }
+        if (tee_can_write(primary_format, format, ffmpeg_params, media)) {
+            tee_formats.push_back(format);
+        } else {
+            remux_formats.push_back(format);
+        }
+    }
+    ffmpeg_params.extra_formats = tee_formats;
+}
+
+// Stream copy into another container. Only subtitles, and copied audio
+// the container can't hold, are converted; the video is never touched.
+std::vector<std::string> build_remux_command(const std::string& primary_file, const std::string& format,
+                                             const FFmpegParams& ffmpeg_params, const MediaInfo& media,
+                                             bool verbose) {
+    std::string output_file = fs::path(primary_file).replace_extension(format).string();
+    std::vector<std::string> cmd = {"ffmpeg", "-y", "-i", primary_file, "-map", "0", "-c", "copy"};
+
+    if (!media.subtitle_codecs.empty()) {
+        bool all_text = std::all_of(media.subtitle_codecs.begin(), media.subtitle_codecs.end(), is_text_subtitle);
+        if (!all_text && is_mp4_family(format)) {
+            cmd.push_back("-sn");
+        } else if (is_mp4_family(format)) {
+            cmd.insert(cmd.end(), {"-c:s", "mov_text"});
+        } else if (format == "webm") {
+            cmd.insert(cmd.end(), {"-c:s", "webvtt"});
+        } else {
+            cmd.insert(cmd.end(), {"-c:s", "srt"});
+        }
+    }
+
+    if (!audio_fits_container(format, ffmpeg_params, media)) {
+        cmd.insert(cmd.end(), {"-c:a", format == "webm" ? "libopus" : "aac"});
+    }
+
+    if (is_mp4_family(format)) {
+        cmd.insert(cmd.end(), {"-movflags", "+faststart"});
+    }
+    if (!verbose) {
+        cmd.insert(cmd.end(), {"-v", "error"});
+    }
+    cmd.push_back(output_file);
+    return cmd;
+}
+
+// A remux can convert audio and subtitles, but webm only takes VP9/AV1 video
+void drop_unsupported_containers(FFmpegParams& ffmpeg_params) {
+    auto webm = std::find(ffmpeg_params.extra_formats.begin(), ffmpeg_params.extra_formats.end(), "webm");
+    if (webm != ffmpeg_params.extra_formats.end() && ffmpeg_params.vcodec.find("vp9") == std::string::npos &&
+        ffmpeg_params.vcodec.find("av1") == std::string::npos) {
+        std::cout << "Warning: Skipping webm output, " << ffmpeg_params.vcodec << " video can't go into webm"
+                  << std::endl;
+        ffmpeg_params.extra_formats.erase(webm);
+    }
+}
+
+int remux_containers(const std::string& primary_file, const std::vector<std::string>& formats,
+                     const FFmpegParams& ffmpeg_params, const MediaInfo& media,
+                     bool verbose, bool execute, const ExecContext& exec) {
+    int errors = 0;
+    for (const auto& format : formats) {
+        std::vector<std::string> cmd = build_remux_command(primary_file, format, ffmpeg_params, media, verbose);
+        if (!execute) {
+            print_command(cmd);
+            continue;
+        }
+        std::cout << "Remuxing to " << cmd.back() << std::endl;
+        int result_code = execute_command(cmd, verbose, exec);
+        if (result_code != 0) {
+            std::cout << "Error: Remux to " << format << " failed with return code " << result_code << std::endl;
+            errors++;
+        }
+    }
+    return errors > 0 ? 1 : 0;
+}
+
+// Scheduler for the segments of one file: they share the file's CPUs,
+// and its placement when it has one.
+SchedulerOptions segment_scheduler(const FFmpegParams& ffmpeg_params, const ExecContext& exec,
+                                   int max_jobs, bool verbose) {
+    SchedulerOptions scheduler;
+    scheduler.max_jobs = max_jobs;
+    scheduler.total_cpus = ffmpeg_params.threads > 0 ? ffmpeg_params.threads : get_available_cpus();
+    scheduler.verbose = verbose;
+    if (!exec.cpus.empty()) {
+        scheduler.topology = read_cpu_topology();
+        scheduler.topology.cpus = exec.cpus;
+        scheduler.pin_cpus = true;
+    }
+    return scheduler;
+}
+
+int encode_chunked(const std::string& input_file,
+                   const std::string& output_file,
+                   const FFmpegParams& ffmpeg_params,
+                   const MediaInfo& media,
+                   int chunk_count,
+                   int analyze_duration,
+                   int probe_size,
+                   bool verbose,
+                   bool execute,
+                   const ExecContext& exec) {
+    std::vector<std::string> keyframes;
+    long source_frames = 0;
+    if (!probe_video_packets(input_file, keyframes, source_frames)) {
+        std::cout << "Error: Could not read the keyframes of " << input_file << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> boundaries = plan_chunk_boundaries(keyframes, media, chunk_count);
+    chunk_count = static_cast<int>(boundaries.size());
+
+    fs::path out_path(output_file);
+    fs::path chunk_dir = out_path.parent_path() / ("." + out_path.stem().string() + ".chunks");
+
+    std::vector<std::string> chunk_files;
+    for (int i = 0; i < chunk_count; ++i) {
+        chunk_files.push_back((chunk_dir / ("chunk" + std::to_string(1000 + i).substr(1) + ".mkv")).string());
+    }
+    auto chunk_start = [&](int i) {
+        return input_seek_time(boundaries[i], media);
+    };
+    auto chunk_end = [&](int i) {
+        return i + 1 < chunk_count ? input_seek_time(boundaries[i + 1], media) : std::string();
+    };
+
+    if (!execute) {
+        std::cout << "Chunked encode of " << input_file << " (" << chunk_count << " chunks at keyframes "
+                  << join_string(boundaries, ", ") << "):" << std::endl;
+        for (int i = 0; i < chunk_count; ++i) {
+            for (const auto& cmd : build_segment_commands(input_file, chunk_files[i], ffmpeg_params, chunk_start(i),
+                                                          chunk_end(i), analyze_duration, probe_size, verbose)) {
+                print_command(cmd);
+            }
+        }
+        print_command(build_join_command(input_file, (chunk_dir / "segments.txt").string(), output_file,
+                                         ffmpeg_params, media, boundaries[0], analyze_duration, probe_size, verbose));
+        return 0;
+    }
+
+    std::cout << "Processing: " << input_file << std::endl;
+    std::cout << "Output: " << output_file << std::endl;
+    std::cout << "Splitting into " << chunk_count << " chunks at keyframes " << join_string(boundaries, ", ") << std::endl;
+
+    try {
+        fs::create_directories(chunk_dir);
+    } catch (const fs::filesystem_error& e) {
+        std::cout << "Error creating chunk directory: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<Job> chunk_jobs;
+    for (int i = 0; i < chunk_count; ++i) {
+        Job job;
+        job.input_file = input_file + " [chunk " + std::to_string(i + 1) + "/" + std::to_string(chunk_count) + "]";
+        job.media = media;
+        job.params = ffmpeg_params;
+        job.exec = exec;
+        job.exec.cpus.clear();
+        job.exec.nodes.clear();
+        job.run = [&, i](Job& j) {
+            int result_code = 0;
+            for (const auto& cmd : build_segment_commands(input_file, chunk_files[i], j.params, chunk_start(i),
+                                                          chunk_end(i), analyze_duration, probe_size, verbose)) {
+                result_code = execute_command(cmd, verbose, j.exec);
+                if (result_code != 0) {
+                    std::cout << "Error: Chunk " << (i + 1) << " failed with return code " << result_code << std::endl;
+                    break;
+                }
+            }
+            return result_code;
+        };
+        chunk_jobs.push_back(job);
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    long long cpu_before = exec.cpu_usec ? exec.cpu_usec->load() : 0;
+    if (run_job_queue(chunk_jobs, segment_scheduler(ffmpeg_params, exec, chunk_count, verbose)) > 0) {
+        std::cout << "Error: Chunked encode failed, chunks kept in " << chunk_dir << std::endl;
+        return 1;
+    }
+    double encode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    double cpu_seconds = exec.cpu_usec ? (exec.cpu_usec->load() - cpu_before) / 1e6 : 0.0;
+
+    if (join_segments(input_file, output_file, chunk_files, ffmpeg_params, media, boundaries[0], source_frames,
+                      chunk_dir, analyze_duration, probe_size, verbose, exec) != 0) {
+        return 1;
+    }
+
+    // Chunks share the file's CPUs, so their summed wall time only counts
+    // how many ran at once; the CPU time is what the encode cost
+    std::cout << "Chunked encode of " << chunk_count << " chunks took " << static_cast<int>(encode_seconds) << "s";
+    if (cpu_seconds > 0.0) {
+        std::cout << ", " << static_cast<int>(cpu_seconds) << "s of CPU time";
+    }
+    std::cout << std::endl;
+
+    std::error_code ec;
+    fs::remove_all(chunk_dir, ec);
+    return 0;
+}
+
+// One audio track on its own, with the filters and measured loudness of
+// that track. Audio encoders are single threaded.
+std::vector<std::string> build_audio_track_command(const std::string& input_file,
+                                                   const std::string& audio_file,
+                                                   const FFmpegParams& ffmpeg_params,
+                                                   int track,
+                                                   int analyze_duration,
+                                                   int probe_size,
+                                                   bool verbose) {
+    std::vector<std::string> cmd = {"ffmpeg", "-y", "-analyzeduration", std::to_string(analyze_duration),
+                                    "-probesize", std::to_string(probe_size)};
+    append_audio_input_options(cmd, ffmpeg_params);
+    cmd.insert(cmd.end(), {"-i", input_file, "-map", "0:a:" + std::to_string(track), "-vn", "-sn", "-dn",
+                           "-threads", "1"});
+
+    FFmpegParams track_params = ffmpeg_params;
+    track_params.loudness.clear();
+    if (track < static_cast<int>(ffmpeg_params.loudness.size())) {
+        track_params.loudness.push_back(ffmpeg_params.loudness[track]);
+    }
+    track_params.audio_tracks = 1;
+    append_audio_options(cmd, track_params);
+    if (!verbose) {
+        cmd.insert(cmd.end(), {"-v", "error"});
+    }
+    cmd.push_back(audio_file);
+    return cmd;
+}
+
+// Stream copy the intermediates together. Each input starts at zero when
+// read, so it is moved to where its stream started in the source; the
+// source itself gives subtitles, attachments, chapters, metadata and the
+// audio tracks' dispositions.
+std::vector<std::string> build_split_mux_command(const std::string& input_file,
+                                                 const std::string& video_file,
+                                                 const std::vector<std::string>& audio_files,
+                                                 const std::string& output_file,
+                                                 const FFmpegParams& ffmpeg_params,
+                                                 const MediaInfo& media,
+                                                 int analyze_duration,
+                                                 int probe_size,
+                                                 bool verbose) {
+    int tracks = static_cast<int>(audio_files.size());
+    std::vector<std::string> cmd = {"ffmpeg", "-itsoffset", format_number(media.video_start_time - media.start_time, 6),
+                                    "-i", video_file};
+    for (int track = 0; track < tracks; ++track) {
+        double start = track < static_cast<int>(media.audio_start_times.size()) ? media.audio_start_times[track]
+                                                                                : media.start_time;
+        cmd.insert(cmd.end(), {"-itsoffset", format_number(start - media.start_time, 6), "-i", audio_files[track]});
+    }
+    std::string source = std::to_string(tracks + 1);
+    cmd.insert(cmd.end(), {"-analyzeduration", std::to_string(analyze_duration),
+                           "-probesize", std::to_string(probe_size), "-i", input_file, "-map", "0:v"});
+    for (int track = 0; track < tracks; ++track) {
+        cmd.insert(cmd.end(), {"-map", std::to_string(track + 1) + ":a"});
+    }
+    cmd.insert(cmd.end(), {"-map", source + ":s?"});
+    map_side_streams(cmd, source, output_file);
+    cmd.insert(cmd.end(), {"-c:v", "copy", "-c:a", "copy", "-map_metadata", source, "-map_chapters", source});
+    for (int track = 0; track < tracks && track < static_cast<int>(media.audio_dispositions.size()); ++track) {
+        cmd.insert(cmd.end(), {"-disposition:a:" + std::to_string(track), media.audio_dispositions[track]});
+    }
+    if (!verbose) {
+        cmd.insert(cmd.end(), {"-v", "error", "-stats"});
+    }
+    append_output(cmd, output_file, ffmpeg_params);
+    return cmd;
+}
+
+// Video and every audio track are encoded by processes of their own at
+// the same time, into Matroska intermediates that keep the timestamps,
+// then muxed without re-encoding. Lossless audio transcodes then use
+// free cores instead of queueing behind the video in one process. Audio
+// still waiting for its loudness is measured right before its encode,
+// while the video runs.
+int encode_split(const std::string& input_file,
+                 const std::string& output_file,
+                 const FFmpegParams& ffmpeg_params,
+                 const MediaInfo& media,
+                 int analyze_duration,
+                 int probe_size,
+                 bool verbose,
+                 bool execute,
+                 const ExecContext& exec) {
+    fs::path out_path(output_file);
+    fs::path work_dir = out_path.parent_path() / ("." + out_path.stem().string() + ".split");
+    std::string video_file = (work_dir / "video.mkv").string();
+    int tracks = media.audio_streams;
+    std::vector<std::string> audio_files;
+    for (int track = 0; track < tracks; ++track) {
+        audio_files.push_back((work_dir / ("audio" + std::to_string(track) + ".mka")).string());
+    }
+    bool measure = ffmpeg_params.loudness_target < 0 && ffmpeg_params.loudness.empty();
+
+    if (!execute) {
+        std::cout << "Split encode of " << input_file << " (video and " << tracks << " audio track"
+                  << (tracks == 1 ? "" : "s") << " side by side, then muxed):" << std::endl;
+        for (const auto& cmd : build_segment_commands(input_file, video_file, ffmpeg_params, "0", "",
+                                                      analyze_duration, probe_size, verbose)) {
+            print_command(cmd);
+        }
+        for (int track = 0; track < tracks; ++track) {
+            if (measure) {
+                std::vector<Loudness> loudness;
+                measure_loudness(ffmpeg_params, input_file, media, track, loudness, analyze_duration, probe_size,
+                                 verbose, false, exec);
+            }
+            print_command(build_audio_track_command(input_file, audio_files[track], ffmpeg_params, track,
+                                                    analyze_duration, probe_size, verbose));
+        }
+        print_command(build_split_mux_command(input_file, video_file, audio_files, output_file, ffmpeg_params, media,
+                                              analyze_duration, probe_size, verbose));
+        return 0;
+    }
+
+    std::cout << "Processing: " << input_file << std::endl;
+    std::cout << "Output: " << output_file << std::endl;
+    std::cout << "Encoding video and " << tracks << " audio track" << (tracks == 1 ? "" : "s")
+              << " in separate processes" << std::endl;
+
+    try {
+        fs::create_directories(work_dir);
+    } catch (const fs::filesystem_error& e) {
+        std::cout << "Error creating work directory: " << e.what() << std::endl;
+        return 1;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    std::vector<int> audio_results(tracks, 0);
+    std::vector<double> audio_seconds(tracks, 0.0);
+    std::vector<std::thread> audio_workers;
+    for (int track = 0; track < tracks; ++track) {
+        audio_workers.emplace_back([&, track, prefix = output_prefix]() {
+            output_prefix = prefix;
+            FFmpegParams params = ffmpeg_params;
+            ExecContext audio_exec = exec;
+            audio_exec.null_stdin = true;
+            audio_exec.children.reset();  // small beside the video encode, not alike
+            if (measure) {
+                std::vector<Loudness> loudness;
+                if (measure_loudness(ffmpeg_params, input_file, media, track, loudness, analyze_duration, probe_size,
+                                     verbose, true, audio_exec)) {
+                    params.loudness.assign(tracks, Loudness());
+                    params.loudness[track] = loudness[0];
+                }
+            }
+            audio_results[track] = execute_command(build_audio_track_command(input_file, audio_files[track], params,
+                                                                             track, analyze_duration, probe_size,
+                                                                             verbose), verbose, audio_exec);
+            audio_seconds[track] = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        });
+    }
+
+    int result_code = 0;
+    for (const auto& cmd : build_segment_commands(input_file, video_file, ffmpeg_params, "0", "",
+                                                  analyze_duration, probe_size, verbose)) {
+        result_code = execute_command(cmd, verbose, exec);
+        if (result_code != 0) {
+            std::cout << "Error: Video encode failed with return code " << result_code << std::endl;
+            break;
+        }
+    }
+    double video_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    for (auto& worker : audio_workers) {
+        worker.join();
+    }
+    for (int track = 0; track < tracks && result_code == 0; ++track) {
+        if (audio_results[track] != 0) {
+            std::cout << "Error: Audio track " << track << " failed with return code " << audio_results[track]
+                      << std::endl;
+            result_code = audio_results[track];
+        }
+    }
+
+    if (result_code == 0) {
+        std::cout << "Muxing " << output_file << std::endl;
+        result_code = execute_command(build_split_mux_command(input_file, video_file, audio_files, output_file,
+                                                              ffmpeg_params, media, analyze_duration, probe_size,
+                                                              verbose), verbose, exec);
+        if (result_code != 0) {
+            std::cout << "Error: Mux failed with return code " << result_code << std::endl;
+        }
+    }
+
+    std::error_code ec;
+    fs::remove_all(work_dir, ec);
+    if (result_code != 0) {
+        return 1;
+    }
+
+    double audio_longest = tracks > 0 ? *std::max_element(audio_seconds.begin(), audio_seconds.end()) : 0.0;
+    double total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Split encode took " << static_cast<int>(total_seconds) << "s: video "
+              << static_cast<int>(video_seconds) << "s, audio done after " << static_cast<int>(audio_longest)
+              << "s alongside it" << std::endl;
+    return 0;
+}
+
+// Start times of `count` windows of `window` seconds spread evenly over
+// the file, each in the middle of its share of it. They are input seeks,
+// which ffmpeg counts from the container start.
+std::vector<double> sample_windows(const MediaInfo& media, int count, double window) {
+    std::vector<double> starts;
+    if (media.duration <= 0.0 || count <= 0) {
+        return starts;
+    }
+    double usable = std::max(0.0, media.duration - window);
+    for (int k = 0; k < count; ++k) {
+        double start = usable * (k + 0.5) / count;
+        if (starts.empty() || start > starts.back()) {
+            starts.push_back(start);
+        }
+    }
+    return starts;
+}
+
+std::string format_seconds(double seconds) {
+    std::ostringstream out;
+    out.precision(3);
+    out << std::fixed << seconds;
+    return out.str();
+}
+
+std::string format_number(double value, int decimals) {
+    std::ostringstream out;
+    out.precision(decimals);
+    out << std::fixed << value;
+    return out.str();
+}
+
+// Run `count` short analysis jobs side by side, sharing the file's CPUs
+// like chunks do. build() makes the commands of job k with its thread
+// budget applied. Returns the number of jobs that failed.
+int run_sample_jobs(const std::string& input_file, const std::string& label, int count,
+                    const FFmpegParams& ffmpeg_params, const MediaInfo& media, const ExecContext& exec, bool verbose,
+                    const std::function<std::vector<std::vector<std::string>>(int, const FFmpegParams&)>& build) {
+    std::vector<Job> sample_jobs;
+    for (int k = 0; k < count; ++k) {
+        Job job;
+        job.input_file = input_file + " [" + label + " " + std::to_string(k + 1) + "/" + std::to_string(count) + "]";
+        job.media = media;
+        job.params = ffmpeg_params;
+        job.exec = exec;
+        job.exec.cpus.clear();
+        job.exec.nodes.clear();
+        job.run = [&, k](Job& j) {
+            for (const auto& cmd : build(k, j.params)) {
+                int result_code = execute_command(cmd, verbose, j.exec);
+                if (result_code != 0) {
+                    return result_code;
+                }
+            }
+            return 0;
+        };
+        sample_jobs.push_back(job);
+    }
+    return run_job_queue(sample_jobs, segment_scheduler(ffmpeg_params, exec, count, verbose));
+}
+
+// Mean of a per-frame score from an ssim or psnr stats_file
+bool read_metric_log(const std::string& log_file, const std::string& field, double& sum, long& frames) {
+    std::ifstream in(log_file);
+    if (!in.is_open()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t pos = line.find(field + ":");
+        if (pos == std::string::npos) {
+            continue;
+        }
+        std::string value = line.substr(pos + field.size() + 1);
+        value = value.substr(0, value.find(' '));
+        // Identical frames have infinite PSNR; count them as very good
+        double score = value == "inf" ? 100.0 : parse_rational(value);
+        sum += std::min(score, 100.0);
+        frames++;
+    }
+    return true;
+}
+
+// Per-title CRF: encode a few short windows spread over the file at
+// candidate CRFs, score them against the source with ffmpeg's ssim or psnr
+// filter, and binary search for the highest CRF that still meets the
+// target. The windows of one candidate are encoded in parallel.
+bool search_crf(FFmpegParams& ffmpeg_params,
+                const std::string& input_file,
+                const MediaInfo& media,
+                const std::string& metric,
+                double target,
+                int analyze_duration,
+                int probe_size,
+                bool verbose,
+                bool execute,
+                const ExecContext& exec) {
+    size_t crf_pos = ffmpeg_params.quality.find("-crf ");
+    if (crf_pos == std::string::npos) {
+        std::cout << "Note: CRF search needs a constant quality preset, keeping " << ffmpeg_params.quality << std::endl;
+        return false;
+    }
+    int base_crf = static_cast<int>(std::lround(parse_rational(ffmpeg_params.quality.substr(crf_pos + 5))));
+    const EncoderInfo* encoder = find_encoder(ffmpeg_params);
+    std::string quality_extra = encoder ? encoder->quality_extra : "";
+    int low = std::max(0, base_crf - 10);
+    int high = std::min(encoder ? encoder->quality_max : 51, base_crf + 10);
+
+    const int window_count = 4;
+    const double window = std::min(4.0, media.duration / window_count);
+    std::vector<double> starts = sample_windows(media, window_count, window);
+    if (starts.empty() || window <= 0.0) {
+        std::cout << "Note: Unknown duration, no CRF search for " << input_file << std::endl;
+        return false;
+    }
+
+    // std::cout may be left in fixed notation by the progress output
+    auto number = [](double value) {
+        std::ostringstream text;
+        text << value;
+        return text.str();
+    };
+
+    if (!execute) {
+        std::cout << "CRF search for " << input_file << ": " << starts.size() << " windows of " << number(window)
+                  << "s, CRF " << low << "-" << high << ", target " << metric << " >= " << number(target)
+                  << std::endl;
+        return true;
+    }
+
+    fs::path work_dir = fs::temp_directory_path() /
+        ("hb-ffmpeg-conv-crf-" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::string>()(input_file)));
+    std::error_code ec;
+    fs::create_directories(work_dir, ec);
+
+    // The reference goes through the same picture chain as the encode
+    std::string chain = video_filter_chain(ffmpeg_params, true);
+    std::string reference = "[1:v]" + (chain.empty() ? "" : chain + ",");
+    if (ffmpeg_params.framerate != "auto" && !ffmpeg_params.framerate.empty()) {
+        reference += "fps=" + ffmpeg_params.framerate + ",";
+    }
+    reference += "format=yuv420p,setpts=PTS-STARTPTS[ref];[0:v]format=yuv420p,setpts=PTS-STARTPTS[enc];[enc][ref]";
+
+    auto started = std::chrono::steady_clock::now();
+    long long cpu_before = exec.cpu_usec ? exec.cpu_usec->load() : 0;
+    std::map<int, double> scores;
+    auto score = [&](int crf) {
+        FFmpegParams candidate = ffmpeg_params;
+        candidate.quality = "-crf " + std::to_string(crf) + quality_extra;
+        candidate.extra_formats.clear();
+        strip_analysis_options(candidate);
+
+        auto build = [&](int k, const FFmpegParams& budgeted) {
+            std::string sample = (work_dir / ("crf" + std::to_string(crf) + "-" + std::to_string(k) + ".mkv")).string();
+            std::string log = sample + ".log";
+            std::vector<std::string> encode = {
+                "ffmpeg", "-y", "-ss", format_seconds(starts[k]), "-t", format_seconds(window),
+                "-analyzeduration", std::to_string(analyze_duration), "-probesize", std::to_string(probe_size),
+                "-i", input_file, "-map", "0:v:0"
+            };
+            append_video_options(encode, budgeted);
+            encode.insert(encode.end(), {"-an", "-sn", "-dn", "-v", "error", sample});
+
+            std::vector<std::string> measure = {
+                "ffmpeg", "-i", sample, "-ss", format_seconds(starts[k]), "-t", format_seconds(window),
+                "-i", input_file, "-lavfi", reference + metric + "=stats_file=" + log,
+                "-v", "error", "-f", "null", get_null_device()
+            };
+            return std::vector<std::vector<std::string>>{encode, measure};
+        };
+
+        double sum = 0.0;
+        long frames = 0;
+        if (run_sample_jobs(input_file, "CRF " + std::to_string(crf), static_cast<int>(starts.size()),
+                            candidate, media, exec, verbose, build) == 0) {
+            for (size_t k = 0; k < starts.size(); ++k) {
+                read_metric_log((work_dir / ("crf" + std::to_string(crf) + "-" + std::to_string(k) + ".mkv.log")).string(),
+                                metric == "ssim" ? "All" : "psnr_avg", sum, frames);
+            }
+        }
+        scores[crf] = frames > 0 ? sum / frames : -1.0;
+        std::cout << "  CRF " << crf << ": " << metric << " " << number(scores[crf]) << std::endl;
+        return scores[crf];
+    };
+
+    // Highest CRF (smallest file) that still meets the target
+    std::cout << "CRF search for " << input_file << " (target " << metric << " >= " << number(target) << "):" << std::endl;
+    int best = -1;
+    int lo = low;
+    int hi = high;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (score(mid) >= target) {
+            best = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    double sample_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    double sample_cpu = exec.cpu_usec ? (exec.cpu_usec->load() - cpu_before) / 1e6 : 0.0;
+    double sampled = scores.size() * starts.size() * window;
+    fs::remove_all(work_dir, ec);
+
+    if (best < 0) {
+        best = low;
+        std::cout << "Warning: No CRF down to " << low << " reaches " << metric << " " << number(target) << ", using " << low
+                  << std::endl;
+    }
+    if (scores.count(best) && scores[best] < 0) {
+        std::cout << "Warning: CRF search failed, keeping " << ffmpeg_params.quality << std::endl;
+        return false;
+    }
+
+    ffmpeg_params.quality = "-crf " + std::to_string(best) + quality_extra;
+    std::cout << "CRF search picked " << best << " (preset: " << base_crf << ") after " << scores.size()
+              << " candidates; sampling took " << format_duration(sample_seconds) << " ("
+              << static_cast<int>(sample_cpu) << " CPU seconds) for "
+              << static_cast<int>(sampled) << "s of encoded video, " << std::fixed << std::setprecision(1)
+              << 100.0 * sampled / media.duration << std::defaultfloat << "% of the title's length" << std::endl;
+    return true;
+}
+
+// Record the source size the picture filters work on, turn the crop edges
+// into a crop filter and shrink the output size by the same share, so the
+// preset's scale factor is kept and the bars aren't stretched into the
+// picture. Without probed dimensions the crop is left to ffmpeg's
+// expressions and the size is kept.
+void apply_crop(FFmpegParams& ffmpeg_params, const MediaInfo& media) {
+    const int* crop = ffmpeg_params.crop;
+    ffmpeg_params.crop_filter.clear();
+    ffmpeg_params.source_width = media.width;
+    ffmpeg_params.source_height = media.height;
+    bool cropping = crop[0] != 0 || crop[1] != 0 || crop[2] != 0 || crop[3] != 0;
+
+    if (cropping && (media.width <= 0 || media.height <= 0)) {
+        ffmpeg_params.crop_filter = "crop=iw-" + std::to_string(crop[2] + crop[3]) + ":ih-" +
+                                    std::to_string(crop[0] + crop[1]) + ":" + std::to_string(crop[2]) + ":" +
+                                    std::to_string(crop[0]);
+    } else if (cropping) {
+        int crop_width = media.width - crop[2] - crop[3];
+        int crop_height = media.height - crop[0] - crop[1];
+        if (crop_width < 16 || crop_height < 16) {
+            std::cout << "Warning: Crop " << crop[0] << "/" << crop[1] << "/" << crop[2] << "/" << crop[3]
+                      << " leaves no picture of " << media.width << "x" << media.height << ", not cropping"
+                      << std::endl;
+        } else {
+            ffmpeg_params.crop_filter = "crop=" + std::to_string(crop_width) + ":" + std::to_string(crop_height) +
+                                        ":" + std::to_string(crop[2]) + ":" + std::to_string(crop[0]);
+            ffmpeg_params.source_width = crop_width;
+            ffmpeg_params.source_height = crop_height;
+        }
+    }
+
+    fit_output_size(ffmpeg_params, media);
+}
+
+// Output size for this file: the (cropped) source at its display aspect
+// ratio, fitted into the preset's box, only enlarged when the preset
+// allows upscaling, with sides rounded to the preset's modulus. When that
+// is the source size already the resolution is left empty and no scaler
+// runs. Presets that don't keep the aspect ratio get their box as is.
+void fit_output_size(FFmpegParams& ffmpeg_params, const MediaInfo& media) {
+    if (ffmpeg_params.source_width <= 0 || ffmpeg_params.source_height <= 0) {
+        return;
+    }
+
+    int source_width = ffmpeg_params.source_width;
+    int source_height = ffmpeg_params.source_height;
+    double display_width = source_width * media.sample_aspect;
+    double display_height = source_height;
+    if (ffmpeg_params.rotate_quarter) {
+        std::swap(source_width, source_height);
+        std::swap(display_width, display_height);
+    }
+
+    int modulus = std::max(2, ffmpeg_params.modulus);
+    auto round_side = [&](double side) {
+        return std::max(modulus, static_cast<int>(std::lround(side / modulus)) * modulus);
+    };
+
+    int width, height;
+    if (!ffmpeg_params.keep_aspect && ffmpeg_params.max_width > 0 && ffmpeg_params.max_height > 0) {
+        width = round_side(ffmpeg_params.max_width);
+        height = round_side(ffmpeg_params.max_height);
+    } else {
+        double factor = 1e9;
+        if (ffmpeg_params.max_width > 0) {
+            factor = std::min(factor, ffmpeg_params.max_width / display_width);
+        }
+        if (ffmpeg_params.max_height > 0) {
+            factor = std::min(factor, ffmpeg_params.max_height / display_height);
+        }
+        if (factor > 1.0 && (!ffmpeg_params.allow_upscaling || factor >= 1e9)) {
+            factor = 1.0;
+        }
+        width = round_side(display_width * factor);
+        height = round_side(display_height * factor);
+        // Rounding must not leave the box
+        if (ffmpeg_params.max_width > 0 && width > ffmpeg_params.max_width) {
+            width -= modulus;
+        }
+        if (ffmpeg_params.max_height > 0 && height > ffmpeg_params.max_height) {
+            height -= modulus;
+        }
+    }
+
+    bool same_size = width == source_width && height == source_height && std::fabs(media.sample_aspect - 1.0) < 0.01;
+    ffmpeg_params.resolution = same_size ? "" : std::to_string(width) + "x" + std::to_string(height);
+}
+
+// Black bar detection: cropdetect over short windows spread through the
+// file, run in parallel with input seeking instead of decoding it all.
+// Each window reports the picture area seen over its frames; windows that
+// were black throughout are ignored, and the crop keeps everything any
+// other window saw, so a dark scene can't crop into the picture.
+bool detect_crop(FFmpegParams& ffmpeg_params,
+                 const std::string& input_file,
+                 const MediaInfo& media,
+                 int analyze_duration,
+                 int probe_size,
+                 bool verbose,
+                 bool execute,
+                 const ExecContext& exec) {
+    const int window_count = 8;
+    const double window = std::min(2.0, media.duration / window_count);
+    std::vector<double> starts = sample_windows(media, window_count, window);
+    if (starts.empty() || window <= 0.0 || media.width <= 0 || media.height <= 0) {
+        std::cout << "Note: Unknown duration or size, no crop detection for " << input_file << std::endl;
+        return false;
+    }
+
+    if (!execute) {
+        std::cout << "Crop detection for " << input_file << ": cropdetect on " << starts.size() << " windows of "
+                  << format_seconds(window) << "s" << std::endl;
+        return true;
+    }
+
+    fs::path work_dir = fs::temp_directory_path() /
+        ("hb-ffmpeg-conv-crop-" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::string>()(input_file)));
+    std::error_code ec;
+    fs::create_directories(work_dir, ec);
+
+    auto build = [&](int k, const FFmpegParams& budgeted) {
+        std::string log = (work_dir / (std::to_string(k) + ".log")).string();
+        std::vector<std::string> cmd = {"ffmpeg"};
+        if (budgeted.threads > 0) {
+            cmd.insert(cmd.end(), {"-threads", std::to_string(budgeted.threads)});
+        }
+        cmd.insert(cmd.end(), {
+            "-ss", format_seconds(starts[k]), "-t", format_seconds(window),
+            "-analyzeduration", std::to_string(analyze_duration), "-probesize", std::to_string(probe_size),
+            "-i", input_file, "-map", "0:v:0",
+            "-vf", "cropdetect=limit=24:round=2:reset=0,metadata=mode=print:file=" + log,
+            "-an", "-sn", "-dn", "-v", "error", "-f", "null", get_null_device()
+        });
+        return std::vector<std::vector<std::string>>{cmd};
+    };
+    int failed = run_sample_jobs(input_file, "crop", static_cast<int>(starts.size()), ffmpeg_params, media, exec,
+                                 verbose, build);
+
+    // Union of the picture areas; cropdetect's last frame carries the
+    // window's totals since it doesn't reset
+    int x1 = media.width, y1 = media.height, x2 = -1, y2 = -1;
+    int usable = 0;
+    for (size_t k = 0; k < starts.size(); ++k) {
+        std::ifstream in(work_dir / (std::to_string(k) + ".log"));
+        std::map<std::string, int> box;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.rfind("lavfi.cropdetect.", 0) == 0 && line.find('=') != std::string::npos) {
+                box[line.substr(17, line.find('=') - 17)] = static_cast<int>(parse_rational(line.substr(line.find('=') + 1)));
+            }
+        }
+        if (!box.count("x1") || box["x2"] - box["x1"] < media.width / 4 || box["y2"] - box["y1"] < media.height / 4) {
+            continue;
+        }
+        usable++;
+        x1 = std::min(x1, box["x1"]);
+        y1 = std::min(y1, box["y1"]);
+        x2 = std::max(x2, box["x2"]);
+        y2 = std::max(y2, box["y2"]);
+    }
+    fs::remove_all(work_dir, ec);
+
+    if (failed > 0 || usable * 2 < static_cast<int>(starts.size())) {
+        std::cout << "Warning: Crop detection found too few usable windows (" << usable << " of " << starts.size()
+                  << "), not cropping " << input_file << std::endl;
+        return false;
+    }
+
+    // Even edges, rounded towards keeping picture
+    int crop[4] = {y1 & ~1, (media.height - 1 - y2) & ~1, x1 & ~1, (media.width - 1 - x2) & ~1};
+    long long source_pixels = static_cast<long long>(media.width) * media.height;
+    long long kept_pixels = static_cast<long long>(media.width - crop[2] - crop[3]) * (media.height - crop[0] - crop[1]);
+    if (kept_pixels > source_pixels * 99 / 100) {
+        std::cout << "Crop detection: no black bars in " << input_file << std::endl;
+        return true;
+    }
+
+    int width, height;
+    get_output_dimensions(ffmpeg_params, media, width, height);
+    std::copy(crop, crop + 4, ffmpeg_params.crop);
+    apply_crop(ffmpeg_params, media);
+    int cropped_width, cropped_height;
+    get_output_dimensions(ffmpeg_params, media, cropped_width, cropped_height);
+
+    long long encoded_pixels = static_cast<long long>(width) * height;
+    long long saved_pixels = encoded_pixels - static_cast<long long>(cropped_width) * cropped_height;
+    std::cout << "Crop detection: " << ffmpeg_params.crop_filter << " for " << input_file << " (" << usable << " of "
+              << starts.size() << " windows), " << width << "x" << height << " encoded as " << cropped_width << "x"
+              << cropped_height << ": " << saved_pixels << " fewer pixels per frame ("
+              << 100 * saved_pixels / std::max(1LL, encoded_pixels) << "%)" << std::endl;
+    return true;
+}
+
+// Deinterlace or inverse telecine for what detect_field_type() found,
+// with the filters the preset asked for
+void apply_field_filter(FFmpegParams& ffmpeg_params, const MediaInfo& media) {
+    ffmpeg_params.field_filter.clear();
+    std::string parity = media.field_order == "bff" ? "bff" : "tff";
+
+    if (media.field_type == "telecined" && ffmpeg_params.detelecine) {
+        // Frames fieldmatch can't pair are left combed for the deinterlacer
+        ffmpeg_params.field_filter = "fieldmatch=order=" + parity + ",";
+        if (!ffmpeg_params.deinterlacer.empty()) {
+            ffmpeg_params.field_filter += ffmpeg_params.deinterlacer + "=deint=interlaced,";
+        }
+        ffmpeg_params.field_filter += "decimate";
+    } else if ((media.field_type == "interlaced" || media.field_type == "telecined") &&
+               !ffmpeg_params.deinterlacer.empty()) {
+        ffmpeg_params.field_filter = ffmpeg_params.deinterlacer + "=mode=" + ffmpeg_params.deinterlace_mode +
+                                     ":parity=" + parity;
+    }
+}
+
+// Progressive, interlaced or telecined, from idet over short windows spread
+// through the file, run in parallel with input seeking. The answer is kept
+// in the MediaInfo and in a cache keyed by the file's path, size and
+// modification time, so re-runs and resumed encodes agree without
+// looking again.
+bool detect_field_type(FFmpegParams& ffmpeg_params,
+                       const std::string& input_file,
+                       MediaInfo& media,
+                       const std::string& cache_file,
+                       int analyze_duration,
+                       int probe_size,
+                       bool verbose,
+                       bool execute,
+                       const ExecContext& exec) {
+    std::error_code ec;
+    auto mtime = fs::last_write_time(input_file, ec);
+    std::string key = source_identity(input_file, ffmpeg_params) + "|" + std::to_string(media.file_size) + "|" +
+                      std::to_string(static_cast<long long>(mtime.time_since_epoch().count()));
+
+    if (media.field_type.empty()) {
+        std::ifstream in(cache_file);
+        std::string line;
+        while (std::getline(in, line)) {
+            try {
+                json entry = json::parse(line);
+                if (entry.value("key", "") == key) {
+                    media.field_type = entry.value("field_type", "");
+                    media.field_order = entry.value("field_order", media.field_order);
+                }
+            } catch (json::exception&) {
+                continue;
+            }
+        }
+    }
+    if (!media.field_type.empty()) {
+        apply_field_filter(ffmpeg_params, media);
+        if (verbose) {
+            std::cout << "Field detection (cached): " << input_file << " is " << media.field_type << std::endl;
+        }
+        return true;
+    }
+
+    const int window_count = 6;
+    const double window = std::min(4.0, media.duration / window_count);
+    std::vector<double> starts = sample_windows(media, window_count, window);
+    if (starts.empty() || window <= 0.0) {
+        std::cout << "Note: Unknown duration, no field detection for " << input_file << std::endl;
+        return false;
+    }
+
+    if (!execute) {
+        std::cout << "Field detection for " << input_file << ": idet on " << starts.size() << " windows of "
+                  << format_seconds(window) << "s" << std::endl;
+        return true;
+    }
+
+    fs::path work_dir = fs::temp_directory_path() /
+        ("hb-ffmpeg-conv-idet-" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::string>()(input_file)));
+    fs::create_directories(work_dir, ec);
+
+    auto build = [&](int k, const FFmpegParams& budgeted) {
+        std::string log = (work_dir / (std::to_string(k) + ".log")).string();
+        std::vector<std::string> cmd = {"ffmpeg"};
+        if (budgeted.threads > 0) {
+            cmd.insert(cmd.end(), {"-threads", std::to_string(budgeted.threads)});
+        }
+        cmd.insert(cmd.end(), {
+            "-ss", format_seconds(starts[k]), "-t", format_seconds(window),
+            "-analyzeduration", std::to_string(analyze_duration), "-probesize", std::to_string(probe_size),
+            "-i", input_file, "-map", "0:v:0",
+            "-vf", "idet,metadata=mode=print:file=" + log,
+            "-an", "-sn", "-dn", "-v", "error", "-f", "null", get_null_device()
+        });
+        return std::vector<std::vector<std::string>>{cmd};
+    };
+    int failed = run_sample_jobs(input_file, "idet", static_cast<int>(starts.size()), ffmpeg_params, media, exec,
+                                 verbose, build);
+
+    // idet's counters are running totals, so each window's last frame has
+    // the window's counts
+    std::map<std::string, double> totals;
+    for (size_t k = 0; k < starts.size(); ++k) {
+        std::ifstream in(work_dir / (std::to_string(k) + ".log"));
+        std::map<std::string, double> counts;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.rfind("lavfi.idet.", 0) == 0 && line.find('=') != std::string::npos) {
+                counts[line.substr(11, line.find('=') - 11)] = parse_rational(line.substr(line.find('=') + 1));
+            }
+        }
+        for (const auto& count : counts) {
+            totals[count.first] += count.second;
+        }
+    }
+    fs::remove_all(work_dir, ec);
+
+    double interlaced = totals["multiple.tff"] + totals["multiple.bff"];
+    double frames = interlaced + totals["multiple.progressive"];
+    double repeated = totals["repeated.top"] + totals["repeated.bottom"];
+    if (failed > 0 || frames < 10) {
+        std::cout << "Warning: Field detection failed for " << input_file << ", treating it as progressive"
+                  << std::endl;
+        return false;
+    }
+
+    // 3:2 pulldown repeats a field in two of every five frames and leaves
+    // about as many combed; real interlacing combs most frames and repeats
+    // nothing
+    if (interlaced < 0.1 * frames) {
+        media.field_type = "progressive";
+    } else if (repeated >= 0.15 * (repeated + totals["repeated.neither"]) && interlaced < 0.7 * frames) {
+        media.field_type = "telecined";
+    } else {
+        media.field_type = "interlaced";
+    }
+    if (interlaced > 0) {
+        media.field_order = totals["multiple.bff"] > totals["multiple.tff"] ? "bff" : "tff";
+    }
+
+    append_json_line(cache_file, {{"key", key}, {"field_type", media.field_type}, {"field_order", media.field_order}});
+    apply_field_filter(ffmpeg_params, media);
+
+    std::cout << "Field detection: " << input_file << " is " << media.field_type << " ("
+              << static_cast<int>(100 * interlaced / frames) << "% combed, "
+              << static_cast<int>(100 * repeated / std::max(1.0, repeated + totals["repeated.neither"]))
+              << "% repeated fields over " << static_cast<int>(frames) << " frames)"
+              << (ffmpeg_params.field_filter.empty() ? "" : ", filtering with " + ffmpeg_params.field_filter)
+              << std::endl;
+    return true;
+}
+
+std::string loudness_log_prefix(const std::string& input_file) {
+    return (fs::temp_directory_path() / ("hb-ffmpeg-conv-loudness-" + std::to_string(getpid()) + "-" +
+                                         std::to_string(std::hash<std::string>()(input_file)))).string();
+}
+
+// Loudness of each track from the ebur128 logs of a measuring decode; its
+// values are running totals, so the last frame has the whole track. The
+// logs are removed. first_track numbers the tracks in the report.
+bool read_loudness(const std::string& log_prefix, int tracks, int first_track, const std::string& input_file,
+                   const FFmpegParams& ffmpeg_params, std::vector<Loudness>& loudness) {
+    std::vector<Loudness> measured(tracks);
+    bool complete = tracks > 0;
+    for (int track = 0; track < tracks; ++track) {
+        std::string log = log_prefix + "-" + std::to_string(track) + ".log";
+        std::map<std::string, double> values;
+        std::ifstream in(log);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.rfind("lavfi.r128.", 0) == 0 && line.find('=') != std::string::npos) {
+                values[line.substr(11, line.find('=') - 11)] = parse_rational(line.substr(line.find('=') + 1));
+            }
+        }
+        in.close();
+        std::error_code ec;
+        fs::remove(log, ec);
+
+        if (!values.count("I") || !values.count("LRA")) {
+            complete = false;
+            continue;
+        }
+        measured[track].integrated = values["I"];
+        measured[track].range = values["LRA"];
+        // Peaks are linear amplitudes
+        double peak = values.count("true_peak") ? values["true_peak"] : 1.0;
+        measured[track].true_peak = peak > 0.0 ? std::max(-99.0, 20.0 * std::log10(peak)) : -99.0;
+    }
+
+    if (!complete) {
+        std::cout << "Warning: Loudness measurement failed for " << input_file
+                  << ", loudnorm falls back to dynamic normalization" << std::endl;
+        return false;
+    }
+    loudness = measured;
+    for (int track = 0; track < tracks; ++track) {
+        const Loudness& m = measured[track];
+        double gain = ffmpeg_params.loudness_target - m.integrated;
+        bool linear = m.true_peak + gain <= -1.0 && m.range <= 20.0;
+        std::cout << "Loudness: " << input_file << " track " << first_track + track << ": "
+                  << format_number(m.integrated, 1)
+                  << " LUFS, " << format_number(m.true_peak, 1) << " dBTP, LRA " << format_number(m.range, 1)
+                  << " LU -> " << (m.integrated <= -70.0 ? std::string("silent, left alone")
+                                   : format_number(gain, 1) + " dB" + (linear ? "" : " (peaks too high, dynamic)"))
+                  << std::endl;
+    }
+    return true;
+}
+
+// Loudness from an audio-only decode for encodes without a pass 1 to
+// measure in, of every track or only of `track`. Video isn't decoded, so
+// this is a fraction of the encode's work and runs next to the sampling
+// passes or the video encode.
+bool measure_loudness(const FFmpegParams& ffmpeg_params,
+                      const std::string& input_file,
+                      const MediaInfo& media,
+                      int track,
+                      std::vector<Loudness>& loudness,
+                      int analyze_duration,
+                      int probe_size,
+                      bool verbose,
+                      bool execute,
+                      const ExecContext& exec) {
+    int tracks = track >= 0 ? 1 : media.audio_streams;
+    FFmpegParams measure = ffmpeg_params;
+    measure.acodec = "-c:a pcm_f32le";
+    measure.loudness_log = loudness_log_prefix(input_file) + (track >= 0 ? "-a" + std::to_string(track) : "");
+    measure.audio_tracks = tracks;
+    measure.loudness.clear();
+
+    std::vector<std::string> cmd = {"ffmpeg", "-analyzeduration", std::to_string(analyze_duration),
+                                    "-probesize", std::to_string(probe_size)};
+    append_audio_input_options(cmd, ffmpeg_params);
+    cmd.insert(cmd.end(), {"-i", input_file, "-map", track >= 0 ? "0:a:" + std::to_string(track) : "0:a",
+                           "-vn", "-sn", "-dn"});
+    append_audio_options(cmd, measure);
+    if (!verbose) {
+        cmd.insert(cmd.end(), {"-v", "error"});
+    }
+    cmd.insert(cmd.end(), {"-f", "null", get_null_device()});
+
+    if (!execute) {
+        std::cout << "Loudness measurement for " << input_file << " (audio only, "
+                  << (track >= 0 ? "track " + std::to_string(track)
+                                 : std::to_string(tracks) + (tracks == 1 ? " track" : " tracks")) << "):" << std::endl;
+        print_command(cmd);
+        return true;
+    }
+
+    if (execute_command(cmd, verbose, exec) != 0) {
+        for (int k = 0; k < tracks; ++k) {
+            std::error_code ec;
+            fs::remove(measure.loudness_log + "-" + std::to_string(k) + ".log", ec);
+        }
+        std::cout << "Warning: Loudness measurement failed for " << input_file
+                  << ", loudnorm falls back to dynamic normalization" << std::endl;
+        return false;
+    }
+    return read_loudness(measure.loudness_log, tracks, std::max(0, track), input_file, ffmpeg_params, loudness);
+}
+
+// Everything that decides what the encoded video looks like; a checkpoint
+// is only resumed with the same settings. Thread knobs don't count, nor
+// does the preset the deadline governor picked for this run.
+std::string encode_settings_signature(const FFmpegParams& ffmpeg_params) {
+    FFmpegParams params = ffmpeg_params;
+    if (!params.requested_preset.empty()) {
+        params.preset = params.requested_preset;
+        params.requested_preset.clear();
+    }
+    params.threads = 0;
+    params.passlogfile.clear();
+    params.encoder_flags.clear();
+
+    std::vector<std::string> options;
+    for (const auto& option : split_encoder_options(params.encoder_options)) {
+        std::string key = option.substr(0, option.find('='));
+        if (key != "pools" && key != "frame-threads" && key != "lookahead_threads" && key != "lp" &&
+            key != "stats") {
+            options.push_back(option);
+        }
+    }
+    params.encoder_options = join_string(options, ":");
+
+    std::vector<std::string> cmd;
+    append_video_options(cmd, params);
+    return join_string(cmd, " ") + (params.multipass ? " multipass" : "");
+}
+
+// Segment start times, as packet times. Boundaries sit half a frame before
+// a frame time so no frame lands exactly on one and ends up in two
+// segments (or none). The count comes from the video stream's length, so
+// a longer audio track doesn't add an empty last segment.
+std::vector<std::string> plan_checkpoint_boundaries(const MediaInfo& media, double segment_seconds) {
+    double frame_duration = media.framerate > 0.0 ? 1.0 / media.framerate : 0.0;
+    double video_duration = media.video_duration > 0.0
+                          ? media.video_duration
+                          : media.duration - (media.video_start_time - media.start_time);
+    int segment_count = std::max(1, static_cast<int>(std::ceil((video_duration - frame_duration / 2) /
+                                                               segment_seconds)));
+    std::vector<std::string> boundaries;
+    for (int i = 0; i < segment_count; ++i) {
+        double t = media.video_start_time + i * segment_seconds;
+        if (i > 0 && frame_duration > 0.0) {
+            t = media.video_start_time + (std::round(i * segment_seconds / frame_duration) - 0.5) * frame_duration;
+        }
+        boundaries.push_back(format_number(t, 6));
+    }
+    return boundaries;
+}
+
+// First passes only gather rate control stats; analysis is saved or
+// loaded by the pass that writes the output
+void strip_analysis_options(FFmpegParams& ffmpeg_params) {
+    std::vector<std::string> options;
+    for (const auto& option : split_encoder_options(ffmpeg_params.encoder_options)) {
+        std::string key = option.substr(0, option.find('='));
+        if (key.substr(0, 8) != "analysis" && key != "scale-factor") {
+            options.push_back(option);
+        }
+    }
+    ffmpeg_params.encoder_options = join_string(options, ":");
+}
+
+// The input's path for cache keys and checkpoints: the source's, also
+// while a staged copy of it is read
+std::string source_identity(const std::string& input_file, const FFmpegParams& ffmpeg_params) {
+    return fs::absolute(ffmpeg_params.source_file.empty() ? input_file : ffmpeg_params.source_file).string();
+}
+
+// Everything x265 needs to match for analysis data to be reused: the
+// source frames and the encoder structure, but not rate control.
+std::string analysis_cache_key(const std::string& input_file, const MediaInfo& media,
+                               const FFmpegParams& ffmpeg_params, int width, int height) {
+    std::error_code ec;
+    auto mtime = fs::last_write_time(input_file, ec);
+
+    std::vector<std::string> options;
+    for (const auto& option : split_encoder_options(ffmpeg_params.encoder_options)) {
+        std::string key = option.substr(0, option.find('='));
+        if (key != "pools" && key != "frame-threads" && key != "stats" && key.substr(0, 8) != "analysis" &&
+            key != "scale-factor") {
+            options.push_back(option);
+        }
+    }
+
+    std::string identity = source_identity(input_file, ffmpeg_params) + "|" + std::to_string(media.file_size) + "|" +
+                           std::to_string(static_cast<long long>(mtime.time_since_epoch().count())) + "|" +
+                           std::to_string(width) + "x" + std::to_string(height) + "|" + ffmpeg_params.framerate +
+                           "|" + ffmpeg_params.preset + "|" + ffmpeg_params.profile + "|" + ffmpeg_params.tune +
+                           "|" + ffmpeg_params.level + "|" + join_string(options, ":");
+
+    std::ostringstream key;
+    key << std::hex << std::setw(16) << std::setfill('0') << std::hash<std::string>()(identity);
+    return key.str();
+}
+
+// Point a libx265 encode at the analysis cache: load the analysis of an
+// earlier encode of the same frames, or one saved for reuse at twice its
+// size (x265 scales it up), otherwise save this encode's analysis. x265
+// needs the scale factor on both sides, so encodes that fit into the
+// source twice over save scaled for the larger ones. Saves go to a .part
+// file that finish_analysis_save() publishes.
+void plan_analysis_reuse(FFmpegParams& ffmpeg_params, const std::string& input_file, const MediaInfo& media,
+                         std::vector<std::string>& pending_saves) {
+    if (ffmpeg_params.analysis_cache.empty() || ffmpeg_params.vcodec != "libx265") {
+        return;
+    }
+
+    int width, height;
+    get_output_dimensions(ffmpeg_params, media, width, height);
+    fs::path cache_dir(ffmpeg_params.analysis_cache);
+    auto cache_file = [&](int w, int h, bool scaled) {
+        return cache_dir / (analysis_cache_key(input_file, media, ffmpeg_params, w, h) + (scaled ? "-x2" : "") + ".dat");
+    };
+
+    // Half this size was rounded to the modulus either way by its encode
+    int modulus = std::max(2, ffmpeg_params.modulus);
+    std::vector<std::pair<fs::path, bool>> candidates = {{cache_file(width, height, false), false}};
+    for (int w : {width / 2 / modulus * modulus, (width / 2 + modulus - 1) / modulus * modulus}) {
+        for (int h : {height / 2 / modulus * modulus, (height / 2 + modulus - 1) / modulus * modulus}) {
+            std::pair<fs::path, bool> candidate(cache_file(w, h, true), true);
+            if (std::find(candidates.begin(), candidates.end(), candidate) == candidates.end()) {
+                candidates.push_back(candidate);
+            }
+        }
+    }
+
+    std::error_code ec;
+    for (const auto& candidate : candidates) {
+        if (!fs::exists(candidate.first, ec)) {
+            continue;
+        }
+        // Keep recently used entries out of the way of pruning
+        fs::last_write_time(candidate.first, fs::file_time_type::clock::now(), ec);
+        set_encoder_option(ffmpeg_params, "analysis-load", escape_encoder_value(candidate.first.string()));
+        set_encoder_option(ffmpeg_params, "analysis-load-reuse-level", "10");
+        if (candidate.second) {
+            set_encoder_option(ffmpeg_params, "scale-factor", "2");
+        }
+        return;
+    }
+
+    int source_width = ffmpeg_params.source_width > 0 ? ffmpeg_params.source_width : media.width;
+    int source_height = ffmpeg_params.source_height > 0 ? ffmpeg_params.source_height : media.height;
+    bool scaled = source_width > 0 && source_height > 0 && width * 2 <= source_width + modulus &&
+                  height * 2 <= source_height + modulus;
+
+    // Two renditions of the same size in one ladder only save once
+    std::string part_file = cache_file(width, height, scaled).string() + ".part";
+    if (std::find(pending_saves.begin(), pending_saves.end(), part_file) != pending_saves.end()) {
+        return;
+    }
+    set_encoder_option(ffmpeg_params, "analysis-save", escape_encoder_value(part_file));
+    set_encoder_option(ffmpeg_params, "analysis-save-reuse-level", "10");
+    if (scaled) {
+        set_encoder_option(ffmpeg_params, "scale-factor", "2");
+    }
+    pending_saves.push_back(part_file);
+}
+
+// Publish analysis saved by a successful encode, drop it otherwise, then
+// trim the cache to its size limit by evicting the least recently used.
+void finish_analysis_save(const std::vector<std::string>& pending_saves, bool success, long long cache_limit) {
+    if (pending_saves.empty()) {
+        return;
+    }
+
+    std::error_code ec;
+    for (const auto& part_file : pending_saves) {
+        if (success) {
+            fs::rename(part_file, part_file.substr(0, part_file.size() - 5), ec);
+        } else {
+            fs::remove(part_file, ec);
+        }
+    }
+
+    fs::path cache_dir = fs::path(pending_saves[0]).parent_path();
+    std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+    long long total = 0;
+    for (const auto& entry : fs::directory_iterator(cache_dir, ec)) {
+        if (entry.path().extension() == ".dat") {
+            entries.emplace_back(fs::last_write_time(entry.path(), ec), entry.path());
+            total += static_cast<long long>(fs::file_size(entry.path(), ec));
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    for (const auto& entry : entries) {
+        if (total <= cache_limit) {
+            break;
+        }
+        total -= static_cast<long long>(fs::file_size(entry.second, ec));
+        fs::remove(entry.second, ec);
+    }
+}
+
+int encode_checkpointed(const std::string& input_file,
+                        const std::string& output_file,
+                        const FFmpegParams& ffmpeg_params,
+                        const MediaInfo& media,
+                        double segment_seconds,
+                        int parallel_segments,
+                        int analyze_duration,
+                        int probe_size,
+                        bool verbose,
+                        bool execute,
+                        const ExecContext& exec) {
+    if (media.duration <= 0.0) {
+        std::cout << "Error: Unknown duration, can't checkpoint " << input_file << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> boundaries = plan_checkpoint_boundaries(media, segment_seconds);
+    int segment_count = static_cast<int>(boundaries.size());
+
+    fs::path out_path(output_file);
+    fs::path work_dir = !ffmpeg_params.checkpoint_dir.empty()
+                        ? fs::path(ffmpeg_params.checkpoint_dir)
+                        : out_path.parent_path() / ("." + out_path.stem().string() + ".checkpoint");
+    fs::path state_file = work_dir / "state.json";
+
+    std::vector<std::string> segment_files;
+    for (int i = 0; i < segment_count; ++i) {
+        segment_files.push_back((work_dir / ("segment" + std::to_string(10000 + i).substr(1) + ".mkv")).string());
+    }
+    auto segment_start = [&](int i) {
+        return input_seek_time(boundaries[i], media);
+    };
+    auto segment_end = [&](int i) {
+        return i + 1 < segment_count ? input_seek_time(boundaries[i + 1], media) : std::string();
+    };
+
+    if (!execute) {
+        std::cout << "Checkpointed encode of " << input_file << " (" << segment_count << " segments of "
+                  << segment_seconds << "s, state in " << state_file << "):" << std::endl;
+        for (int i = 0; i < segment_count; ++i) {
+            for (const auto& cmd : build_segment_commands(input_file, segment_files[i], ffmpeg_params, segment_start(i),
+                                                          segment_end(i), analyze_duration, probe_size, verbose)) {
+                print_command(cmd);
+            }
+        }
+        print_command(build_join_command(input_file, (work_dir / "segments.txt").string(), output_file,
+                                         ffmpeg_params, media, boundaries[0], analyze_duration, probe_size, verbose));
+        return 0;
+    }
+
+    std::cout << "Processing: " << input_file << std::endl;
+    std::cout << "Output: " << output_file << std::endl;
+
+    // The state is only valid for the same input, settings and segmenting
+    json identity = {
+        {"input", source_identity(input_file, ffmpeg_params)},
+        {"input_size", media.file_size},
+        {"input_mtime", static_cast<long long>(fs::last_write_time(input_file).time_since_epoch().count())},
+        {"settings", encode_settings_signature(ffmpeg_params)},
+        {"segment_seconds", segment_seconds}
+    };
+
+    json state;
+    std::ifstream state_in(state_file);
+    if (state_in.is_open()) {
+        try {
+            state = json::parse(state_in);
+        } catch (json::parse_error&) {
+            state = json();
+        }
+    }
+    if (!state.is_object() || state.value("identity", json()) != identity) {
+        if (state.is_object()) {
+            std::cout << "Input or settings changed since the last checkpoint, starting over" << std::endl;
+        }
+        std::error_code ec;
+        fs::remove_all(work_dir, ec);
+        state = {{"identity", identity}, {"completed", json::object()}};
+    }
+
+    try {
+        fs::create_directories(work_dir);
+    } catch (const fs::filesystem_error& e) {
+        std::cout << "Error creating checkpoint directory: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // A segment counts as done only if it is recorded and still on disk
+    // with the frames it had when it was recorded
+    std::vector<int> pending;
+    for (int i = 0; i < segment_count; ++i) {
+        json done = state["completed"].value(std::to_string(i), json());
+        if (!done.is_object() || !fs::exists(segment_files[i]) || done.value("frames", -1L) < 0 ||
+            count_video_frames(segment_files[i]) != done.value("frames", -1L)) {
+            state["completed"].erase(std::to_string(i));
+            pending.push_back(i);
+        }
+    }
+    if (pending.size() < static_cast<size_t>(segment_count)) {
+        std::cout << "Resuming from checkpoint: " << (segment_count - pending.size()) << " of "
+                  << segment_count << " segments already done" << std::endl;
+    } else {
+        std::cout << "Encoding " << segment_count << " segments of " << segment_seconds << "s" << std::endl;
+    }
+
+    // Runs in the segment workers, so failures are reported, not thrown; a
+    // segment missing from the state is only encoded again on resume
+    std::mutex state_mutex;
+    auto save_state = [&]() {
+        fs::path temp_file = work_dir / "state.json.tmp";
+        std::ofstream out(temp_file);
+        out << state.dump(2) << std::endl;
+        out.close();
+        std::error_code ec;
+        fs::rename(temp_file, state_file, ec);
+        if (!out || ec) {
+            std::cout << "Warning: Could not save checkpoint " << state_file
+                      << (ec ? ": " + ec.message() : std::string()) << std::endl;
+        }
+    };
+    save_state();
+
+    std::vector<Job> segment_jobs;
+    for (int i : pending) {
+        Job job;
+        job.input_file = input_file + " [segment " + std::to_string(i + 1) + "/" + std::to_string(segment_count) + "]";
+        job.media = media;
+        job.params = ffmpeg_params;
+        job.exec = exec;
+        job.exec.cpus.clear();
+        job.exec.nodes.clear();
+        job.run = [&, i](Job& j) {
+            int result_code = 0;
+            for (const auto& cmd : build_segment_commands(input_file, segment_files[i], j.params, segment_start(i),
+                                                          segment_end(i), analyze_duration, probe_size, verbose)) {
+                result_code = execute_command(cmd, verbose, j.exec);
+                if (result_code != 0) {
+                    std::cout << "Error: Segment " << (i + 1) << " failed with return code " << result_code << std::endl;
+                    return result_code;
+                }
+            }
+
+            std::lock_guard<std::mutex> guard(state_mutex);
+            state["completed"][std::to_string(i)] = {
+                {"file", fs::path(segment_files[i]).filename().string()},
+                {"frames", count_video_frames(segment_files[i])}
+            };
+            save_state();
+            return 0;
+        };
+        segment_jobs.push_back(job);
+    }
+
+    if (run_job_queue(segment_jobs, segment_scheduler(ffmpeg_params, exec, parallel_segments, verbose)) > 0) {
+        std::cout << "Error: Encode stopped, rerun to resume from " << state_file << std::endl;
+        return 1;
+    }
+
+    long source_frames = count_video_frames(input_file);
+    if (join_segments(input_file, output_file, segment_files, ffmpeg_params, media, boundaries[0], source_frames,
+                      work_dir, analyze_duration, probe_size, verbose, exec) != 0) {
+        return 1;
+    }
+
+    std::error_code ec;
+    fs::remove_all(work_dir, ec);
+    return 0;
+}
+
+// Rewrite "-flag value" pairs so they only apply to one output stream,
+// e.g. "-crf 20" -> "-crf:v:1 20" and "-c:a aac" -> "-c:a:2 aac"
+std::vector<std::string> with_stream_specifier(const std::vector<std::string>& options,
+                                               const std::string& type, int index) {
+    std::vector<std::string> result;
+    for (size_t i = 0; i + 1 < options.size(); i += 2) {
+        std::string flag = options[i];
+        std::string suffix = ":" + type;
+        if (flag.size() > suffix.size() && flag.compare(flag.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            flag += ":" + std::to_string(index);
+        } else {
+            flag += suffix + ":" + std::to_string(index);
+        }
+        result.push_back(flag);
+        result.push_back(options[i + 1]);
+    }
+    return result;
+}
+
+std::string tee_format_name(const std::string& format) {
+    if (format == "mkv") {
+        return "matroska";
+    }
+    if (format == "m4v") {
+        return "mp4";
+    }
+    return format;
+}
+
+// A file name as a tee slave: the muxer splits slaves at '|', reads their
+// options from '[...]' and unquotes the rest, so those are escaped
+std::string tee_slave_name(const std::string& output_file) {
+    std::string result;
+    for (char c : output_file) {
+        if (c == '\\' || c == '|' || c == '[' || c == ']' || c == '\'') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+// One decode for every rendition: the video is split and scaled once per
+// rendition in a single filter graph, each rendition gets its own encoder
+// and the tee muxer writes each to its own file. Renditions with the same
+// audio settings share one audio encode.
+std::vector<std::vector<std::string>> build_ladder_commands(const std::string& input_file,
+                                                            const std::vector<std::string>& output_files,
+                                                            const std::vector<FFmpegParams>& renditions,
+                                                            const MediaInfo& media,
+                                                            int analyze_duration,
+                                                            int probe_size,
+                                                            bool verbose,
+                                                            const std::string& passlogfile) {
+    // Two-pass renditions go first so their stream numbers, which ffmpeg
+    // puts in the pass log names, are the same in both passes
+    std::vector<int> order;
+    std::vector<int> multipass;
+    for (int i = 0; i < static_cast<int>(renditions.size()); ++i) {
+        if (uses_two_pass(renditions[i])) {
+            multipass.push_back(i);
+        }
+    }
+    order = multipass;
+    for (int i = 0; i < static_cast<int>(renditions.size()); ++i) {
+        if (std::find(multipass.begin(), multipass.end(), i) == multipass.end()) {
+            order.push_back(i);
+        }
+    }
+    if (order.empty()) {
+        return {};
+    }
 
-    // Remove the output file (last element)
-    pass1_cmd.pop_back();
+    // Input, split/scale graph and video encoders for the given renditions
+    auto build_video = [&](const std::vector<int>& members, int pass) {
+        int count = static_cast<int>(members.size());
+        // Source-size filters run once ahead of the split; each rendition
+        // denoises and finishes at its own size
+        const std::string& denoise = renditions[members[0]].denoise_filter;
+        std::vector<std::string> shared = video_filters(renditions[members[0]], true);
+        shared.erase(std::remove(shared.begin(), shared.end(), denoise), shared.end());
+        shared.push_back("split=" + std::to_string(count));
+        std::string filter = "[0:v:0]" + join_string(shared, ",");
+        for (int n = 0; n < count; ++n) {
+            filter += "[s" + std::to_string(n) + "]";
+        }
+        for (int n = 0; n < count; ++n) {
+            const FFmpegParams& rendition = renditions[members[n]];
+            std::vector<std::string> own = video_filters(rendition, false);
+            if (!denoise.empty() && std::find(own.begin(), own.end(), denoise) == own.end()) {
+                own.insert(own.begin(), denoise);
+            }
+            if (!scale_filter(rendition).empty()) {
+                own.insert(own.begin(), scale_filter(rendition));
+            }
+            filter += ";[s" + std::to_string(n) + "]" + (own.empty() ? "null" : join_string(own, ",")) +
+                      "[v" + std::to_string(n) + "]";
+        }
 
-    // Add pass and format parameters
-    pass1_cmd.push_back("-pass");
-    pass1_cmd.push_back("1");
-    pass1_cmd.push_back("-f");
-    pass1_cmd.push_back("null");
-    pass1_cmd.push_back(null_device);
+        std::vector<std::string> cmd = {
+            "ffmpeg", "-analyzeduration", std::to_string(analyze_duration),
+            "-probesize", std::to_string(probe_size)
+        };
+        if (pass > 1) {
+            append_audio_input_options(cmd, renditions[members[0]]);
+        }
+        cmd.insert(cmd.end(), {"-i", input_file});
+        if (renditions[members[0]].threads > 0) {
+            cmd.insert(cmd.end(), {"-filter_complex_threads", std::to_string(renditions[members[0]].threads)});
+        }
+        cmd.insert(cmd.end(), {"-filter_complex", filter});
 
-    // Second pass command
-    std::vector<std::string> pass2_cmd = build_ffmpeg_command(input_file, output_file, ffmpeg_params,
-                                                           analyze_duration, probe_size, verbose);
-    pass2_cmd.push_back("-pass");
-    pass2_cmd.push_back("2");
+        for (int n = 0; n < count; ++n) {
+            cmd.push_back("-map");
+            cmd.push_back("[v" + std::to_string(n) + "]");
 
-    commands.push_back(pass1_cmd);
-    commands.push_back(pass2_cmd);
+            FFmpegParams params = renditions[members[n]];
+            bool two_pass = n < static_cast<int>(multipass.size());
+            if (pass == 1) {
+                strip_analysis_options(params);
+            }
+            if (two_pass && params.vcodec == "libx265") {
+                set_encoder_option(params, "stats", passlogfile + "-" + std::to_string(n) + ".x265.log");
+            }
+            std::vector<std::string> options;
+            append_video_options(options, params);
+
+            // Scaling happens in the filter graph
+            std::vector<std::string> stream_options;
+            for (size_t j = 0; j + 1 < options.size(); j += 2) {
+                if (options[j] != "-s" && options[j] != "-vf" && options[j] != "-filter_threads") {
+                    stream_options.push_back(options[j]);
+                    stream_options.push_back(options[j + 1]);
+                }
+            }
+            if (two_pass && pass > 0) {
+                stream_options.insert(stream_options.end(), {"-pass", std::to_string(pass),
+                                                             "-passlogfile", passlogfile});
+            }
+            stream_options = with_stream_specifier(stream_options, "v", n);
+            cmd.insert(cmd.end(), stream_options.begin(), stream_options.end());
+        }
+        return cmd;
+    };
+
+    std::vector<std::vector<std::string>> commands;
+
+    if (!multipass.empty()) {
+        std::vector<std::string> pass1 = build_video(multipass, 1);
+        pass1.insert(pass1.end(), {"-an", "-sn"});
+        if (!verbose) {
+            pass1.insert(pass1.end(), {"-v", "error", "-stats"});
+        }
+        pass1.insert(pass1.end(), {"-f", "null", get_null_device()});
+        commands.push_back(pass1);
+    }
+
+    std::vector<std::string> cmd = build_video(order, 2);
+    int count = static_cast<int>(order.size());
+
+    // Audio: one set of encoded tracks per distinct audio setting
+    int tracks = media.audio_streams;
+    std::vector<std::vector<std::vector<std::string>>> audio_settings;  // group -> track -> options
+    std::vector<int> audio_group(count, 0);
+    for (int n = 0; n < count; ++n) {
+        const FFmpegParams& rendition = renditions[order[n]];
+        std::vector<std::vector<std::string>> setting;
+        for (int track = 0; track < tracks; ++track) {
+            std::vector<std::string> options = split_string(rendition.acodec + " " + rendition.audio_channels, ' ');
+            options.erase(std::remove(options.begin(), options.end(), ""), options.end());
+            std::string filters = audio_filter_chain(rendition, track);
+            if (rendition.acodec.find("copy") == std::string::npos && !filters.empty()) {
+                options.insert(options.end(), {"-filter:a", filters});
+            }
+            setting.push_back(options);
+        }
+        auto found = std::find(audio_settings.begin(), audio_settings.end(), setting);
+        audio_group[n] = static_cast<int>(found - audio_settings.begin());
+        if (found == audio_settings.end()) {
+            audio_settings.push_back(setting);
+        }
+    }
+
+    if (tracks > 0) {
+        for (size_t group = 0; group < audio_settings.size(); ++group) {
+            cmd.push_back("-map");
+            cmd.push_back("0:a");
+        }
+        for (size_t group = 0; group < audio_settings.size(); ++group) {
+            for (int track = 0; track < tracks; ++track) {
+                std::vector<std::string> options = with_stream_specifier(
+                    audio_settings[group][track], "a", static_cast<int>(group) * tracks + track);
+                cmd.insert(cmd.end(), options.begin(), options.end());
+            }
+        }
+    }
+    cmd.insert(cmd.end(), {"-map", "0:s?", "-flags", "+global_header"});
+
+    if (!verbose) {
+        cmd.insert(cmd.end(), {"-v", "error", "-stats"});
+    }
+
+    std::vector<std::string> slaves;
+    for (int n = 0; n < count; ++n) {
+        std::string select = "v:" + std::to_string(n);
+        for (int track = 0; track < tracks; ++track) {
+            select += ",a:" + std::to_string(audio_group[n] * tracks + track);
+        }
+        select += ",s";
+        slaves.push_back("[f=" + tee_format_name(renditions[order[n]].format) + ":select=\\'" + select + "\\']" +
+                         tee_slave_name(output_files[order[n]]));
+        for (const auto& extra_format : renditions[order[n]].extra_formats) {
+            std::string options = "f=" + tee_format_name(extra_format) + ":select=\\'" + select + "\\'";
+            if (tee_format_name(extra_format) == "mp4" || extra_format == "mov") {
+                options += ":movflags=+faststart";
+            }
+            slaves.push_back("[" + options + "]" +
+                             tee_slave_name(fs::path(output_files[order[n]]).replace_extension(extra_format).string()));
+        }
+    }
+    cmd.insert(cmd.end(), {"-f", "tee", join_string(slaves, "|")});
+    commands.push_back(cmd);
 
     return commands;
 }
 
-int execute_command(const std::vector<std::string>& cmd, bool verbose) {
-    std::string command = join_string(cmd, " ");
+int encode_ladder(const std::string& input_file,
+                  const std::vector<std::string>& output_files,
+                  const std::vector<FFmpegParams>& renditions,
+                  const FFmpegParams& ffmpeg_params,
+                  const MediaInfo& media,
+                  int analyze_duration,
+                  int probe_size,
+                  bool verbose,
+                  bool execute,
+                  const ExecContext& exec) {
+    // Split this job's thread budget between the renditions by size
+    std::vector<FFmpegParams> budgeted = renditions;
+    int total_threads = ffmpeg_params.threads > 0 ? ffmpeg_params.threads : get_available_cpus();
+    std::vector<double> weights;
+    double weight_sum = 0.0;
+    for (const auto& rendition : renditions) {
+        int width, height;
+        get_output_dimensions(rendition, media, width, height);
+        weights.push_back(resolution_weight(width, height));
+        weight_sum += weights.back();
+    }
+    for (size_t i = 0; i < budgeted.size(); ++i) {
+        int width, height;
+        get_output_dimensions(budgeted[i], media, width, height);
+        int threads = std::max(1, static_cast<int>(std::lround(total_threads * weights[i] / weight_sum)));
+        apply_thread_budget(budgeted[i], threads, width, height);
+    }
 
-    if (verbose) {
-        std::cout << "Executing: " << command << std::endl;
+    std::string passlogfile = (fs::path(output_files[0]).parent_path() /
+                               ("." + fs::path(output_files[0]).stem().string() + ".ladder")).string();
+    std::vector<std::vector<std::string>> commands = build_ladder_commands(
+        input_file, output_files, budgeted, media, analyze_duration, probe_size, verbose, passlogfile);
+
+    if (!execute) {
+        std::cout << "Ladder encode of " << input_file << " (" << renditions.size() << " renditions, one decode):"
+                  << std::endl;
+        for (const auto& cmd : commands) {
+            print_command(cmd);
+        }
+        return 0;
     }
 
-    return system(command.c_str());
+    std::cout << "Processing: " << input_file << std::endl;
+    for (const auto& output_file : output_files) {
+        std::cout << "Output: " << output_file << std::endl;
+    }
+
+    int result_code = 0;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        if (commands.size() > 1) {
+            std::cout << "Running pass " << (i + 1) << " of " << commands.size() << "..." << std::endl;
+        }
+        result_code = execute_command(commands[i], verbose, exec);
+        if (result_code != 0) {
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < renditions.size(); ++i) {
+        for (const char* suffix : {".log", ".log.mbtree", ".x265.log", ".x265.log.cutree"}) {
+            std::error_code ec;
+            fs::remove(passlogfile + "-" + std::to_string(i) + suffix, ec);
+        }
+    }
+
+    if (result_code != 0) {
+        std::cout << "Error: FFmpeg command failed with return code " << result_code << std::endl;
+        return 1;
+    }
+    std::cout << "Conversion successful (" << renditions.size() << " renditions from one decode)" << std::endl;
+    return 0;
 }
 
 bool rename_to_m4v(const std::string& file_path, bool dry_run) {
@@ -599,19 +5550,177 @@ std::vector<std::string> find_media_files(const std::string& directory,
     return result;
 }
 
-int process_file(const std::string& input_file,
-                const std::string& media_dir,
-                const std::string& output_dir,
-                const FFmpegParams& ffmpeg_params,
-                const std::string& original_format,
-                const std::string& output_format,
-                bool force_m4v,
-                bool execute,
-                bool dry_run,
-                bool replace_underscores,
-                int analyze_duration,
-                int probe_size,
-                bool verbose) {
+// One ffmpeg process for several inputs: each -i is mapped to its own
+// output with its own encoder, so the clips stay independent.
+std::vector<std::string> build_batch_command(const std::vector<std::string>& input_files,
+                                             const std::vector<std::string>& output_files,
+                                             const std::vector<FFmpegParams>& params,
+                                             int analyze_duration,
+                                             int probe_size,
+                                             bool verbose) {
+    std::vector<std::string> cmd = {"ffmpeg"};
+    for (size_t k = 0; k < input_files.size(); ++k) {
+        cmd.insert(cmd.end(), {"-analyzeduration", std::to_string(analyze_duration),
+                               "-probesize", std::to_string(probe_size)});
+        append_audio_input_options(cmd, params[k]);
+        cmd.insert(cmd.end(), {"-i", input_files[k]});
+    }
+
+    if (!verbose) {
+        cmd.insert(cmd.end(), {"-v", "error", "-stats"});
+    }
+
+    for (size_t k = 0; k < output_files.size(); ++k) {
+        append_video_options(cmd, params[k]);
+        append_audio_options(cmd, params[k]);
+
+        cmd.push_back("-map");
+        cmd.push_back(std::to_string(k));
+        append_output(cmd, output_files[k], params[k]);
+    }
+
+    return cmd;
+}
+
+// Encode short clips together. ffmpeg's exit code covers the whole batch,
+// so each output is checked on its own: it must run as long as its clip,
+// to within two frames. Members that fail are left with a non-zero
+// result, and their output removed, to be retried on their own.
+int process_batch(std::vector<Job>& members,
+                  const std::string& media_dir,
+                  const std::string& output_dir,
+                  const std::string& original_format,
+                  const std::string& output_format,
+                  bool force_m4v,
+                  bool execute,
+                  bool dry_run,
+                  bool replace_underscores,
+                  int analyze_duration,
+                  int probe_size,
+                  bool verbose,
+                  const ExecContext& exec,
+                  int threads) {
+    std::string actual_format = (force_m4v && execute) ? original_format : output_format;
+    bool run = execute && !dry_run;
+
+    std::vector<size_t> batched;
+    std::vector<std::string> input_files;
+    std::vector<std::string> output_files;
+    std::vector<FFmpegParams> params;
+    std::vector<std::vector<std::string>> remux_formats;
+    std::vector<std::vector<std::string>> analysis_saves;
+
+    for (size_t k = 0; k < members.size(); ++k) {
+        Job& member = members[k];
+        fs::path output_base = get_output_base(member.input_file, media_dir, output_dir, replace_underscores);
+        std::string output_file = output_base.string() + "." + actual_format;
+        if (!prepare_output_dir(output_base.parent_path(), dry_run) ||
+            (run && !check_file_access(output_file))) {
+            member.result = 1;
+            continue;
+        }
+
+        FFmpegParams member_params = member.params;
+        member_params.extra_formats.erase(std::remove(member_params.extra_formats.begin(),
+                                                      member_params.extra_formats.end(), output_format),
+                                          member_params.extra_formats.end());
+        remux_formats.emplace_back();
+        analysis_saves.emplace_back();
+        split_extra_formats(actual_format, member_params, member.media, remux_formats.back());
+        plan_analysis_reuse(member_params, member.input_file, member.media, analysis_saves.back());
+
+        // The clips encode side by side, so they share the job's budget
+        if (threads > 0) {
+            int width, height;
+            get_output_dimensions(member_params, member.media, width, height);
+            apply_thread_budget(member_params, std::max(1, threads / static_cast<int>(members.size())), width, height);
+        }
+
+        batched.push_back(k);
+        input_files.push_back(member.input_file);
+        output_files.push_back(output_file);
+        params.push_back(member_params);
+        member.result = 0;
+    }
+
+    if (batched.empty()) {
+        return static_cast<int>(members.size());
+    }
+
+    std::vector<std::string> cmd = build_batch_command(input_files, output_files, params,
+                                                       analyze_duration, probe_size, verbose);
+
+    if (!run) {
+        std::cout << (dry_run ? "[DRY RUN] Would execute" : "Generated command for") << " a batch of "
+                  << batched.size() << " clips:" << std::endl;
+        print_command(cmd);
+        for (size_t n = 0; n < batched.size(); ++n) {
+            remux_containers(output_files[n], remux_formats[n], params[n], members[batched[n]].media,
+                             verbose, false, exec);
+        }
+        return 0;
+    }
+
+    std::cout << "Processing a batch of " << batched.size() << " clips in one ffmpeg process:" << std::endl;
+    for (size_t n = 0; n < batched.size(); ++n) {
+        std::cout << "  " << input_files[n] << " -> " << output_files[n] << std::endl;
+    }
+
+    int result_code = execute_command(cmd, verbose, exec);
+    if (result_code != 0) {
+        std::cout << "Warning: Batch ffmpeg exited with code " << result_code << ", checking each output"
+                  << std::endl;
+    }
+
+    int failed = 0;
+    for (size_t n = 0; n < batched.size(); ++n) {
+        Job& member = members[batched[n]];
+        double fps = (params[n].framerate != "auto" && !params[n].framerate.empty())
+                     ? parse_rational(params[n].framerate) : member.media.framerate;
+        MediaInfo output = fs::exists(output_files[n]) ? probe_media(output_files[n], analyze_duration, probe_size)
+                                                       : MediaInfo();
+        // Stream durations where both have them; the container's can
+        // include longer audio
+        bool by_stream = member.media.video_duration > 0 && output.video_duration > 0;
+        double expected = by_stream ? member.media.video_duration : member.media.duration;
+        double actual = by_stream ? output.video_duration : output.duration;
+        bool ok = output.valid && actual > 0 && actual >= expected - (fps > 0 ? 2.0 / fps : 0.1);
+
+        finish_analysis_save(analysis_saves[n], ok, params[n].analysis_cache_limit);
+        if (ok) {
+            ok = remux_containers(output_files[n], remux_formats[n], params[n], member.media,
+                                  verbose, true, exec) == 0;
+        }
+
+        if (!ok) {
+            std::cout << "Batch output for " << member.input_file << " failed (" << format_number(actual, 2)
+                      << " of " << format_number(expected, 2) << " s), will retry it on its own" << std::endl;
+            std::error_code ec;
+            fs::remove(output_files[n], ec);
+            for (const auto& extra_format : params[n].extra_formats) {
+                fs::remove(fs::path(output_files[n]).replace_extension(extra_format), ec);
+            }
+            member.result = 1;
+            failed++;
+            continue;
+        }
+
+        if (force_m4v) {
+            if (!rename_to_m4v(output_files[n], dry_run)) {
+                std::cout << "Warning: Failed to rename file to .m4v" << std::endl;
+            }
+        }
+    }
+
+    std::cout << "Batch done: " << (batched.size() - failed) << " of " << batched.size()
+              << " clips converted" << std::endl;
+    return failed + static_cast<int>(members.size() - batched.size());
+}
+
+// Output path without extension: the input's place under media_dir
+// mirrored under output_dir, with the basename formatted
+fs::path get_output_base(const std::string& input_file, const std::string& media_dir,
+                         const std::string& output_dir, bool replace_underscores) {
     // Calculate relative path to preserve directory structure
     fs::path input_path(input_file);
     fs::path media_path(media_dir);
@@ -625,21 +5734,11 @@ int process_file(const std::string& input_file,
         output_subdir = fs::path(output_dir) / dir_part;
     }
 
-    std::string filename = input_path.filename().string();
-    std::string basename = input_path.stem().string();
-
     // Format basename (replace underscores with spaces if enabled)
-    std::string formatted_basename = format_filename(basename, replace_underscores);
-
-    // Determine the correct output format for initial conversion
-    std::string actual_format = output_format;
-    if (force_m4v && execute) {
-        // When executing with force_m4v, use original format first
-        actual_format = original_format;
-    }
-
-    fs::path output_file = output_subdir / (formatted_basename + "." + actual_format);
+    return output_subdir / format_filename(input_path.stem().string(), replace_underscores);
+}
 
+bool prepare_output_dir(const fs::path& output_subdir, bool dry_run) {
     // Create output subdirectory if needed
     if (!fs::exists(output_subdir)) {
         if (!dry_run) {
@@ -648,12 +5747,310 @@ int process_file(const std::string& input_file,
                 fs::create_directories(output_subdir);
             } catch (const fs::filesystem_error& e) {
                 std::cout << "Error creating directory: " << output_subdir << ": " << e.what() << std::endl;
-                return 1;
+                return false;
             }
         } else {
             std::cout << "[DRY RUN] Would create directory: " << output_subdir << std::endl;
         }
     }
+    return true;
+}
+
+// Copy with copy_file_range where the kernel has it (no trip through
+// user space, server-side on NFS 4.2), else in large sequential reads
+bool copy_file_contents(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    std::error_code ec;
+    return fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+#else
+    int in = open(from.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    bool ok = true;
+    bool fallback = true;
+#ifdef __linux__
+    fallback = false;
+    while (true) {
+        ssize_t copied = copy_file_range(in, nullptr, out, nullptr, 64 << 20, 0);
+        if (copied > 0) {
+            continue;
+        }
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        // Across file systems on older kernels, or not supported at all:
+        // the offsets are where it stopped, so plain reads carry on
+        if (copied < 0) {
+            fallback = errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL;
+            ok = fallback;
+        }
+        break;
+    }
+#endif
+    if (fallback) {
+        std::vector<char> buffer(8 << 20);
+        while (ok) {
+            ssize_t got = read(in, buffer.data(), buffer.size());
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                ok = got == 0;
+                break;
+            }
+            for (ssize_t written = 0; written < got;) {
+                ssize_t n = write(out, buffer.data() + written, got - written);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    ok = false;
+                    break;
+                }
+                written += n;
+            }
+        }
+    }
+    close(in);
+    if (close(out) != 0) {
+        ok = false;
+    }
+    return ok;
+#endif
+}
+
+// Where an input's copy goes below the stage's "in" directory: its path
+// below the input root as the output tree mirrors it, or, for inputs
+// outside the root, one directory per source directory so the copy
+// stays within the stage
+fs::path staged_path(const std::string& input, const std::string& input_root) {
+    std::error_code ec;
+    fs::path relative = fs::relative(input, input_root, ec);
+    bool outside = ec || relative.empty() || relative.is_absolute() ||
+                   std::any_of(relative.begin(), relative.end(), [](const fs::path& part) { return part == ".."; });
+    if (!outside) {
+        return relative;
+    }
+    std::ostringstream name;
+    name << "outside-" << std::hex << std::setw(16) << std::setfill('0')
+         << std::hash<std::string>()(fs::absolute(input).parent_path().string());
+    return fs::path(name.str()) / fs::path(input).filename();
+}
+
+// Room an input takes in the scratch budget: its copy and an output of
+// the same size. Unreadable inputs take more than any budget.
+uintmax_t stage_need(const std::string& input) {
+    std::error_code ec;
+    uintmax_t size = fs::file_size(input, ec);
+    return ec ? std::numeric_limits<uintmax_t>::max() : 2 * size;
+}
+
+// Runs beside the job queue: copies the inputs in the order the scheduler
+// is expected to start their jobs, while the budget has room for a copy
+// and an output of the same size. Inputs that can't be staged are read in
+// place.
+void stage_inputs(ScratchStage& stage, bool verbose) {
+    if (stage.idle_io) {
+        set_idle_io_priority();
+    }
+    std::map<std::string, uintmax_t> needs;
+    for (;;) {
+        // The input wanted first can change while waiting for room
+        std::unique_lock<std::mutex> lock(stage.mutex);
+        auto next = stage.queue.end();
+        uintmax_t need = 0;
+        stage.changed.wait(lock, [&] {
+            next = std::find_if(stage.queue.begin(), stage.queue.end(),
+                                [&](const std::string& input) { return stage.staged.count(input) == 0; });
+            if (stage.stop || next == stage.queue.end()) {
+                return true;
+            }
+            auto known = needs.find(*next);
+            need = known != needs.end() ? known->second : (needs[*next] = stage_need(*next));
+            return need > stage.budget || stage.reserved + need <= stage.budget;
+        });
+        if (stage.stop || next == stage.queue.end()) {
+            break;
+        }
+        std::string input = *next;
+        if (need > stage.budget) {
+            std::cout << "Note: " << input << " doesn't fit the scratch budget, reading it in place" << std::endl;
+            stage.staged[input] = "";
+            stage.changed.notify_all();
+            continue;
+        }
+        stage.reserved += need;
+        stage.reservations[input] = need;
+        stage.copying = input;
+        lock.unlock();
+
+        uintmax_t size = need / 2;
+        std::error_code ec;
+
+        fs::path local = fs::path(stage.dir) / "in" / staged_path(input, stage.input_root);
+        auto started = std::chrono::steady_clock::now();
+        fs::create_directories(local.parent_path(), ec);
+        bool ok = copy_file_contents(input, local.string());
+        if (ok) {
+            // Caches are keyed by the source's path, size and modification
+            // time; the copy must not look newer than the source
+            fs::last_write_time(local, fs::last_write_time(input, ec), ec);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+        lock.lock();
+        stage.copying.clear();
+        if (stage.staged.count(input) > 0) {
+            // Released while it was copied, its job failed up front; the
+            // reservation went with the release
+            fs::remove(local, ec);
+        } else if (ok) {
+            stage.staged[input] = local.string();
+            if (verbose) {
+                std::cout << "Staged " << input << " (" << size / 1000000 << " MB in " << format_duration(seconds)
+                          << ", " << static_cast<long long>(size / 1e6 / std::max(seconds, 0.001)) << " MB/s)"
+                          << std::endl;
+            }
+        } else {
+            std::cout << "Warning: Could not stage " << input << ", reading it in place" << std::endl;
+            fs::remove(local, ec);
+            stage.reserved -= need;
+            stage.reservations.erase(input);
+            stage.staged[input] = "";
+        }
+        stage.changed.notify_all();
+    }
+}
+
+// Moves an input the stage hasn't got to yet to the front of its queue
+void promote_stage(ScratchStage& stage, const std::string& input_file) {
+    std::lock_guard<std::mutex> guard(stage.mutex);
+    auto queued = std::find(stage.queue.begin(), stage.queue.end(), input_file);
+    if (queued != stage.queue.end() && stage.staged.count(input_file) == 0 && stage.copying != input_file) {
+        std::rotate(stage.queue.begin(), queued, queued + 1);
+        stage.changed.notify_all();
+    }
+}
+
+// The local copy of an input once staging got to it; inputs the stage
+// doesn't handle are read in place straight away. So are inputs that
+// don't fit while other jobs' copies hold the budget, rather than wait on
+// jobs that may only start after this one.
+std::string wait_for_stage(ScratchStage& stage, const std::string& input_file) {
+    uintmax_t need = stage_need(input_file);
+    promote_stage(stage, input_file);
+    std::unique_lock<std::mutex> lock(stage.mutex);
+    if (std::find(stage.queue.begin(), stage.queue.end(), input_file) == stage.queue.end()) {
+        return input_file;
+    }
+    stage.changed.wait(lock, [&] {
+        return stage.stop || stage.staged.count(input_file) > 0 ||
+               (stage.copying != input_file && stage.reserved + need > stage.budget && need <= stage.budget);
+    });
+    if (stage.staged.count(input_file) == 0 && !stage.stop) {
+        std::cout << "Note: Scratch budget is taken by other jobs' inputs, reading " << input_file << " in place"
+                  << std::endl;
+        stage.staged[input_file] = "";
+        stage.changed.notify_all();
+    }
+    auto staged = stage.staged.find(input_file);
+    return staged == stage.staged.end() || staged->second.empty() ? input_file : staged->second;
+}
+
+// Frees an input's copy and reservation once its job is done, or failed
+// before it started; the stage doesn't copy it after that
+void release_stage(ScratchStage& stage, const std::string& input_file) {
+    std::lock_guard<std::mutex> guard(stage.mutex);
+    std::string& local = stage.staged[input_file];
+    if (!local.empty()) {
+        std::error_code ec;
+        fs::remove(local, ec);
+        local.clear();
+    }
+    auto reservation = stage.reservations.find(input_file);
+    if (reservation != stage.reservations.end()) {
+        stage.reserved -= reservation->second;
+        stage.reservations.erase(reservation);
+    }
+    stage.changed.notify_all();
+}
+
+// Move a finished job's files from scratch into the output tree. Across
+// file systems each file is copied under a temporary name and renamed,
+// so a partial file never shows up under the final name.
+int move_outputs(const fs::path& from, const fs::path& to) {
+    int failed = 0;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(from, ec); !ec && it != fs::recursive_directory_iterator();
+         it.increment(ec)) {
+        if (!it->is_regular_file()) {
+            continue;
+        }
+        fs::path target = to / it->path().lexically_relative(from);
+        std::error_code move_ec;
+        fs::create_directories(target.parent_path(), move_ec);
+        fs::rename(it->path(), target, move_ec);
+        if (!move_ec) {
+            continue;
+        }
+        fs::path partial = target.parent_path() / ("." + target.filename().string() + ".part");
+        if (copy_file_contents(it->path().string(), partial.string())) {
+            fs::rename(partial, target, move_ec);
+        }
+        if (move_ec || !fs::exists(target)) {
+            std::cout << "Error: Could not move " << it->path() << " to " << target << std::endl;
+            fs::remove(partial, move_ec);
+            failed++;
+        }
+    }
+    if (failed == 0) {
+        fs::remove_all(from, ec);
+    }
+    return failed;
+}
+
+int process_file(const std::string& input_file,
+                const std::string& media_dir,
+                const std::string& output_dir,
+                const FFmpegParams& ffmpeg_params,
+                const std::string& original_format,
+                const std::string& output_format,
+                bool force_m4v,
+                bool execute,
+                bool dry_run,
+                bool replace_underscores,
+                int analyze_duration,
+                int probe_size,
+                bool verbose,
+                const ExecContext& exec,
+                const MediaInfo& media,
+                int chunk_count,
+                double checkpoint_seconds,
+                const std::vector<FFmpegParams>& renditions) {
+    fs::path output_base = get_output_base(input_file, media_dir, output_dir, replace_underscores);
+    fs::path output_subdir = output_base.parent_path();
+    std::string formatted_basename = output_base.filename().string();
+
+    // Determine the correct output format for initial conversion
+    std::string actual_format = output_format;
+    if (force_m4v && execute) {
+        // When executing with force_m4v, use original format first
+        actual_format = original_format;
+    }
+
+    fs::path output_file = output_subdir / (formatted_basename + "." + actual_format);
+
+    if (!prepare_output_dir(output_subdir, dry_run)) {
+        return 1;
+    }
 
     // Check if output file location is valid and writable
     if (!dry_run && execute) {
@@ -663,16 +6060,128 @@ int process_file(const std::string& input_file,
         }
     }
 
+    // Containers the tee muxer can't write alongside the primary one are
+    // remuxed from the finished file instead
+    FFmpegParams encode_params = ffmpeg_params;
+    encode_params.extra_formats.erase(std::remove(encode_params.extra_formats.begin(),
+                                                  encode_params.extra_formats.end(), output_format),
+                                      encode_params.extra_formats.end());
+    std::vector<std::string> remux_formats;
+    split_extra_formats(actual_format, encode_params, media, remux_formats);
+
+    // Analysis files this encode saves for later x265 encodes of the source
+    std::vector<std::string> analysis_saves;
+
+    // An encoding ladder writes every rendition from a single decode
+    if (!renditions.empty()) {
+        std::vector<std::string> output_files;
+        std::vector<FFmpegParams> ladder = renditions;
+        std::vector<std::vector<std::string>> ladder_remux(ladder.size());
+        for (size_t i = 0; i < ladder.size(); ++i) {
+            int width, height;
+            get_output_dimensions(ladder[i], media, width, height);
+            // Renditions are named after their box when the picture fills
+            // it on one side; cropping and the source's shape don't rename
+            // a 720p rendition, a source smaller than the box does
+            int modulus = std::max(2, ladder[i].modulus);
+            if (ladder[i].max_height > 0 && (height >= ladder[i].max_height - modulus ||
+                                             (ladder[i].max_width > 0 && width >= ladder[i].max_width - modulus))) {
+                height = ladder[i].max_height;
+            }
+            std::string label = std::to_string(height) + "p";
+            std::string extension = force_m4v ? "m4v" : ladder[i].format;
+            fs::path rendition_file = output_subdir / (formatted_basename + "-" + label + "." + extension);
+            for (int n = 2; std::find(output_files.begin(), output_files.end(), rendition_file.string()) != output_files.end(); ++n) {
+                rendition_file = output_subdir / (formatted_basename + "-" + label + "-" + std::to_string(n) + "." + extension);
+            }
+            output_files.push_back(rendition_file.string());
+            split_extra_formats(extension, ladder[i], media, ladder_remux[i]);
+            plan_analysis_reuse(ladder[i], input_file, media, analysis_saves);
+        }
+        bool run = execute && !dry_run;
+        int result_code = encode_ladder(input_file, output_files, ladder, ffmpeg_params, media,
+                                        analyze_duration, probe_size, verbose, run, exec);
+        if (run) {
+            finish_analysis_save(analysis_saves, result_code == 0, ffmpeg_params.analysis_cache_limit);
+        }
+        for (size_t i = 0; i < ladder.size() && result_code == 0; ++i) {
+            result_code = remux_containers(output_files[i], ladder_remux[i], ladder[i], media, verbose, run, exec);
+        }
+        return result_code;
+    }
+
+    // Checkpointed encodes go segment by segment so they can be resumed;
+    // long inputs are split at keyframes and the pieces encoded in parallel
+    if (checkpoint_seconds > 0 || chunk_count > 1) {
+        bool run = execute && !dry_run;
+        int result_code;
+        if (checkpoint_seconds > 0) {
+            result_code = encode_checkpointed(input_file, output_file.string(), encode_params, media,
+                                              checkpoint_seconds, std::max(1, chunk_count),
+                                              analyze_duration, probe_size, verbose, run, exec);
+        } else {
+            result_code = encode_chunked(input_file, output_file.string(), encode_params, media, chunk_count,
+                                         analyze_duration, probe_size, verbose, run, exec);
+        }
+        if (result_code == 0) {
+            result_code = remux_containers(output_file.string(), remux_formats, encode_params, media,
+                                           verbose, run, exec);
+        }
+        if (run && result_code == 0 && force_m4v) {
+            if (!rename_to_m4v(output_file.string(), dry_run)) {
+                std::cout << "Warning: Failed to rename file to .m4v" << std::endl;
+            }
+        }
+        return result_code;
+    }
+
+    plan_analysis_reuse(encode_params, input_file, media, analysis_saves);
+
+    if (encode_params.split_audio) {
+        bool run = execute && !dry_run;
+        int result_code = encode_split(input_file, output_file.string(), encode_params, media, analyze_duration,
+                                       probe_size, verbose, run, exec);
+        if (run) {
+            finish_analysis_save(analysis_saves, result_code == 0, encode_params.analysis_cache_limit);
+        }
+        if (result_code == 0) {
+            result_code = remux_containers(output_file.string(), remux_formats, encode_params, media,
+                                           verbose, run, exec);
+        }
+        if (run && result_code == 0 && force_m4v) {
+            if (!rename_to_m4v(output_file.string(), dry_run)) {
+                std::cout << "Warning: Failed to rename file to .m4v" << std::endl;
+            }
+        }
+        return result_code;
+    }
+
     // Determine if multipass is needed
-    bool is_multipass = ffmpeg_params.multipass && ffmpeg_params.quality.find("-crf") == std::string::npos;
+    bool is_multipass = uses_two_pass(encode_params);
+
+    // Pass 1 decodes the audio anyway, so it measures the loudness for
+    // pass 2 (which until then shows loudnorm's dynamic mode)
+    bool measure_in_pass1 = is_multipass && encode_params.loudness_target < 0 && encode_params.loudness.empty() &&
+                            media.audio_streams > 0 && encode_params.acodec.find("copy") == std::string::npos;
+    FFmpegParams measure_params = encode_params;
+    if (measure_in_pass1) {
+        measure_params.acodec = "-c:a pcm_f32le";
+        measure_params.loudness_log = loudness_log_prefix(input_file);
+        measure_params.audio_tracks = media.audio_streams;
+    }
 
     // Build ffmpeg command(s)
     std::string ffmpeg_cmd_str;
+    std::vector<std::vector<std::string>> ffmpeg_cmds;
 
     if (is_multipass) {
-        std::vector<std::vector<std::string>> ffmpeg_cmds = build_multipass_commands(
-            input_file, output_file.string(), ffmpeg_params, analyze_duration, probe_size, verbose
+        ffmpeg_cmds = build_multipass_commands(
+            input_file, output_file.string(), encode_params, analyze_duration, probe_size, verbose
         );
+        if (measure_in_pass1) {
+            ffmpeg_cmds[0] = build_multipass_commands(input_file, output_file.string(), measure_params,
+                                                      analyze_duration, probe_size, verbose)[0];
+        }
 
         std::vector<std::string> cmd_strs;
         for (const auto& cmd : ffmpeg_cmds) {
@@ -686,7 +6195,7 @@ int process_file(const std::string& input_file,
         ffmpeg_cmd_str = join_string(cmd_strs, " && ");
     } else {
         std::vector<std::string> ffmpeg_cmd = build_ffmpeg_command(
-            input_file, output_file.string(), ffmpeg_params, analyze_duration, probe_size, verbose
+            input_file, output_file.string(), encode_params, analyze_duration, probe_size, verbose
         );
 
         std::vector<std::string> escaped_cmd;
@@ -700,6 +6209,7 @@ int process_file(const std::string& input_file,
     if (dry_run) {
         std::cout << "[DRY RUN] Would execute:" << std::endl;
         std::cout << ffmpeg_cmd_str << std::endl;
+        remux_containers(output_file.string(), remux_formats, encode_params, media, verbose, false, exec);
         if (force_m4v) {
             fs::path m4v_output = output_file.parent_path() / (output_file.stem().string() + ".m4v");
             std::cout << "[DRY RUN] Would rename " << output_file << " to " << m4v_output << std::endl;
@@ -715,28 +6225,40 @@ int process_file(const std::string& input_file,
         try {
             if (is_multipass) {
                 // For multipass, run commands sequentially
-                std::vector<std::vector<std::string>> ffmpeg_cmds = build_multipass_commands(
-                    input_file, output_file.string(), ffmpeg_params, analyze_duration, probe_size, verbose
-                );
-
                 for (size_t i = 0; i < ffmpeg_cmds.size(); ++i) {
+                    if (i == 1 && measure_in_pass1 &&
+                        read_loudness(measure_params.loudness_log, media.audio_streams, 0, input_file,
+                                      encode_params, encode_params.loudness)) {
+                        ffmpeg_cmds[1] = build_multipass_commands(input_file, output_file.string(), encode_params,
+                                                                  analyze_duration, probe_size, verbose)[1];
+                    }
                     std::cout << "Running pass " << (i + 1) << " of " << ffmpeg_cmds.size() << "..." << std::endl;
-                    result_code = execute_command(ffmpeg_cmds[i], verbose);
+                    result_code = execute_command(ffmpeg_cmds[i], verbose, exec);
 
                     if (result_code != 0) {
                         break;
                     }
                 }
+                for (int track = 0; measure_in_pass1 && track < media.audio_streams; ++track) {
+                    std::error_code ec;
+                    fs::remove(measure_params.loudness_log + "-" + std::to_string(track) + ".log", ec);
+                }
             } else {
             // For single pass
             std::vector<std::string> ffmpeg_cmd = build_ffmpeg_command(
-            input_file, output_file.string(), ffmpeg_params, analyze_duration, probe_size, verbose
+            input_file, output_file.string(), encode_params, analyze_duration, probe_size, verbose
             );
-            result_code = execute_command(ffmpeg_cmd, verbose);
+            result_code = execute_command(ffmpeg_cmd, verbose, exec);
             }
+            finish_analysis_save(analysis_saves, result_code == 0, encode_params.analysis_cache_limit);
             if (result_code == 0) {
                 std::cout << "Conversion successful" << std::endl;
 
+                if (remux_containers(output_file.string(), remux_formats, encode_params, media,
+                                     verbose, true, exec) != 0) {
+                    return 1;
+                }
+
                 // If successful and force_m4v is enabled, rename to .m4v
                 if (force_m4v) {
                     if (!rename_to_m4v(output_file.string(), dry_run)) {
@@ -753,11 +6275,13 @@ int process_file(const std::string& input_file,
             }
         } catch (const std::exception& e) {
             std::cout << "Error executing command: " << e.what() << std::endl;
+            finish_analysis_save(analysis_saves, false, encode_params.analysis_cache_limit);
             return 1;
         }
     } else {
         std::cout << "Generated command for " << input_file << ":" << std::endl;
         std::cout << ffmpeg_cmd_str << std::endl;
+        remux_containers(output_file.string(), remux_formats, encode_params, media, verbose, false, exec);
         if (force_m4v) {
             std::cout << "Note: If executed, the file will be converted to " << actual_format
                       << " then renamed to .m4v" << std::endl;
@@ -776,6 +6300,31 @@ struct CmdOptions {
     bool force_m4v = false;
     bool no_underscore_replace = false;
     bool verbose = false;
+    int jobs = 1;
+    bool affinity = false;
+    double chunk_threshold = 0;  // seconds, 0 = never chunk
+    int chunks = 0;              // 0 = pick from the CPU budget
+    double checkpoint_seconds = 0;  // segment length, 0 = no checkpointing
+    std::string ladder;             // comma separated heights and/or preset files
+    std::vector<std::string> containers;  // extra output containers
+    double batch_seconds = 0;             // clips up to this long are batched, 0 = off
+    int batch_size = 8;                   // clips per ffmpeg process
+    std::string order;                    // longest, shortest or input; empty = longest with -j
+    std::string stats_file;               // finished jobs are recorded here for the speed model
+    std::string deadline;                 // HH:MM or +DURATION, empty = none
+    std::string analysis_cache;           // x265 analysis reuse directory, empty = off
+    double analysis_cache_gb = 50;
+    std::string quality_metric;           // ssim or psnr for the CRF search, empty = preset CRF
+    double quality_target = 0;
+    double loudness_target = 0;           // integrated LUFS, 0 = no loudness normalization
+    bool split_audio = false;             // encode audio tracks in processes of their own
+    std::string scratch_dir;              // stage inputs and outputs on local storage, empty = off
+    double scratch_gb = 0;                // 0 = most of the scratch file system's free space
+    bool io_idle = false;                 // ffmpeg and staging reads in the idle I/O class
+    bool keep_cache = false;              // leave finished inputs and outputs in the page cache
+    int per_device = 0;                   // concurrent jobs per disk, 0 = no limit
+    bool no_space_check = false;          // start jobs whether or not their output is likely to fit
+    double memory_gb = 0;                 // peak RSS concurrent jobs may add up to, 0 = from what is available
     std::string input_dir;
     std::string output_dir;
     std::string ignore_flag = ".noconvert";
@@ -829,6 +6378,211 @@ CmdOptions parse_arguments(int argc, char* argv[]) {
             } else {
                 show_usage(argv[0]);
             }
+        } else if (arg == "-j" || arg == "--jobs") {
+            if (i + 1 < argc) {
+                try {
+                    options.jobs = std::stoi(argv[++i]);
+                } catch (...) {
+                    options.jobs = 0;
+                }
+                if (options.jobs < 1) {
+                    std::cerr << "Error: --jobs requires a positive number" << std::endl;
+                    show_usage(argv[0]);
+                }
+            } else {
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--affinity") {
+            options.affinity = true;
+        } else if (arg == "--chunked") {
+            options.chunk_threshold = 1800;
+        } else if (arg.substr(0, 10) == "--chunked=") {
+            try {
+                options.chunk_threshold = std::stod(arg.substr(10));
+            } catch (...) {
+                options.chunk_threshold = 0;
+            }
+            if (options.chunk_threshold <= 0) {
+                std::cerr << "Error: --chunked= requires a duration in seconds" << std::endl;
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--chunks") {
+            if (i + 1 < argc) {
+                try {
+                    options.chunks = std::stoi(argv[++i]);
+                } catch (...) {
+                    options.chunks = 0;
+                }
+                if (options.chunks < 2) {
+                    std::cerr << "Error: --chunks requires a number of at least 2" << std::endl;
+                    show_usage(argv[0]);
+                }
+            } else {
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--checkpoint") {
+            options.checkpoint_seconds = 300;
+        } else if (arg.substr(0, 13) == "--checkpoint=") {
+            try {
+                options.checkpoint_seconds = std::stod(arg.substr(13));
+            } catch (...) {
+                options.checkpoint_seconds = 0;
+            }
+            if (options.checkpoint_seconds <= 0) {
+                std::cerr << "Error: --checkpoint= requires a segment length in seconds" << std::endl;
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--ladder") {
+            if (i + 1 < argc) {
+                options.ladder = argv[++i];
+            } else {
+                show_usage(argv[0]);
+            }
+        } else if (arg.substr(0, 11) == "--deadline=") {
+            options.deadline = arg.substr(11);
+        } else if (arg.substr(0, 13) == "--stats-file=") {
+            options.stats_file = arg.substr(13);
+        } else if (arg.substr(0, 8) == "--order=") {
+            options.order = arg.substr(8);
+            if (options.order != "longest" && options.order != "shortest" && options.order != "input") {
+                std::cerr << "Error: --order= must be longest, shortest or input" << std::endl;
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--batch") {
+            options.batch_seconds = 30;
+        } else if (arg.substr(0, 8) == "--batch=") {
+            try {
+                options.batch_seconds = std::stod(arg.substr(8));
+            } catch (...) {
+                options.batch_seconds = 0;
+            }
+            if (options.batch_seconds <= 0) {
+                std::cerr << "Error: --batch= requires a clip length in seconds" << std::endl;
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--batch-size") {
+            if (i + 1 < argc) {
+                try {
+                    options.batch_size = std::stoi(argv[++i]);
+                } catch (...) {
+                    options.batch_size = 0;
+                }
+                if (options.batch_size < 2) {
+                    std::cerr << "Error: --batch-size requires a number of at least 2" << std::endl;
+                    show_usage(argv[0]);
+                }
+            } else {
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--analysis-cache") {
+            options.analysis_cache = (get_user_dir("XDG_CACHE_HOME", ".cache") / "x265-analysis").string();
+        } else if (arg.substr(0, 17) == "--analysis-cache=") {
+            options.analysis_cache = arg.substr(17);
+        } else if (arg.substr(0, 22) == "--analysis-cache-size=") {
+            try {
+                options.analysis_cache_gb = std::stod(arg.substr(22));
+            } catch (...) {
+                options.analysis_cache_gb = 0;
+            }
+            if (options.analysis_cache_gb <= 0) {
+                std::cerr << "Error: --analysis-cache-size= requires a size in GB" << std::endl;
+                show_usage(argv[0]);
+            }
+        } else if (arg.substr(0, 14) == "--target-ssim=" || arg.substr(0, 14) == "--target-psnr=") {
+            options.quality_metric = arg.substr(9, 4);
+            try {
+                options.quality_target = std::stod(arg.substr(14));
+            } catch (...) {
+                options.quality_target = 0;
+            }
+            double limit = options.quality_metric == "ssim" ? 1.0 : 100.0;
+            if (options.quality_target <= 0 || options.quality_target >= limit) {
+                std::cerr << "Error: " << arg.substr(0, 14) << " requires a score between 0 and " << limit
+                          << std::endl;
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--split-audio") {
+            options.split_audio = true;
+        } else if (arg == "--io-idle") {
+            options.io_idle = true;
+        } else if (arg == "--keep-cache") {
+            options.keep_cache = true;
+        } else if (arg == "--no-space-check") {
+            options.no_space_check = true;
+        } else if (arg == "--per-device") {
+            if (i + 1 < argc) {
+                try {
+                    options.per_device = std::stoi(argv[++i]);
+                } catch (...) {
+                    options.per_device = 0;
+                }
+                if (options.per_device < 1) {
+                    std::cerr << "Error: --per-device requires a number of at least 1" << std::endl;
+                    show_usage(argv[0]);
+                }
+            } else {
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--scratch") {
+            if (i + 1 < argc) {
+                options.scratch_dir = argv[++i];
+            } else {
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--scratch-size") {
+            if (i + 1 < argc) {
+                try {
+                    options.scratch_gb = std::stod(argv[++i]);
+                } catch (...) {
+                    options.scratch_gb = 0;
+                }
+                if (options.scratch_gb <= 0) {
+                    std::cerr << "Error: --scratch-size requires a size in GB" << std::endl;
+                    show_usage(argv[0]);
+                }
+            } else {
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--memory") {
+            if (i + 1 < argc) {
+                try {
+                    options.memory_gb = std::stod(argv[++i]);
+                } catch (...) {
+                    options.memory_gb = 0;
+                }
+                if (options.memory_gb <= 0) {
+                    std::cerr << "Error: --memory requires a size in GB" << std::endl;
+                    show_usage(argv[0]);
+                }
+            } else {
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--loudnorm") {
+            options.loudness_target = -23.0;
+        } else if (arg.substr(0, 11) == "--loudnorm=") {
+            try {
+                options.loudness_target = std::stod(arg.substr(11));
+            } catch (...) {
+                options.loudness_target = 0;
+            }
+            if (options.loudness_target < -70.0 || options.loudness_target > -5.0) {
+                std::cerr << "Error: --loudnorm= requires an integrated loudness between -70 and -5 LUFS"
+                          << std::endl;
+                show_usage(argv[0]);
+            }
+        } else if (arg == "--containers") {
+            if (i + 1 < argc) {
+                static const std::vector<std::string> known = {"mkv", "mp4", "m4v", "mov", "webm"};
+                for (const auto& container : split_string(argv[++i], ',')) {
+                    if (std::find(known.begin(), known.end(), container) == known.end()) {
+                        std::cerr << "Error: Unsupported container '" << container << "'" << std::endl;
+                        show_usage(argv[0]);
+                    }
+                    options.containers.push_back(container);
+                }
+            } else {
+                show_usage(argv[0]);
+            }
         } else if (arg == "-l" || arg == "--log") {
             if (i + 1 < argc) {
                 options.log_file = argv[++i];
@@ -844,7 +6598,230 @@ CmdOptions parse_arguments(int argc, char* argv[]) {
     return options;
 }
 
+// Checks of the helpers whose mistakes only show on particular sources:
+// seek times, size and memory estimates, file matching. Needs no ffmpeg.
+int run_self_tests() {
+    int failures = 0;
+    auto check = [&](bool ok, const std::string& what) {
+        if (!ok) {
+            std::cout << "FAIL: " << what << std::endl;
+            failures++;
+        }
+    };
+
+    // Chunk boundaries are packet times; seeks count from the container start
+    MediaInfo ts;
+    ts.valid = true;
+    ts.duration = 30.0;
+    ts.start_time = 1.4;
+    std::vector<std::string> keyframes = {"1.400000", "6.400000", "11.400000", "16.400000", "21.400000",
+                                          "26.400000"};
+    std::vector<std::string> boundaries = plan_chunk_boundaries(keyframes, ts, 3);
+    check(boundaries == std::vector<std::string>({"1.400000", "11.400000", "21.400000"}),
+          "chunk boundaries at the keyframes nearest an even split");
+    check(input_seek_time(boundaries[0], ts) == "0.000000", "first chunk seeks to the container start");
+    check(input_seek_time(boundaries[1], ts) == "10.000000", "chunk seek is relative to start_time");
+    check(plan_chunk_boundaries(keyframes, ts, 10).size() == keyframes.size(), "at most one chunk per keyframe");
+
+    // Checkpoint segments follow the video stream, half a frame early
+    MediaInfo clip;
+    clip.valid = true;
+    clip.framerate = 25.0;
+    clip.video_duration = 60.0;
+    clip.duration = 61.0;
+    check(plan_checkpoint_boundaries(clip, 30.0) == std::vector<std::string>({"0.000000", "29.980000"}),
+          "checkpoint segments end with the video, not the longer audio");
+    clip.video_duration = 60.5;
+    check(plan_checkpoint_boundaries(clip, 30.0).size() == 3, "a partial last segment is kept");
+    clip.video_duration = 0.0;
+    clip.duration = 60.0;
+    clip.start_time = 1.0;
+    clip.video_start_time = 1.0;
+    check(plan_checkpoint_boundaries(clip, 30.0) == std::vector<std::string>({"1.000000", "30.980000"}),
+          "checkpoint segments without a stream duration use the format's");
+
+    // Sampling windows are input seeks, whatever the container start
+    MediaInfo sampled;
+    sampled.duration = 104.0;
+    sampled.start_time = 1.4;
+    check(sample_windows(sampled, 4, 4.0) == std::vector<double>({12.5, 37.5, 62.5, 87.5}),
+          "sample windows sit mid-share, counted from the container start");
+    check(sample_windows(sampled, 0, 4.0).empty(), "no windows asked for, none given");
+    sampled.duration = 0.0;
+    check(sample_windows(sampled, 4, 4.0).empty(), "no windows without a duration");
+    sampled.duration = 2.0;
+    check(sample_windows(sampled, 4, 4.0) == std::vector<double>({0.0}),
+          "a file shorter than a window is sampled once from the start");
+
+    // Phone video: the display matrix or the rotate tag turns the picture
+    check(display_rotation(json::parse(R"({"side_data_list": [{"rotation": -90}]})")) == 270,
+          "display matrix rotation is read");
+    check(display_rotation(json::parse(R"({"tags": {"rotate": "90"}})")) == 270, "rotate tag is read clockwise");
+    check(display_rotation(json::parse(R"({"side_data_list": [{"rotation": 180}]})")) == 180, "half turn is kept");
+    check(display_rotation(json::parse("{}")) == 0, "no rotation without side data or tag");
+
+    // Bit depths of one ffmpeg encoder are told apart by the preset's name
+    FFmpegParams deep_x265;
+    deep_x265.vcodec = "libx265";
+    deep_x265.preset = "medium";
+    deep_x265.multipass = false;
+    deep_x265.threads = 0;
+    FFmpegParams x265_8bit = deep_x265;
+    deep_x265.encoder_name = "x265_12bit";
+    check(find_encoder(deep_x265) == find_encoder("x265_12bit"), "the preset's encoder entry is found");
+    check(encoder_speed_factor(deep_x265) > encoder_speed_factor(x265_8bit), "12-bit x265 is costed as slower");
+
+    // FFV1 slices bring their level along once
+    FFmpegParams lossless;
+    lossless.vcodec = "ffv1";
+    lossless.multipass = false;
+    apply_thread_budget(lossless, 8, 1920, 1080);
+    std::vector<std::string> ffv1_cmd;
+    append_video_options(ffv1_cmd, lossless);
+    check(std::count(ffv1_cmd.begin(), ffv1_cmd.end(), "-level") == 1, "ffv1 gets one -level");
+    lossless.level = "1";
+    lossless.encoder_flags.clear();
+    apply_thread_budget(lossless, 8, 1920, 1080);
+    check(lossless.level == "1" && lossless.encoder_flags.empty(), "a preset's ffv1 level 1 is kept, without slices");
+
+    // A checkpoint made at the preset asked for resumes under --deadline
+    FFmpegParams asked;
+    asked.vcodec = "libx264";
+    asked.preset = "slow";
+    asked.multipass = false;
+    asked.threads = 0;
+    FFmpegParams governed = asked;
+    governed.requested_preset = "slow";
+    governed.preset = "fast";
+    check(encode_settings_signature(governed) == encode_settings_signature(asked),
+          "a governed preset keeps the requested preset's checkpoint signature");
+
+    // Staged copies stay within the stage, named as the output tree is
+    check(staged_path("/media/tv/show/e1.mkv", "/media/tv") == fs::path("show/e1.mkv"),
+          "a staged copy keeps its path below the input root");
+    fs::path outside = staged_path("/media/films/x.mkv", "/media/tv");
+    check(outside.filename() == "x.mkv" && outside.parent_path().string().rfind("outside-", 0) == 0 &&
+          outside.parent_path().parent_path().empty(), "inputs outside the root are staged one level down");
+
+    // A job's outputs, not those of sources that share the start of its name
+    check(is_job_output("Movie.mkv", "Movie") && is_job_output("Movie.mp4", "Movie"), "containers of the job match");
+    check(is_job_output("Movie-720p.mkv", "Movie") && is_job_output("Movie-720p-2.mkv", "Movie"),
+          "ladder renditions of the job match");
+    check(!is_job_output("Movie 2.mkv", "Movie") && !is_job_output("Movie-2.mkv", "Movie") &&
+          !is_job_output("Movie.part2.mkv", "Movie") && !is_job_output("Movies.mkv", "Movie") &&
+          !is_job_output("Movie-720px.mkv", "Movie"), "other sources starting with the same name don't");
+
+    // Output sizes: bitrate targets outright, earlier runs per 1080p frame,
+    // and twice the output for encodes joined from parts
+    ThroughputModel fresh;
+    FFmpegParams sized;
+    sized.vcodec = "libx264";
+    sized.preset = "medium";
+    sized.quality = "-b:v 8000";
+    sized.multipass = false;
+    sized.threads = 0;
+    MediaInfo film;
+    film.valid = true;
+    film.duration = 100.0;
+    check(predict_output_bytes(fresh, sized, film, 2500.0, false) == 100000000, "a bitrate target gives the size");
+    check(predict_output_bytes(fresh, sized, film, 2500.0, true) == 200000000, "parts double the space needed");
+    ThroughputModel learned;
+    learned.sizes[size_model_key(sized)] = {1000.0, 5e8};
+    sized.extra_formats = {"mp4"};
+    check(predict_output_bytes(learned, sized, film, 2500.0, false) ==
+              static_cast<uintmax_t>(2500.0 / encoder_speed_factor(sized) * 5e5 * 2),
+          "learned sizes are per 1080p frame and per container");
+    MediaInfo unprobed;
+    unprobed.file_size = 700000000;
+    check(predict_output_bytes(fresh, sized, unprobed, 0.0, true) == 1400000000,
+          "an unprobed input comes out its own size, twice in parts");
+
+    // Peak memory: 10- and 12-bit formats take two bytes a sample, nv12 one
+    FFmpegParams held;
+    held.vcodec = "libx264";
+    held.resolution = "1920x1080";
+    held.multipass = false;
+    held.threads = 0;
+    MediaInfo hd;
+    hd.valid = true;
+    hd.width = 1920;
+    hd.height = 1080;
+    held.pix_fmt = "yuv420p";
+    uintmax_t eight_bit = estimate_peak_rss(held, hd);
+    held.pix_fmt = "nv12";
+    check(estimate_peak_rss(held, hd) == eight_bit, "nv12 is 8-bit");
+    for (const char* deep : {"yuv420p10le", "p010le", "yuv444p12le"}) {
+        held.pix_fmt = deep;
+        check(estimate_peak_rss(held, hd) > eight_bit, std::string(deep) + " is costed as deep");
+    }
+    held.pix_fmt = "yuv420p";
+    held.encoder_options = "rc-lookahead=80";
+    check(estimate_peak_rss(held, hd) > eight_bit, "a longer lookahead keeps more frames");
+
+    // Available memory: MemAvailable, then the cgroup's limit less usage
+    std::istringstream meminfo("MemTotal:       16000000 kB\nMemFree:         1000000 kB\n"
+                               "MemAvailable:    8000000 kB\nBuffers:          100000 kB\n");
+    check(parse_mem_available(meminfo) == 8192000000ULL, "MemAvailable is read in bytes");
+    std::istringstream old_kernel("MemTotal:       16000000 kB\nMemFree:         1000000 kB\n");
+    check(parse_mem_available(old_kernel) == 0, "no MemAvailable, nothing known");
+    std::istringstream cgroup("12:memory:/user\n0::/user.slice/job.scope\n");
+    check(parse_cgroup_path(cgroup) == "/user.slice/job.scope", "the v2 cgroup path is read");
+    check(cgroup_memory_left("4000000000", "1500000000") == 2500000000ULL, "the limit less usage is left");
+    check(cgroup_memory_left("1000", "2000") == 0, "nothing is left over the limit");
+    check(cgroup_memory_left("max", "2000") == std::numeric_limits<uintmax_t>::max(), "no limit, no cap");
+
+    // Joined chunks keep the source's fonts and data streams like -map 0
+    FFmpegParams joined;
+    joined.acodec = "-c:a copy";
+    MediaInfo source;
+    auto join_mkv = build_join_command("in.mkv", "list.txt", "out.mkv", joined, source, "0", 0, 0, false);
+    check(std::find(join_mkv.begin(), join_mkv.end(), "1:t?") != join_mkv.end(), "a Matroska join keeps attachments");
+    auto join_mp4 = build_join_command("in.mkv", "list.txt", "out.mp4", joined, source, "0", 0, 0, false);
+    check(std::find(join_mp4.begin(), join_mp4.end(), "1:d?") != join_mp4.end() &&
+              std::find(join_mp4.begin(), join_mp4.end(), "1:t?") == join_mp4.end(),
+          "an MP4 join keeps data streams, no attachments");
+
+    auto split_mux = build_split_mux_command("in.mkv", "video.mkv", {"a0.mka", "a1.mka"}, "out.mkv", joined, source,
+                                             0, 0, false);
+    check(std::find(split_mux.begin(), split_mux.end(), "3:t?") != split_mux.end(),
+          "a split encode keeps the source's attachments");
+
+    // Tee slaves keep odd file names whole
+    check(tee_slave_name("out/A|B [x] it's.mkv") == "out/A\\|B \\[x\\] it\\'s.mkv", "tee slave names are escaped");
+
+    // Encoder options keep escaped paths whole
+    FFmpegParams x265;
+    x265.encoder_options = "aq-mode=3";
+    set_encoder_option(x265, "analysis-load", escape_encoder_value("C:\\cache\\a=b.dat"));
+    set_encoder_option(x265, "aq-mode", "2");
+    check(x265.encoder_options == "analysis-load=C\\:\\\\cache\\\\a\\=b.dat:aq-mode=2",
+          "encoder option values with ':' and '=' are escaped and kept whole");
+
+    // Height-only ladder renditions take the source's aspect ratio
+    FFmpegParams rung;
+    rung.keep_aspect = true;
+    rung.max_height = 720;
+    rung.modulus = 2;
+    rung.source_width = 1440;
+    rung.source_height = 1080;
+    MediaInfo square;
+    square.sample_aspect = 1.0;
+    fit_output_size(rung, square);
+    check(rung.resolution == "960x720", "a 4:3 source keeps 4:3 in a ladder rendition");
+
+    std::cout << (failures > 0 ? std::to_string(failures) + " self test(s) failed" : "All self tests passed")
+              << std::endl;
+    return failures > 0 ? 1 : 0;
+}
+
 int main(int argc, char* argv[]) {
+    // Never freed: std::cout is flushed after main returns
+    std::cout.rdbuf(new LineOutput(std::cout.rdbuf()));
+
+    if (argc == 2 && std::string(argv[1]) == "--self-test") {
+        return run_self_tests();
+    }
+
     // Parse command line arguments
     CmdOptions args = parse_arguments(argc, argv);
 
@@ -861,6 +6838,7 @@ int main(int argc, char* argv[]) {
 
     // Set up logging if requested
     std::ofstream log_file;
+    std::unique_ptr<LineOutput> log_output;  // whole, labelled lines from concurrent jobs, like the console
     std::streambuf* cout_buffer = nullptr;
 
     if (!args.log_file.empty()) {
@@ -869,7 +6847,8 @@ int main(int argc, char* argv[]) {
             std::cerr << "Error: Could not open log file: " << args.log_file << std::endl;
         } else {
             cout_buffer = std::cout.rdbuf();
-            std::cout.rdbuf(log_file.rdbuf());
+            log_output = std::make_unique<LineOutput>(log_file.rdbuf());
+            std::cout.rdbuf(log_output.get());
         }
     }
 
@@ -879,13 +6858,86 @@ int main(int argc, char* argv[]) {
     // Extract settings from the preset
     Settings settings = extract_preset_settings(preset_data);
 
-    // Convert to FFmpeg parameters
+    // Convert to FFmpeg parameters, checked against what this ffmpeg's
+    // encoder accepts
     FFmpegParams ffmpeg_params = convert_to_ffmpeg_params(settings);
+    std::string capability_cache = (get_user_dir("XDG_CACHE_HOME", ".cache") / "encoders.jsonl").string();
+    check_encoder_capabilities(ffmpeg_params, capability_cache);
+
+    ffmpeg_params.extra_formats = args.containers;
+    drop_unsupported_containers(ffmpeg_params);
+    ffmpeg_params.analysis_cache = args.analysis_cache;
+    ffmpeg_params.analysis_cache_limit = static_cast<long long>(args.analysis_cache_gb * 1e9);
+    set_loudness_target(ffmpeg_params, args.loudness_target);
 
     // Default FFmpeg extended settings
     int analyze_duration = 100000000;  // 100MB
     int probe_size = 100000000;        // 100MB
 
+    // Renditions for an encoding ladder: preset files, or heights that
+    // reuse this preset's settings
+    std::vector<FFmpegParams> renditions;
+    for (const auto& entry : split_string(args.ladder, ',')) {
+        if (entry.size() > 5 && entry.substr(entry.size() - 5) == ".json") {
+            renditions.push_back(convert_to_ffmpeg_params(extract_preset_settings(load_json_preset(entry))));
+            check_encoder_capabilities(renditions.back(), capability_cache);
+            renditions.back().extra_formats = args.containers;
+            drop_unsupported_containers(renditions.back());
+            renditions.back().analysis_cache = ffmpeg_params.analysis_cache;
+            renditions.back().analysis_cache_limit = ffmpeg_params.analysis_cache_limit;
+            set_loudness_target(renditions.back(), args.loudness_target);
+            continue;
+        }
+
+        int height = 0;
+        try {
+            height = std::stoi(entry);
+        } catch (...) {
+            height = 0;
+        }
+        if (height <= 0) {
+            std::cerr << "Error: Ladder entry '" << entry << "' is neither a height nor a .json preset" << std::endl;
+            return 1;
+        }
+
+        // Only the height is fixed; the width follows each file's probed
+        // display aspect when the rendition is fitted to it
+        FFmpegParams rendition = ffmpeg_params;
+        rendition.resolution.clear();
+        rendition.keep_aspect = true;
+        rendition.max_width = 0;
+        rendition.max_height = height;
+        renditions.push_back(rendition);
+    }
+
+    if (!renditions.empty()) {
+        std::cout << "Encoding ladder with " << renditions.size() << " renditions:";
+        for (const auto& rendition : renditions) {
+            std::cout << " " << (rendition.resolution.empty() ? std::to_string(rendition.max_height) + "p" : rendition.resolution)
+                      << " (" << rendition.vcodec << ", " << rendition.format << ")";
+        }
+        std::cout << std::endl;
+    }
+
+    if (!args.analysis_cache.empty()) {
+        bool any_x265 = ffmpeg_params.vcodec == "libx265";
+        for (const auto& rendition : renditions) {
+            any_x265 = any_x265 || rendition.vcodec == "libx265";
+        }
+        if (!any_x265) {
+            std::cout << "Note: --analysis-cache only applies to libx265 encodes" << std::endl;
+        } else if (args.execute && !args.dry_run) {
+            std::error_code ec;
+            fs::create_directories(args.analysis_cache, ec);
+            if (ec) {
+                std::cerr << "Error: Could not create analysis cache " << args.analysis_cache << ": "
+                          << ec.message() << std::endl;
+                return 1;
+            }
+            std::cout << "Using x265 analysis cache: " << args.analysis_cache << std::endl;
+        }
+    }
+
     // Determine output format
     std::string output_format = ffmpeg_params.format;
     std::string original_format = output_format;  // Store original before potentially overriding
@@ -899,9 +6951,28 @@ int main(int argc, char* argv[]) {
                   << " first, then renamed to .m4v" << std::endl;
     }
 
+    // Speed model from earlier runs
+    if (args.stats_file.empty()) {
+        args.stats_file = (get_user_dir("XDG_DATA_HOME", ".local/share") / "stats.jsonl").string();
+    }
+    ThroughputModel model = load_throughput_model(args.stats_file);
+    std::string model_source = model.runs > 0 ? std::to_string(model.runs) + " recorded jobs"
+                                              : "no history yet, rough default";
+    int total_cpus = get_available_cpus();
+
     // Show preset only if requested
     if (args.show_preset) {
         show_preset(ffmpeg_params, output_format, analyze_duration, probe_size);
+
+        MediaInfo hour;
+        hour.valid = true;
+        hour.duration = 3600.0;
+        double cpu_seconds = predict_cpu_seconds(model, ffmpeg_params,
+                                                 estimate_encode_cost(ffmpeg_params, hour, std::string()));
+        std::cout << "Projected: " << std::fixed << std::setprecision(1) << cpu_seconds / 3600.0
+                  << std::defaultfloat << " CPU-hours per hour of video, about "
+                  << format_duration(cpu_seconds / (total_cpus * model.utilization)) << " on " << total_cpus
+                  << " CPUs (" << model_source << ")" << std::endl;
         return 0;
     }
 
@@ -963,30 +7034,227 @@ int main(int argc, char* argv[]) {
     // Find media files
     std::vector<std::string> media_files = find_media_files(args.input_dir, args.recursive, MEDIA_EXTENSIONS);
 
-    // Process each file
+    // Queue each file
     int file_count = 0;
     int skipped_count = 0;
     int error_count = 0;
+    std::vector<Job> jobs;
+    std::vector<size_t> clip_jobs;  // jobs short enough to batch
+
+    // Batch short clips unless the encode needs a process of its own
+    bool batching = args.batch_seconds > 0 && renditions.empty() && args.checkpoint_seconds <= 0 &&
+                    args.quality_metric.empty() && !ffmpeg_params.auto_crop &&
+                    ffmpeg_params.deinterlacer.empty() && !ffmpeg_params.detelecine &&
+                    ffmpeg_params.loudness_target == 0 && !args.split_audio &&
+                    !uses_two_pass(ffmpeg_params);
+    int batch_analyze_duration = 5000000;  // 5 s, also enough to size a job for ordering
+    int batch_probe_size = 5000000;        // 5MB
+
+    // Longest first keeps a big title from starting last and running alone
+    std::string order = args.order.empty() ? (args.jobs > 1 ? "longest" : "input") : args.order;
+
+    bool running = args.execute && !args.dry_run;
+
+    // The preset's own crop is sized against each file's probed dimensions
+    bool manual_crop = !ffmpeg_params.auto_crop && std::any_of(ffmpeg_params.crop, ffmpeg_params.crop + 4,
+                                                               [](int edge) { return edge > 0; });
+
+    // Field types are detected per file when the preset deinterlaces or
+    // detelecines, and cached by file
+    bool field_detection = !ffmpeg_params.deinterlacer.empty() || ffmpeg_params.detelecine;
+    std::string field_cache = (get_user_dir("XDG_CACHE_HOME", ".cache") / "field-types.jsonl").string();
+
+    // Staging through local scratch, set up once the job order is known
+    std::unique_ptr<ScratchStage> stage;
+
+    // A finished job's files leave the page cache to the rest of the host
+    auto drop_job_files = [&](const std::string& input_file, fs::file_time_type since) {
+        if (!running || args.keep_cache) {
+            return;
+        }
+        drop_cached_file(input_file, false);
+        fs::path output_base = get_output_base(input_file, args.input_dir, args.output_dir,
+                                               !args.no_underscore_replace);
+        for (const auto& output : recent_outputs(output_base, since)) {
+            drop_cached_file(output, true);
+        }
+    };
+
+    // One finished encode for the stats store. Memory is only compared
+    // when the process was this encode's alone.
+    auto record_speed = [&](const Job& j, double wall_seconds, double cpu_seconds, double sampling_seconds,
+                            int threads, fs::file_time_type since, bool own_process) {
+        if (!running || !j.media.valid || j.media.duration <= 0 || cpu_seconds <= 0) {
+            return;
+        }
+        int width, height;
+        get_output_dimensions(j.params, j.media, width, height);
+        double speed_factor = encoder_speed_factor(j.params);
+        double frames_1080p = j.cost / speed_factor;
+        double fps = j.media.framerate > 0 && wall_seconds > 0 ? j.media.duration * j.media.framerate / wall_seconds
+                                                                : 0.0;
+        uintmax_t output_bytes = 0;
+        for (const auto& output : recent_outputs(j.output_base, since)) {
+            std::error_code ec;
+            uintmax_t size = fs::file_size(output, ec);
+            output_bytes += ec ? 0 : size;
+        }
+        json record = {
+            {"time", static_cast<long long>(std::time(nullptr))},
+            {"setting", speed_model_key(j.params)},
+            {"encoder", j.params.vcodec},
+            {"preset", j.params.preset},
+            {"quality", j.params.quality},
+            {"width", width},
+            {"height", height},
+            {"duration", j.media.duration},
+            {"frames_1080p", frames_1080p},
+            {"speed_factor", speed_factor},
+            {"fps", fps},
+            {"wall_seconds", wall_seconds},
+            {"cpu_seconds", cpu_seconds},
+            {"threads", threads},
+            {"concurrency", j.concurrency},
+            {"sampling_cpu_seconds", sampling_seconds},
+            {"output_bytes", output_bytes / static_cast<double>(1 + j.params.extra_formats.size())}
+        };
+        if (own_process && j.estimated_rss > 0) {
+            record["estimated_rss"] = j.estimated_rss;
+            record["max_rss"] = j.exec.max_rss ? j.exec.max_rss->load() : 0LL;
+        }
+        record_job_stats(args.stats_file, record);
+    };
+
+    // Split long files into chunks, a few CPUs each; that many encode at
+    // once, checkpoint segments too
+    auto plan_chunks = [&](double duration, int threads) {
+        if (args.chunk_threshold <= 0 || duration < args.chunk_threshold) {
+            return 0;
+        }
+        return args.chunks > 0 ? args.chunks : std::clamp(threads / 4, 2, 16);
+    };
+
+    std::function<int(Job&)> run_file = [&](Job& j) {
+        fs::file_time_type job_started = fs::file_time_type::clock::now();
+
+        // Jobs taken in input order aren't probed up front; the light
+        // probe sizes the output and the stats record when one starts
+        if (running && !j.media.valid) {
+            j.media = probe_media(j.input_file, batch_analyze_duration, batch_probe_size);
+            apply_crop(j.params, j.media);
+            j.cost = estimate_encode_cost(j.params, j.media, j.input_file);
+        }
 
-    for (const auto& file : media_files) {
-        // Skip JSON file itself
-        if (fs::equivalent(fs::path(file), fs::path(args.json_file))) {
-            continue;
+        // A staged input is read from scratch and the outputs are written
+        // there; the job sees the scratch tree as its input and output
+        // directories, so output names come out the same
+        std::string source_file = j.input_file;
+        std::string staged_file = stage ? wait_for_stage(*stage, j.input_file) : j.input_file;
+        std::string media_dir = args.input_dir;
+        std::string output_dir = args.output_dir;
+        if (staged_file != source_file) {
+            std::lock_guard<std::mutex> guard(stage->mutex);
+            j.input_file = staged_file;
+            media_dir = (fs::path(stage->dir) / "in").string();
+            output_dir = stage->output_dirs.at(source_file);
+            // Caches and checkpoints go by the source; checkpoints stay
+            // next to the final output, where a later run finds them
+            j.params.source_file = source_file;
+            fs::path final_base(j.output_base);
+            j.params.checkpoint_dir = (final_base.parent_path() /
+                                       ("." + final_base.filename().string() + ".checkpoint")).string();
         }
 
-        // Check if file should be ignored
-        if (should_ignore_file(file, args.ignore_flag)) {
-            std::cout << "Skipping: " << file << " (ignore flag found)" << std::endl;
-            skipped_count++;
-            continue;
+        int chunk_count = plan_chunks(j.media.duration, j.threads > 0 ? j.threads : get_available_cpus());
+
+        // A split encode has audio processes of its own, which is only
+        // worth it for audio that is transcoded
+        j.params.audio_tracks = j.media.audio_streams;
+        j.params.split_audio = args.split_audio && renditions.empty() && chunk_count <= 1 &&
+                               args.checkpoint_seconds <= 0 && j.media.audio_streams > 0 &&
+                               j.params.acodec.find("copy") == std::string::npos;
+
+        // Loudness is measured in pass 1 of a two-pass encode, or by the
+        // audio processes of a split encode; anything else gets an
+        // audio-only decode next to the sampling below
+        bool pass1_measures = uses_two_pass(j.params) &&
+                              args.quality_metric.empty() && renditions.empty() && chunk_count <= 1 &&
+                              args.checkpoint_seconds <= 0;
+        std::vector<Loudness> loudness;
+        std::thread loudness_thread;
+        ExecContext loudness_exec = j.exec;
+        loudness_exec.cpu_usec = std::make_shared<std::atomic<long long>>(0);
+        loudness_exec.children.reset();
+        // Joined on every way out, also when the detection or sampling
+        // below throws, before what the measurement writes to goes away
+        struct ThreadJoiner {
+            std::thread& thread;
+            ~ThreadJoiner() {
+                if (thread.joinable()) {
+                    thread.join();
+                }
+            }
+        } loudness_joiner{loudness_thread};
+        if (j.params.loudness_target < 0 && j.media.valid && j.media.audio_streams > 0 && !pass1_measures &&
+            !j.params.split_audio) {
+            loudness_thread = std::thread([&, params = j.params, media = j.media, prefix = output_prefix]() {
+                output_prefix = prefix;
+                measure_loudness(params, j.input_file, media, -1, loudness, analyze_duration, probe_size,
+                                 args.verbose, running, loudness_exec);
+            });
+        }
+
+        // Interlacing and black bars are found per file; a ladder filters
+        // every rendition alike
+        if (field_detection && j.media.valid) {
+            detect_field_type(j.params, j.input_file, j.media, field_cache, analyze_duration, probe_size,
+                              args.verbose, running, j.exec);
         }
+        if (j.params.auto_crop && j.media.valid) {
+            detect_crop(j.params, j.input_file, j.media, analyze_duration, probe_size, args.verbose, running, j.exec);
+        }
+        std::vector<FFmpegParams> job_renditions = renditions;
+        for (auto& rendition : job_renditions) {
+            rendition.audio_tracks = j.media.audio_streams;
+            rendition.source_file = j.params.source_file;
+            rendition.field_filter = j.params.field_filter;
+            std::copy(j.params.crop, j.params.crop + 4, rendition.crop);
+            apply_crop(rendition, j.media);
+        }
+
+        // Per-title CRF; ladders keep their presets' CRFs. The sampling is
+        // reported on its own and kept out of the speed model.
+        long long sampling_usec = 0;
+        if (!args.quality_metric.empty() && renditions.empty() && j.media.valid) {
+            long long before = j.exec.cpu_usec ? j.exec.cpu_usec->load() : 0;
+            search_crf(j.params, j.input_file, j.media, args.quality_metric, args.quality_target,
+                       analyze_duration, probe_size, args.verbose, running, j.exec);
+            sampling_usec = j.exec.cpu_usec ? j.exec.cpu_usec->load() - before : 0;
+        }
+        if (loudness_thread.joinable()) {
+            loudness_thread.join();
+            j.params.loudness = loudness;
+            for (auto& rendition : job_renditions) {
+                rendition.loudness = loudness;
+            }
+            sampling_usec += *loudness_exec.cpu_usec;
+            if (j.exec.cpu_usec) {
+                *j.exec.cpu_usec += *loudness_exec.cpu_usec;
+            }
+        }
+
+        // Against what the encode ends up running, for the memory model
+        if (j.estimated_rss > 0) {
+            j.estimated_rss = estimate_peak_rss(j.params, j.media) * std::max(1, chunk_count);
+        }
+
+        auto started = std::chrono::steady_clock::now();
 
-        // Process the file
         int result = process_file(
-            file,
-            args.input_dir,
-            args.output_dir,
-            ffmpeg_params,
+            j.input_file,
+            media_dir,
+            output_dir,
+            j.params,
             original_format,
             output_format,
             args.force_m4v,
@@ -995,14 +7263,566 @@ int main(int argc, char* argv[]) {
             !args.no_underscore_replace,
             analyze_duration,
             probe_size,
-            args.verbose
+            args.verbose,
+            j.exec,
+            j.media,
+            chunk_count,
+            args.checkpoint_seconds,
+            job_renditions
         );
 
-        if (result == 0) {
-            file_count++;
+        if (staged_file != source_file) {
+            j.input_file = source_file;
+            if (result == 0 && move_outputs(output_dir, args.output_dir) > 0) {
+                std::cout << "Error: Output of " << source_file << " is left in " << output_dir << std::endl;
+                result = 1;
+            } else if (result != 0) {
+                std::error_code ec;
+                fs::remove_all(output_dir, ec);
+            }
+            release_stage(*stage, source_file);
+        }
+        drop_job_files(source_file, job_started);
+
+        if (!j.params.passlogfile.empty()) {
+            for (const char* suffix : {"-0.log", "-0.log.mbtree", ".x265.log", ".x265.log.cutree"}) {
+                std::error_code ec;
+                fs::remove(j.params.passlogfile + suffix, ec);
+            }
+        }
+
+        // Feed the speed model. Ladders don't fit a per-setting model, so
+        // only single encodes are recorded.
+        if (result == 0 && renditions.empty() && j.exec.cpu_usec) {
+            double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            record_speed(j, wall_seconds, (*j.exec.cpu_usec - sampling_usec) / 1e6, sampling_usec / 1e6,
+                         j.threads > 0 ? j.threads : total_cpus, job_started, true);
+        }
+        return result;
+    };
+
+    for (const auto& file : media_files) {
+        // Skip JSON file itself
+        if (fs::equivalent(fs::path(file), fs::path(args.json_file))) {
+            continue;
+        }
+
+        // Check if file should be ignored
+        if (should_ignore_file(file, args.ignore_flag)) {
+            std::cout << "Skipping: " << file << " (ignore flag found)" << std::endl;
+            skipped_count++;
+            continue;
+        }
+
+        Job job;
+        job.input_file = file;
+        job.params = ffmpeg_params;
+
+        // Clips are looked at with a light probe; that is all a batch needs
+        bool needs_probe = args.jobs > 1 || args.chunk_threshold > 0 || args.checkpoint_seconds > 0 ||
+                           !renditions.empty() || !args.containers.empty() || !args.analysis_cache.empty() ||
+                           !args.quality_metric.empty() || ffmpeg_params.auto_crop ||
+                           manual_crop || field_detection || !ffmpeg_params.denoise_filter.empty() ||
+                           ffmpeg_params.loudness_target < 0 || args.split_audio;
+        bool is_clip = false;
+        if (batching || (!needs_probe && order != "input")) {
+            job.media = probe_media(file, batch_analyze_duration, batch_probe_size);
+            is_clip = batching && job.media.valid && job.media.duration > 0 &&
+                      job.media.duration <= args.batch_seconds;
+        }
+        if (needs_probe && !is_clip) {
+            job.media = probe_media(file, analyze_duration, probe_size);
+        }
+
+        // Sized against the probed source; the preset's own crop too
+        apply_crop(job.params, job.media);
+
+        job.cost = estimate_encode_cost(job.params, job.media, file);
+        job.predicted_cpu = predict_cpu_seconds(model, job.params, job.cost);
+        // Chunked, checkpointed and split encodes, as run_file decides them
+        bool in_parts = (args.chunk_threshold > 0 && job.media.duration >= args.chunk_threshold) ||
+                        args.checkpoint_seconds > 0 ||
+                        (args.split_audio && renditions.empty() && job.media.audio_streams > 0 &&
+                         job.params.acodec.find("copy") == std::string::npos);
+        job.predicted_bytes = predict_output_bytes(model, job.params, job.media, job.cost, in_parts);
+        // Chunks and checkpoint segments run side by side, each its own
+        // ffmpeg; a job's share of the CPUs decides how many
+        int parallel = std::max(1, plan_chunks(job.media.duration, std::max(1, total_cpus / std::max(1, args.jobs))));
+        job.predicted_rss = predict_peak_rss(model, job.params, job.media) * parallel;
+        job.estimated_rss = estimate_peak_rss(job.params, job.media) * parallel;
+        if (!renditions.empty()) {
+            job.cost = 0.0;
+            job.predicted_cpu = 0.0;
+            job.predicted_bytes = 0;
+            job.predicted_rss = 0;
+            job.estimated_rss = 0;
+            for (const auto& rendition : renditions) {
+                double cost = estimate_encode_cost(rendition, job.media, file);
+                job.cost += cost;
+                job.predicted_cpu += predict_cpu_seconds(model, rendition, cost);
+                job.predicted_bytes += predict_output_bytes(model, rendition, job.media, cost, in_parts);
+                job.predicted_rss += predict_peak_rss(model, rendition, job.media);
+            }
+        }
+        if (!running || args.no_space_check) {
+            job.predicted_bytes = 0;
+        }
+        job.output_base = get_output_base(file, args.input_dir, args.output_dir, !args.no_underscore_replace).string();
+        job.exec.cpu_usec = std::make_shared<std::atomic<long long>>(0);
+        job.exec.max_rss = std::make_shared<std::atomic<long long>>(0);
+        job.exec.children = std::make_shared<std::atomic<int>>(0);
+        job.exec.idle_io = args.io_idle;
+        if (args.per_device > 0) {
+            job.devices = {device_of(file), device_of(job.output_base)};
+            for (auto it = job.devices.begin(); it != job.devices.end();) {
+                it = is_rotational(*it) ? std::next(it) : job.devices.erase(it);
+            }
+        }
+
+        if (args.jobs > 1) {
+            // Size the job so the thread planner can weigh it against the others
+            int width, height;
+            get_output_dimensions(job.params, job.media, width, height);
+            // Encoding dominates, but decoding and scaling a 4K source isn't free either
+            job.weight = 0.75 * resolution_weight(width, height) +
+                         0.25 * resolution_weight(job.media.width, job.media.height);
+            if (!renditions.empty()) {
+                job.weight = 0.25 * resolution_weight(job.media.width, job.media.height);
+                for (const auto& rendition : renditions) {
+                    get_output_dimensions(rendition, job.media, width, height);
+                    job.weight += 0.75 * resolution_weight(width, height);
+                }
+            }
+
+            // Concurrent two-pass encodes must not share ffmpeg2pass-0.log
+            if (uses_two_pass(job.params)) {
+                job.params.passlogfile = (fs::temp_directory_path() /
+                    ("hb-ffmpeg-conv-" + std::to_string(getpid()) + "-" + std::to_string(jobs.size()))).string();
+                if (job.params.vcodec == "libx265") {
+                    set_encoder_option(job.params, "stats", job.params.passlogfile + ".x265.log");
+                }
+            }
+        }
+
+        job.run = run_file;
+
+        if (is_clip) {
+            clip_jobs.push_back(jobs.size());
+        }
+        jobs.push_back(job);
+    }
+
+    // Short clips go into batches, one ffmpeg process each; whatever fails
+    // in a batch is retried on its own
+    if (!clip_jobs.empty()) {
+        std::vector<Job> queued;
+        std::vector<Job> pending;
+        auto flush_batch = [&]() {
+            if (pending.size() == 1) {
+                queued.push_back(pending[0]);
+            } else if (!pending.empty()) {
+                Job batch_job;
+                batch_job.input_file = pending[0].input_file + " (+" + std::to_string(pending.size() - 1) +
+                                       " more clips)";
+                batch_job.params = ffmpeg_params;
+                batch_job.exec.cpu_usec = std::make_shared<std::atomic<long long>>(0);
+                batch_job.exec.max_rss = std::make_shared<std::atomic<long long>>(0);
+                batch_job.exec.idle_io = args.io_idle;
+                batch_job.weight = 0.0;
+                batch_job.output_base = pending[0].output_base;
+                for (const auto& member : pending) {
+                    batch_job.devices.insert(member.devices.begin(), member.devices.end());
+                    batch_job.cost += member.cost;
+                    batch_job.predicted_cpu += member.predicted_cpu;
+                    batch_job.predicted_bytes += member.predicted_bytes;
+                    batch_job.predicted_rss += member.predicted_rss;
+                    if (member.weight > batch_job.weight) {
+                        batch_job.weight = member.weight;
+                        batch_job.media = member.media;
+                    }
+                }
+                batch_job.batch = pending;
+                batch_job.run = [&](Job& j) {
+                    fs::file_time_type batch_started = fs::file_time_type::clock::now();
+                    auto started = std::chrono::steady_clock::now();
+                    int failed = process_batch(j.batch, args.input_dir, args.output_dir, original_format,
+                                               output_format, args.force_m4v, args.execute, args.dry_run,
+                                               !args.no_underscore_replace, batch_analyze_duration,
+                                               batch_probe_size, args.verbose, j.exec, j.threads);
+
+                    // The clips shared the process; each is recorded with
+                    // its share of the CPU time by cost and of the threads
+                    double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+                    double batch_cost = 0.0;
+                    for (const auto& member : j.batch) {
+                        batch_cost += member.cost;
+                    }
+                    int member_threads = std::max(1, (j.threads > 0 ? j.threads : total_cpus) /
+                                                     static_cast<int>(j.batch.size()));
+                    for (auto& member : j.batch) {
+                        if (member.result == 0 && batch_cost > 0.0 && j.exec.cpu_usec) {
+                            member.concurrency = j.concurrency;
+                            record_speed(member, wall_seconds, *j.exec.cpu_usec / 1e6 * member.cost / batch_cost,
+                                         0.0, member_threads, batch_started, false);
+                        }
+                    }
+
+                    for (auto& member : j.batch) {
+                        if (member.result == 0) {
+                            drop_job_files(member.input_file, batch_started);
+                            continue;
+                        }
+                        member.exec = j.exec;
+                        member.exec.cpu_usec = std::make_shared<std::atomic<long long>>(0);
+                        member.exec.max_rss = std::make_shared<std::atomic<long long>>(0);
+                        member.threads = j.threads;
+                        if (j.threads > 0) {
+                            int width, height;
+                            get_output_dimensions(member.params, member.media, width, height);
+                            apply_thread_budget(member.params, j.threads, width, height);
+                        }
+                        member.result = run_file(member);
+                        if (member.result == 0) {
+                            failed--;
+                        }
+                    }
+                    return failed;
+                };
+                queued.push_back(batch_job);
+            }
+            pending.clear();
+        };
+
+        size_t next_clip = 0;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            if (next_clip < clip_jobs.size() && clip_jobs[next_clip] == i) {
+                next_clip++;
+                pending.push_back(jobs[i]);
+                if (static_cast<int>(pending.size()) >= args.batch_size) {
+                    flush_batch();
+                }
+            } else {
+                queued.push_back(jobs[i]);
+            }
+        }
+        flush_batch();
+        jobs = queued;
+    }
+
+    if (order != "input") {
+        std::stable_sort(jobs.begin(), jobs.end(), [&](const Job& a, const Job& b) {
+            return order == "longest" ? a.cost > b.cost : a.cost < b.cost;
+        });
+        if (args.verbose) {
+            std::cout << "Job order (" << order << " first, estimated cost):" << std::endl;
+            for (const auto& job : jobs) {
+                std::cout << "  " << std::fixed << std::setprecision(0) << job.cost << std::defaultfloat
+                          << "  " << job.input_file << std::endl;
+            }
+        }
+    }
+
+    // What the speed model makes of the plan
+    std::vector<double> predicted;
+    double predicted_total = 0.0;
+    for (const auto& job : jobs) {
+        predicted.push_back(job.predicted_cpu);
+        predicted_total += job.predicted_cpu;
+    }
+    if (!jobs.empty()) {
+        std::cout << "Projected: " << jobs.size() << " jobs, " << std::fixed << std::setprecision(1)
+                  << predicted_total / 3600.0 << std::defaultfloat << " CPU-hours, about "
+                  << format_duration(project_wall_seconds(predicted, args.jobs, total_cpus, model.utilization))
+                  << " on " << total_cpus << " CPUs (" << model_source << ")" << std::endl;
+    }
+
+    // With a deadline, each job's x264/x265 preset is picked when it starts:
+    // faster than the preset asks for when the projected finish is past the
+    // deadline, back to the preset's own when there is slack
+    bool governed = !args.deadline.empty() && renditions.empty();
+    std::chrono::system_clock::time_point deadline;
+    if (!args.deadline.empty()) {
+        if (!parse_deadline(args.deadline, deadline)) {
+            std::cerr << "Error: --deadline must be HH:MM or +DURATION (e.g. +90m)" << std::endl;
+            return 1;
+        }
+        if (!renditions.empty()) {
+            std::cout << "Note: --deadline doesn't adjust ladder encodes" << std::endl;
+        }
+    }
+    auto seconds_to_deadline = [&]() {
+        return std::chrono::duration<double>(deadline - std::chrono::system_clock::now()).count();
+    };
+
+    if (governed && !running && !jobs.empty()) {
+        double projected = project_wall_seconds(predicted, args.jobs, total_cpus, model.utilization);
+        double speedup = seconds_to_deadline() > 0 ? projected / seconds_to_deadline() : 1e9;
+        std::string preset = govern_preset(ffmpeg_params, ffmpeg_params.preset, speedup);
+        std::cout << "Deadline in " << format_duration(seconds_to_deadline()) << ": projected "
+                  << format_duration(projected) << " at preset " << ffmpeg_params.preset;
+        if (preset != ffmpeg_params.preset) {
+            std::cout << ", would start at preset " << preset << " and adjust per job as it goes";
+        }
+        std::cout << std::endl;
+    }
+
+    // Refine the ETA as jobs finish: what is left is scaled by how far off
+    // the predictions for the finished jobs were
+    std::mutex progress_mutex;
+    double finished_predicted = 0.0;
+    double finished_actual = 0.0;
+    double remaining_predicted = predicted_total;
+    double unstarted_predicted = predicted_total;
+    size_t finished_jobs = 0;
+    struct StartedJob {
+        std::chrono::steady_clock::time_point started;
+        double cpu_seconds;
+        int threads;
+    };
+    std::map<const Job*, StartedJob> started_jobs;
+    std::vector<std::string> deadline_report;
+    auto correction = [&]() {
+        return finished_predicted > 0.0 ? finished_actual / finished_predicted : 1.0;
+    };
+
+    // The ETA uses the threads the jobs actually had on average, which
+    // space, memory and device limits can keep below the machine
+    auto run_started = std::chrono::steady_clock::now();
+    auto last_change = run_started;
+    int running_threads = 0;
+    double thread_seconds = 0.0;
+    auto count_threads = [&](int change) {
+        auto now = std::chrono::steady_clock::now();
+        thread_seconds += std::chrono::duration<double>(now - last_change).count() * running_threads;
+        last_change = now;
+        running_threads += change;
+    };
+    auto achieved_threads = [&]() {
+        double elapsed = std::chrono::duration<double>(last_change - run_started).count();
+        return elapsed > 0.0 && thread_seconds > 0.0 ? std::clamp(thread_seconds / elapsed, 1.0, 1.0 * total_cpus)
+                                                     : 1.0 * total_cpus;
+    };
+
+    if (running) {
+        for (auto& job : jobs) {
+            std::function<int(Job&)> run = job.run;
+            job.run = [&, run](Job& j) {
+                int threads = j.threads > 0 ? std::min(j.threads, total_cpus) : total_cpus;
+                {
+                    std::lock_guard<std::mutex> guard(progress_mutex);
+                    count_threads(threads);
+                }
+                if (governed) {
+                    std::lock_guard<std::mutex> guard(progress_mutex);
+                    auto now = std::chrono::steady_clock::now();
+                    double running_left = 0.0;
+                    for (const auto& started : started_jobs) {
+                        double elapsed = std::chrono::duration<double>(now - started.second.started).count();
+                        running_left += std::max(0.0, started.second.cpu_seconds -
+                                                      elapsed * started.second.threads * model.utilization);
+                    }
+
+                    // The speed-up every job from here on needs to make it
+                    double need = unstarted_predicted * correction() + running_left;
+                    double capacity = seconds_to_deadline() * total_cpus * model.utilization;
+                    double speedup = capacity > 0.0 ? need / capacity : 1e9;
+                    std::string preset = govern_preset(j.params, ffmpeg_params.preset, speedup);
+                    unstarted_predicted -= j.predicted_cpu;
+
+                    if (preset != j.params.preset) {
+                        FFmpegParams governed_params = j.params;
+                        governed_params.preset = preset;
+                        double scale = encoder_speed_factor(governed_params) / encoder_speed_factor(j.params);
+                        remaining_predicted += j.predicted_cpu * (scale - 1.0);
+                        j.predicted_cpu *= scale;
+                        j.params.requested_preset = ffmpeg_params.preset;
+                        j.params.preset = preset;
+                        for (auto& member : j.batch) {
+                            member.params.requested_preset = ffmpeg_params.preset;
+                            member.params.preset = preset;
+                        }
+                        std::ostringstream line;
+                        line << j.input_file << ": preset " << ffmpeg_params.preset << " -> " << preset << " ("
+                             << std::fixed << std::setprecision(1) << 1.0 / scale
+                             << "x faster, larger output or lower quality at the same rate control)";
+                        deadline_report.push_back(line.str());
+                        std::cout << "Deadline: " << line.str() << std::endl;
+                    }
+                    started_jobs[&j] = {now, j.predicted_cpu * correction(), j.threads > 0 ? j.threads : total_cpus};
+                }
+
+                int result = run(j);
+
+                std::lock_guard<std::mutex> guard(progress_mutex);
+                count_threads(-threads);
+                started_jobs.erase(&j);
+                finished_jobs++;
+                remaining_predicted -= j.predicted_cpu;
+                if (result == 0 && j.exec.cpu_usec && *j.exec.cpu_usec > 0) {
+                    finished_predicted += j.predicted_cpu;
+                    finished_actual += *j.exec.cpu_usec / 1e6;
+                }
+                std::cout << "Progress: " << finished_jobs << " of " << jobs.size() << " jobs done";
+                if (finished_jobs < jobs.size()) {
+                    std::cout << ", ETA " << format_duration(std::max(0.0, remaining_predicted) * correction() /
+                                                             (achieved_threads() * model.utilization));
+                }
+                std::cout << std::endl;
+                return result;
+            };
+        }
+    }
+
+    // Process the queue
+    SchedulerOptions scheduler;
+    scheduler.max_jobs = args.jobs;
+    scheduler.total_cpus = total_cpus;
+    scheduler.prefetch_inputs = running;
+    // Inputs the stage copies are read from scratch; only those it leaves
+    // in place are worth reading ahead
+    scheduler.reads_local = [&](const Job& job) {
+        if (!stage) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(stage->mutex);
+        auto staged = stage->staged.find(job.input_file);
+        if (staged != stage->staged.end()) {
+            return !staged->second.empty();
+        }
+        return std::find(stage->queue.begin(), stage->queue.end(), job.input_file) != stage->queue.end();
+    };
+    // The stage copies inputs in the order their jobs start, and a job
+    // that fails up front gives back the room kept for it
+    scheduler.on_next = [&](const Job& job) {
+        if (stage) {
+            promote_stage(*stage, job.input_file);
+        }
+    };
+    scheduler.on_rejected = [&](const Job& job) {
+        if (stage) {
+            release_stage(*stage, job.input_file);
+        }
+    };
+    // A staged job writes to scratch until its outputs are moved; the
+    // name there comes from the staged copy, like in run_file
+    scheduler.writes_to = [&](const Job& job) {
+        if (!stage) {
+            return job.output_base;
+        }
+        std::lock_guard<std::mutex> guard(stage->mutex);
+        auto dir = stage->output_dirs.find(job.input_file);
+        auto staged = stage->staged.find(job.input_file);
+        if (dir == stage->output_dirs.end() || (staged != stage->staged.end() && staged->second.empty())) {
+            return job.output_base;
+        }
+        fs::path in = fs::path(stage->dir) / "in";
+        return get_output_base((in / staged_path(job.input_file, stage->input_root)).string(), in.string(),
+                               dir->second, !args.no_underscore_replace).string();
+    };
+    scheduler.max_per_device = args.per_device;
+    scheduler.label_output = args.jobs > 1;
+    scheduler.verbose = args.verbose;
+
+    if (args.jobs > 1) {
+        std::cout << "Running up to " << args.jobs << " jobs concurrently on " << scheduler.total_cpus << " CPUs" << std::endl;
+        if (args.per_device > 0) {
+            std::set<unsigned long long> devices;
+            for (const auto& job : jobs) {
+                devices.insert(job.devices.begin(), job.devices.end());
+            }
+            std::cout << "At most " << args.per_device << " job" << (args.per_device > 1 ? "s" : "")
+                      << " per spinning disk, " << devices.size() << " in use" << std::endl;
+        }
+
+        // What is available now, before our jobs; page cache counts as available
+        std::string memory_source = "--memory";
+        scheduler.memory_budget = args.memory_gb > 0 ? static_cast<uintmax_t>(args.memory_gb * 1e9)
+                                : static_cast<uintmax_t>(get_available_memory(memory_source) * 0.9);
+        if (scheduler.memory_budget > 0) {
+            uintmax_t largest = 0;
+            for (const auto& job : jobs) {
+                largest = std::max(largest, job.predicted_rss);
+            }
+            std::cout << "Memory budget: " << format_number(scheduler.memory_budget / 1e9, 1) << " GB ("
+                      << memory_source << "), largest job about " << format_number(largest / 1e9, 1) << " GB"
+                      << std::endl;
+        }
+        if (args.affinity) {
+            scheduler.pin_cpus = true;
+            scheduler.topology = read_cpu_topology();
+            std::set<int> caches;
+            for (const auto& cpu : scheduler.topology.l3_of) {
+                caches.insert(cpu.second);
+            }
+            std::cout << "CPU affinity enabled: " << scheduler.topology.cpus.size() << " CPUs in "
+                      << scheduler.topology.node_count << " NUMA node(s), " << caches.size()
+                      << " L3 domain(s)" << std::endl;
+        }
+    }
+
+    // Inputs are copied to scratch in job order while earlier jobs encode
+    std::thread stager;
+    if (!args.scratch_dir.empty()) {
+        stage = std::make_unique<ScratchStage>();
+        stage->dir = (fs::path(args.scratch_dir) / ("hb-ffmpeg-conv-" + std::to_string(getpid()))).string();
+        stage->input_root = args.input_dir;
+        stage->idle_io = args.io_idle;
+        std::error_code ec;
+        stage->budget = args.scratch_gb > 0 ? static_cast<uintmax_t>(args.scratch_gb * 1e9)
+                      : static_cast<uintmax_t>(fs::space(args.scratch_dir, ec).available * 0.9);
+        for (const auto& job : jobs) {
+            if (job.batch.empty()) {
+                stage->output_dirs[job.input_file] =
+                    (fs::path(stage->dir) / "out" / std::to_string(stage->queue.size())).string();
+                stage->queue.push_back(job.input_file);
+            }
+        }
+        std::cout << (running ? "Staging through " : "[DRY RUN] Would stage through ") << stage->dir << ", up to "
+                  << std::fixed << std::setprecision(1) << stage->budget / 1e9 << std::defaultfloat << " GB"
+                  << std::endl;
+        if (running) {
+            stager = std::thread(stage_inputs, std::ref(*stage), args.verbose);
         } else {
-            error_count++;
-            std::cout << "Failed to process: " << file << std::endl;
+            stage.reset();
+        }
+    }
+
+    run_job_queue(jobs, scheduler);
+
+    if (stager.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(stage->mutex);
+            stage->stop = true;
+            stage->changed.notify_all();
+        }
+        stager.join();
+        // Outputs that could not be moved stay behind
+        std::error_code ec;
+        fs::remove_all(fs::path(stage->dir) / "in", ec);
+        fs::remove(fs::path(stage->dir) / "out", ec);
+        fs::remove(stage->dir, ec);
+    }
+
+    for (const auto& job : jobs) {
+        for (const auto& member : job.batch.empty() ? std::vector<Job>{job} : job.batch) {
+            if (member.result == 0) {
+                file_count++;
+            } else {
+                error_count++;
+                std::cout << "Failed to process: " << member.input_file << std::endl;
+            }
+        }
+    }
+
+    if (governed && running) {
+        double spare = seconds_to_deadline();
+        std::cout << "Deadline " << (spare >= 0 ? "met with " + format_duration(spare) + " to spare"
+                                                : "missed by " + format_duration(-spare)) << std::endl;
+        if (deadline_report.empty()) {
+            std::cout << "  All files kept preset " << ffmpeg_params.preset << std::endl;
+        }
+        for (const auto& line : deadline_report) {
+            std::cout << "  " << line << std::endl;
         }
     }
 
@@ -1019,6 +7839,7 @@ int main(int argc, char* argv[]) {
     // Restore cout buffer if logging was enabled
     if (cout_buffer != nullptr) {
         std::cout.rdbuf(cout_buffer);
+        log_output.reset();
         log_file.close();
     }
 